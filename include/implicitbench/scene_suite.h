@@ -0,0 +1,27 @@
+#pragma once
+#include <string>
+#include <stdint.h>
+
+namespace scene_suite
+{
+    struct options
+    {
+        std::string scriptDir; // Every .lua file in it is a scene.
+        std::string goldenDir; // Holds a <scene>.png per scene.
+        std::string resultsPath; // JSON file of the results, not written if empty.
+        uint32_t size = 512; // Width and height of the images.
+        size_t runs = 3; // Traces of every scene, after the first one.
+        uint32_t channelTolerance = 8; // Largest difference of a channel for pixels to be the same.
+        double pixelTolerance = 0.001; // Largest fraction of pixels that can differ from the golden image.
+        bool update = false; // Whether to write the golden images instead of comparing to them.
+    };
+
+    /**
+     * \brief Runs every scene script headless, renders it with the default camera of the window and compares it
+     * to its golden image. The golden images are only written with update. The rays per second, the mean
+     * iterations per pixel and the times of every scene are printed, and written to the results file.
+     * \return size_t The number of scenes that failed: their scripts failed, they have no golden image, or they
+     * differ from it.
+     */
+    size_t run(const options& opts);
+}
@@ -19,12 +19,28 @@ extern "C" {
 
 #include <algorithm>
 #include <glm/glm.hpp>
+#include <implicitkernel/mapped_file.h>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 constexpr size_t MAX_ENTITY_COUNT = 32;
+/* Unions with at least these many finite simple operands are evaluated using a
+ * bounding volume hierarchy. */
+constexpr size_t BVH_MIN_PRIMITIVES = 8;
+constexpr size_t BVH_LEAF_SIZE = 4;
+/* Sections of a compiled scene file start at multiples of this many bytes. */
+constexpr size_t SCENE_ALIGNMENT = 4096;
+/* Changes whenever the layout of the render data changes. */
+constexpr uint32_t SCENE_VERSION = 3;
+/* Upper limit of the number of cells in the grid of a beam lattice. */
+constexpr size_t LATTICE_MAX_CELLS = 1 << 22;
+/* Upper limit of the number of planes of a convex polytope. */
+constexpr size_t POLYTOPE_MAX_PLANES = 1024;
 
 namespace entities {
 struct entity;
@@ -34,6 +50,95 @@ struct entity;
  */
 typedef std::shared_ptr<entity> ent_ref;
 
+/**
+ * \brief State of the linearization of an entity into render data. Transforms
+ * are not evaluated as steps. Instead, they are pushed onto the context while
+ * their child is written, and every simple entity written under them is
+ * wrapped by an ENT_TYPE_XFORM entity that maps the sample point. The wrappers
+ * share the bytes of the simple entity they wrap.
+ */
+struct render_context {
+  /**
+   * \brief The value indices of the simple entities written under the current
+   * transforms.
+   */
+  std::unordered_map<entity *, uint32_t> *regMap;
+  /**
+   * \brief The point ops of the current transforms, outermost first.
+   */
+  std::vector<point_op> ops;
+  /**
+   * \brief Converts distances in the current space to world distances.
+   */
+  float dist_scale = 1.0f;
+  /**
+   * \brief Maps the current space to the world. Only valid if affine is set.
+   */
+  glm::mat4 to_world = glm::mat4(1.0f);
+  /**
+   * \brief Set when the current space is not folded by a pattern.
+   */
+  bool affine = true;
+  /**
+   * \brief The byte offsets of the simple entities whose bytes were written.
+   */
+  std::unordered_map<const entity *, size_t> byteOffsets;
+
+  render_context();
+  render_context(const render_context &) = delete;
+  const render_context &operator=(const render_context &) = delete;
+
+  /**
+   * \brief Enters the space of the child of a transform.
+   * \param node The transform entity.
+   * \param toParent Maps the space of the child to the current space. It must
+   * be an invertible affine transform.
+   */
+  void push_affine(const entity *node, const glm::mat4 &toParent);
+  /**
+   * \brief Enters the space of one candidate copy of a pattern.
+   * \param node The pattern entity.
+   * \param variant The index of the candidate.
+   * \param op Folds the current space into the space of the candidate.
+   */
+  void push_fold(const entity *node, uint32_t variant, const point_op &op);
+  /**
+   * \brief Returns to the space before the last push.
+   */
+  void pop();
+  /**
+   * \brief Maps the distances and points of an operation to the world.
+   */
+  op_defn world_op(op_defn op) const;
+  /**
+   * \brief Writes an entity that evaluates the given simple entity at the
+   * sample point mapped by the current transforms.
+   * \param innerOffset The byte offset of the simple entity, already written.
+   * \param innerType The type of the simple entity.
+   * \param innerBytes The bytes of the simple entity. These are only read if
+   * it is already wrapped, in which case the wrappers are merged.
+   */
+  void write_wrapper(uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types,
+                     size_t &currentOffset, size_t innerOffset,
+                     uint8_t innerType, const uint8_t *innerBytes) const;
+
+private:
+  struct frame {
+    float dist_scale;
+    glm::mat4 to_world;
+    bool affine;
+    std::unordered_map<entity *, uint32_t> *regMap;
+  };
+  typedef std::vector<std::pair<const entity *, uint32_t>> scope_key;
+  std::vector<frame> m_frames;
+  scope_key m_scope;
+  // One map per distinct chain of transforms, so entities shared inside a
+  // transformed entity are written once.
+  std::map<scope_key, std::unordered_map<entity *, uint32_t>> m_regMaps;
+  void push(const entity *node, uint32_t variant, const point_op &op,
+            float distScale, const glm::mat4 &toParent);
+};
+
 /**
  * \brief Base type for all entities.
  */
@@ -55,6 +160,23 @@ public:
    */
   virtual bool simple() const = 0;
 
+  /**
+   * \brief Gets the axis aligned bounds of the entity, if it is finite.
+   * \param min Will be set to the minimum corner of the bounds.
+   * \param max Will be set to the maximum corner of the bounds.
+   * \return true If the entity is finite and the bounds were computed.
+   * \return false If the entity is not finite.
+   */
+  virtual bool bounds(glm::vec3 &min, glm::vec3 &max) const;
+
+  /**
+   * \brief Appends all the simple entities this entity is made of, including
+   * the ones nested inside other simple entities. Shared entities are appended
+   * as many times as they are referenced.
+   * \param ents The simple entities are appended to this vector.
+   */
+  virtual void collect_simple(std::vector<entity *> &ents) = 0;
+
   /**
    * \brief Gets the size of the render data to be copied to the device.
    * \param nBytes Will be set to the size of the render data in bytes.
@@ -81,15 +203,23 @@ public:
    * buffer). \param types The types of simple entities. \param steps The csg
    * steps to be performed on the simple entities. \param entityIndex For
    * internal use. \param currentOffset For internal use. \param reg For
-   * internal use.
+   * internal use. \param ctx For internal use.
    */
   virtual void copy_render_data_internal(
       uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types, op_step *&steps,
       size_t &entityIndex, size_t &currentOffset, uint32_t reg,
-      std::unordered_map<entity *, uint32_t> &regMap) const = 0;
+      render_context &ctx) const = 0;
 
+  /**
+   * \brief Accumulates the size of the render data.
+   * \param nBytes The size of the render bytes.
+   * \param nEntities The number of simple entities that are never shared,
+   * such as the ones inside a compiled entity.
+   * \param nSteps The number of csg steps.
+   * \param simpleEntities The simple entities, which may be shared.
+   */
   virtual void render_data_size_internal(
-      size_t &nBytes, size_t &nSteps,
+      size_t &nBytes, size_t &nEntities, size_t &nSteps,
       std::unordered_set<entity *> &simpleEntities) const = 0;
 
   /**
@@ -107,12 +237,16 @@ public:
 /**
  * \brief Represents a compound entity that combines two elements
  * with an operation. The operation can be either a boolean operation or a
- * blending operation.
+ * blending operation. A union or intersection can also combine any number of
+ * operands, in which case the operands are used instead of left and right.
  */
 struct comp_entity : public entity {
   ent_ref left;
   ent_ref right;
+  std::vector<ent_ref> operands;
   op_defn op;
+  glm::mat4 xform = glm::mat4(1.0f); // Maps the child of a transform.
+  point_op fold = {};                 // Folds the space of a pattern.
 
 private:
   /**
@@ -128,16 +262,42 @@ private:
    */
   comp_entity(ent_ref, op_defn op);
 
+  /**
+   * \brief Construct a new comp entity object by combining any number of
+   * entities with a union or intersection. \param ents The operands. \param op
+   * The operation.
+   */
+  comp_entity(const std::vector<ent_ref> &ents, op_defn op);
+
+  void copy_nary_render_data(uint8_t *&bytes, uint32_t *&offsets,
+                             uint8_t *&types, op_step *&steps,
+                             size_t &entityIndex, size_t &currentOffset,
+                             uint32_t reg,
+                             render_context &ctx) const;
+  void copy_transformed_render_data(uint8_t *&bytes, uint32_t *&offsets,
+                                    uint8_t *&types, op_step *&steps,
+                                    size_t &entityIndex, size_t &currentOffset,
+                                    uint32_t reg, render_context &ctx) const;
+  void copy_pattern_render_data(uint8_t *&bytes, uint32_t *&offsets,
+                                uint8_t *&types, op_step *&steps,
+                                size_t &entityIndex, size_t &currentOffset,
+                                uint32_t reg, render_context &ctx) const;
+  uint32_t num_candidates() const;
+  point_op candidate(uint32_t variant) const;
+  static ent_ref make_pattern(ent_ref ent, const point_op &fold);
+
 public:
   virtual bool simple() const;
   virtual uint8_t type() const;
+  virtual bool bounds(glm::vec3 &min, glm::vec3 &max) const;
+  virtual void collect_simple(std::vector<entity *> &ents);
   virtual void
-  render_data_size_internal(size_t &nBytes, size_t &nSteps,
+  render_data_size_internal(size_t &nBytes, size_t &nEntities, size_t &nSteps,
                             std::unordered_set<entity *> &simpleEntities) const;
   virtual void copy_render_data_internal(
       uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types, op_step *&steps,
       size_t &entityIndex, size_t &currentOffset, uint32_t reg,
-      std::unordered_map<entity *, uint32_t> &regMap) const;
+      render_context &ctx) const;
 
   comp_entity(const comp_entity &) = delete;
   const comp_entity &operator=(const comp_entity &) = delete;
@@ -177,6 +337,18 @@ public:
     return make_csg(l, r, opdef);
   };
 
+  /**
+   * \brief Creates a single compound entity on the heap that combines all the
+   * given entities with a union or an intersection. The simple operands are
+   * folded by a single csg step, instead of a chain of binary steps. When many
+   * of the operands of a plain union are finite simple entities, they are
+   * replaced by a single bvh_union entity.
+   * \param ents The entities to be combined.
+   * \param op The operation, must be a union or an intersection.
+   * \return ent_ref The reference to the new entity.
+   */
+  static ent_ref make_nary(const std::vector<ent_ref> &ents, op_defn op);
+
   /**
    * \brief Creates a new entity on the heap by applying an offset operation
    * to the given entity.
@@ -230,6 +402,56 @@ public:
     };
     return ent_ref(new comp_entity(l, r, op));
   };
+
+  /**
+   * \brief Creates a new entity on the heap by applying an affine transform to
+   * the given entity. The sample point is mapped into the space of the entity
+   * before it is evaluated, so all the transformed copies of an entity share
+   * its render data.
+   * \param ent The entity.
+   * \param xform Maps the entity to its new placement. It must be an
+   * invertible affine transform.
+   * \return ent_ref The reference to the new entity.
+   */
+  static ent_ref make_transform(ent_ref ent, const glm::mat4 &xform);
+
+  /**
+   * \brief Creates a new entity on the heap that repeats the given entity
+   * along a line. The sample point is folded into the nearest copy, so the
+   * cost does not depend on the number of copies. The entity is expected to
+   * fit within one step of its copy, so that only the nearest copy and its
+   * neighbor need to be evaluated.
+   * \param ent The entity.
+   * \param step The offset between consecutive copies.
+   * \param count The number of copies.
+   * \return ent_ref The reference to the new entity.
+   */
+  static ent_ref make_linear_pattern(ent_ref ent, glm::vec3 step,
+                                     uint32_t count);
+
+  /**
+   * \brief Creates a new entity on the heap that repeats the given entity on
+   * an axis aligned grid, starting at the entity. As with the linear pattern,
+   * the entity is expected to fit within one cell of the grid.
+   * \param ent The entity.
+   * \param spacing The distance between the copies along each axis.
+   * \param counts The number of copies along each axis.
+   * \return ent_ref The reference to the new entity.
+   */
+  static ent_ref make_grid_pattern(ent_ref ent, glm::vec3 spacing,
+                                   const uint32_t (&counts)[3]);
+
+  /**
+   * \brief Creates a new entity on the heap that repeats the given entity at
+   * equal angles around an axis through the origin. The entity is expected to
+   * fit within the angle between two copies.
+   * \param ent The entity.
+   * \param axis The axis of rotation.
+   * \param count The number of copies.
+   * \return ent_ref The reference to the new entity.
+   */
+  static ent_ref make_polar_pattern(ent_ref ent, glm::vec3 axis,
+                                    uint32_t count);
 };
 
 /**
@@ -238,21 +460,23 @@ public:
  */
 struct simp_entity : public entity {
   const simp_entity &operator=(const simp_entity &) = delete;
+  friend struct bvh_union;
 
 protected:
   simp_entity() = default;
   virtual ~simp_entity() = default;
 
   virtual bool simple() const;
+  virtual void collect_simple(std::vector<entity *> &ents);
   virtual void
-  render_data_size_internal(size_t &nBytes, size_t &nSteps,
+  render_data_size_internal(size_t &nBytes, size_t &nEntities, size_t &nSteps,
                             std::unordered_set<entity *> &simpleEntities) const;
   virtual size_t num_render_bytes() const = 0;
   virtual void write_render_bytes(uint8_t *&bytes) const = 0;
   virtual void copy_render_data_internal(
       uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types, op_step *&steps,
       size_t &entityIndex, size_t &currentOffset, uint32_t reg,
-      std::unordered_map<entity *, uint32_t> &regMap) const;
+      render_context &ctx) const;
 };
 
 /**
@@ -274,6 +498,7 @@ struct box3 : public simp_entity {
        float zhalf);
 
   virtual uint8_t type() const;
+  virtual bool bounds(glm::vec3 &min, glm::vec3 &max) const;
   virtual size_t num_render_bytes() const;
   virtual void write_render_bytes(uint8_t *&bytes) const;
 };
@@ -294,6 +519,7 @@ struct sphere3 : public simp_entity {
   sphere3(float xcenter, float ycenter, float zcenter, float radius);
 
   virtual uint8_t type() const;
+  virtual bool bounds(glm::vec3 &min, glm::vec3 &max) const;
   virtual size_t num_render_bytes() const;
   virtual void write_render_bytes(uint8_t *&bytes) const;
 };
@@ -319,6 +545,7 @@ struct cylinder3 : public simp_entity {
             float radius);
 
   virtual uint8_t type() const;
+  virtual bool bounds(glm::vec3 &min, glm::vec3 &max) const;
   virtual size_t num_render_bytes() const;
   virtual void write_render_bytes(uint8_t *&bytes) const;
 };
@@ -378,6 +605,290 @@ struct halfspace : public simp_entity {
   virtual void write_render_bytes(uint8_t *&bytes) const;
 };
 
+/**
+ * \brief Union of many finite simple entities, evaluated by descending a
+ * bounding volume hierarchy built over their bounds. Only the primitives in
+ * the nodes closer than the current minimum distance are evaluated.
+ */
+struct bvh_union : public simp_entity {
+  std::vector<ent_ref> primitives; // Ordered as referenced by the leaves.
+  std::vector<bvh_node> nodes;
+  /**
+   * \brief Construct a new bvh union object
+   * \param prims The operands of the union. These must be simple entities with
+   * finite bounds.
+   */
+  bvh_union(const std::vector<ent_ref> &prims);
+
+  virtual uint8_t type() const;
+  virtual bool bounds(glm::vec3 &min, glm::vec3 &max) const;
+  virtual void collect_simple(std::vector<entity *> &ents);
+  virtual size_t num_render_bytes() const;
+  virtual void write_render_bytes(uint8_t *&bytes) const;
+
+private:
+  size_t m_numBytes;
+};
+
+/**
+ * \brief Builds a bounding volume hierarchy over the given boxes, by splitting
+ * at the median centroid along the longest axis.
+ * \param mins The minimum corners of the boxes.
+ * \param maxs The maximum corners of the boxes.
+ * \param order Receives the indices of the boxes in the order they are
+ * referenced by the leaves.
+ * \param leafSize The largest number of boxes in a leaf.
+ * \return std::vector<bvh_node> The nodes, root first. The children of a node
+ * are next to each other.
+ */
+std::vector<bvh_node> build_bvh(const std::vector<glm::vec3> &mins,
+                                const std::vector<glm::vec3> &maxs,
+                                std::vector<uint32_t> &order,
+                                size_t leafSize = BVH_LEAF_SIZE);
+
+/**
+ * \brief Union of many capsule shaped struts sharing the same radius. The
+ * edges are hashed into a uniform grid, so only the struts in the cells near a
+ * point are evaluated.
+ */
+struct beam_lattice : public simp_entity {
+  std::vector<glm::vec3> nodes;
+  std::vector<uint32_t> edges; // Pairs of node indices.
+  float radius;
+  /**
+   * \brief Construct a new beam lattice object
+   * \param nodes The positions of the nodes.
+   * \param edges Pairs of indices into the nodes, one pair per strut.
+   * \param radius The radius of the struts.
+   */
+  beam_lattice(const std::vector<glm::vec3> &nodes,
+               const std::vector<uint32_t> &edges, float radius);
+
+  virtual uint8_t type() const;
+  virtual bool bounds(glm::vec3 &min, glm::vec3 &max) const;
+  virtual size_t num_render_bytes() const;
+  virtual void write_render_bytes(uint8_t *&bytes) const;
+
+private:
+  glm::vec3 m_min;
+  glm::vec3 m_max;
+  float m_cellSize;
+  uint32_t m_dims[3];
+  std::vector<uint32_t> m_cellStarts;
+  std::vector<uint32_t> m_cellEdges;
+  void build_grid();
+};
+
+/**
+ * \brief Convex polytope, the intersection of the halfspaces behind its planes.
+ * The distance is the largest signed distance to the planes, which is exact
+ * inside and a lower bound outside.
+ */
+struct polytope : public simp_entity {
+  std::vector<glm::vec4> planes; // Outward unit normal and offset along it.
+  /**
+   * \brief Construct a new polytope object. Duplicate planes are removed.
+   * \param planes The normal and the offset of each plane. The polytope is on
+   * the side opposite to the normal, i.e. dot(normal, p) <= offset.
+   */
+  polytope(const std::vector<glm::vec4> &planes);
+  /**
+   * \brief Creates the convex hull of the given points.
+   * \param points The points, at least four of which must not be coplanar.
+   * \return std::shared_ptr<polytope> The hull.
+   */
+  static std::shared_ptr<polytope> hull(const std::vector<glm::vec3> &points);
+
+  virtual uint8_t type() const;
+  virtual bool bounds(glm::vec3 &min, glm::vec3 &max) const;
+  virtual size_t num_render_bytes() const;
+  virtual void write_render_bytes(uint8_t *&bytes) const;
+
+private:
+  bool m_bounded;
+  glm::vec3 m_min;
+  glm::vec3 m_max;
+};
+
+/**
+ * \brief Closed triangle mesh. The sign of the distance comes from the angle
+ * weighted pseudo-normal of the closest vertex, edge or face, so the mesh is
+ * expected to be watertight and consistently oriented.
+ */
+struct mesh : public simp_entity {
+  std::vector<glm::vec3> vertices;
+  std::vector<glm::vec3> vertex_normals;
+  std::vector<mesh_tri> triangles; // Ordered as referenced by the leaves.
+  std::vector<bvh_node> nodes;
+  /**
+   * \brief Construct a new mesh object. Coincident vertices are welded and
+   * degenerate triangles are removed.
+   * \param verts The vertex positions.
+   * \param tris Three vertex indices per triangle.
+   */
+  mesh(const std::vector<glm::vec3> &verts, const std::vector<uint32_t> &tris);
+  /**
+   * \brief Loads a binary or ascii STL, or an OBJ file.
+   * \param path The path of the file.
+   * \return std::shared_ptr<mesh> The mesh.
+   */
+  static std::shared_ptr<mesh> load(const std::string &path);
+  /**
+   * \brief Computes the signed distance from the given point on the host.
+   */
+  float distance(const glm::vec3 &pt) const;
+
+  virtual uint8_t type() const;
+  virtual bool bounds(glm::vec3 &min, glm::vec3 &max) const;
+  virtual size_t num_render_bytes() const;
+  virtual void write_render_bytes(uint8_t *&bytes) const;
+};
+
+/**
+ * \brief Signed distances sampled on a regular grid, interpolated trilinearly.
+ */
+struct distance_grid : public simp_entity {
+  glm::vec3 origin;
+  float spacing;
+  uint32_t dims[3];
+  std::vector<float> values; // x varies fastest.
+  /**
+   * \brief Samples the distance field of the mesh on a grid that covers its
+   * bounds with a small margin.
+   * \param m The mesh.
+   * \param resolution The number of cells along the longest side of the mesh.
+   * \return std::shared_ptr<distance_grid> The grid.
+   */
+  static std::shared_ptr<distance_grid> bake(const mesh &m,
+                                             uint32_t resolution);
+
+  virtual uint8_t type() const;
+  virtual bool bounds(glm::vec3 &min, glm::vec3 &max) const;
+  virtual size_t num_render_bytes() const;
+  virtual void write_render_bytes(uint8_t *&bytes) const;
+};
+
+/**
+ * \brief Header of the sparse voxel brick file. It is followed by brick_count
+ * brick coordinates (3 x uint32_t, in units of bricks), and then by the bricks
+ * in the same order. Each brick has brick_size^3 samples, x varying fastest.
+ * Voxels not covered by any brick have the background value.
+ */
+struct voxel_brick_header {
+  char magic[4]; // "IVBK"
+  uint32_t version;
+  uint32_t dims[3];
+  float origin[3];
+  float spacing;
+  uint32_t brick_size;
+  uint32_t value_bytes; // 4 for float, 2 for half samples.
+  float background;
+  uint32_t brick_count;
+};
+
+/**
+ * \brief Signed distance samples read from a memory mapped file. The samples
+ * are not copied on the host, the whole grid is uploaded to the voxel atlas
+ * image straight from the mapping when the entity is shown.
+ */
+struct voxelgrid : public simp_entity {
+  glm::vec3 origin;
+  float spacing;
+  uint32_t dims[3];
+  uint32_t value_bytes;    // 4 for float, 2 for half samples.
+  uint32_t brick_size = 0; // Zero for dense grids.
+  uint32_t brick_count = 0;
+  float background = 0.0f;
+  const uint32_t *brick_coords = nullptr; // Into the mapped file.
+  const uint8_t *values = nullptr;        // Into the mapped file.
+  uint32_t atlas_origin[3] = {0, 0, 0}; // Assigned by the viewer before the upload.
+  /**
+   * \brief Maps a dense grid of float or half samples, x varying fastest. The
+   * sample type is deduced from the size of the file.
+   * \param path The path of the file.
+   * \param dims The number of samples along each axis.
+   * \param origin The position of the first sample.
+   * \param spacing The distance between neighbouring samples.
+   * \return std::shared_ptr<voxelgrid> The grid.
+   */
+  static std::shared_ptr<voxelgrid> load_raw(const std::string &path,
+                                             const uint32_t (&dims)[3],
+                                             glm::vec3 origin, float spacing);
+  /**
+   * \brief Maps a sparse voxel brick file (see voxel_brick_header).
+   */
+  static std::shared_ptr<voxelgrid> load_bricks(const std::string &path);
+
+  virtual uint8_t type() const;
+  virtual bool bounds(glm::vec3 &min, glm::vec3 &max) const;
+  virtual size_t num_render_bytes() const;
+  virtual void write_render_bytes(uint8_t *&bytes) const;
+
+private:
+  std::shared_ptr<util::mapped_file> m_file;
+};
+
+/**
+ * \brief Header of a compiled scene file. It is followed by the packed bytes,
+ * types, offsets and steps of the render data, each starting at a multiple of
+ * SCENE_ALIGNMENT from the start of the file.
+ */
+struct scene_header {
+  char magic[4]; // "ISCN"
+  uint32_t version;
+  uint32_t num_entities;
+  uint32_t num_steps;
+  uint32_t num_registers; // The number of registers used by the steps.
+  uint32_t has_bounds;
+  float bounds[6];
+  uint64_t num_bytes;
+  uint64_t bytes_offset;
+  uint64_t types_offset;
+  uint64_t offsets_offset;
+  uint64_t steps_offset;
+};
+
+/**
+ * \brief Entity backed by the render data of a memory mapped scene file. The
+ * render data is used as is, or appended to the render data of the entities it
+ * is combined with, after moving its indices past theirs.
+ */
+struct compiled_entity : public entity {
+  scene_header header;
+  const uint8_t *bytes = nullptr;
+  const uint8_t *types = nullptr;
+  const uint32_t *offsets = nullptr;
+  const op_step *steps = nullptr;
+
+  /**
+   * \brief Maps a scene file written by save.
+   * \param path The path of the scene file.
+   * \return std::shared_ptr<compiled_entity> The entity.
+   */
+  static std::shared_ptr<compiled_entity> load(const std::string &path);
+  /**
+   * \brief Linearizes the entity and writes its render data to a scene file.
+   * \param ent The entity.
+   * \param path The path of the scene file.
+   */
+  static void save(const ent_ref &ent, const std::string &path);
+
+  virtual uint8_t type() const;
+  virtual bool simple() const;
+  virtual bool bounds(glm::vec3 &min, glm::vec3 &max) const;
+  virtual void collect_simple(std::vector<entity *> &ents);
+  virtual void
+  render_data_size_internal(size_t &nBytes, size_t &nEntities, size_t &nSteps,
+                            std::unordered_set<entity *> &simpleEntities) const;
+  virtual void copy_render_data_internal(
+      uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types, op_step *&steps,
+      size_t &entityIndex, size_t &currentOffset, uint32_t reg,
+      render_context &ctx) const;
+
+private:
+  std::shared_ptr<util::mapped_file> m_file;
+};
+
 template <size_t N> struct polyface : public simp_entity {
   std::array<glm::vec3, N> vertices;
 
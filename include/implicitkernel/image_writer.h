@@ -0,0 +1,141 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <fstream>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace util
+{
+    /**
+     * \brief Writes an image file a band of rows at a time, so the whole image never has to be in memory. The
+     * rows are given in the order they are stored in the file, which is from the top of the image unless
+     * bottom_up() is true. The pixels are packed the way the render kernels write them, with the bytes in the
+     * order red, green, blue, alpha. Throws if the file cannot be written.
+     */
+    class image_writer
+    {
+    protected:
+        std::ofstream m_fileStream; // Not opened when writing to the standard output.
+        std::ostream& m_file;
+        uint32_t m_width;
+        uint32_t m_height;
+        uint32_t m_rowsWritten = 0;
+        std::vector<uint8_t> m_row; // Scratch space for converting one row.
+
+        image_writer(const std::string& path, uint32_t width, uint32_t height);
+        /**
+         * \brief Converts one row of pixels into the format of the file, and writes it.
+         */
+        virtual void write_row(const uint32_t* pixels) = 0;
+        /**
+         * \brief Writes whatever the format needs after the last row.
+         */
+        virtual void write_end();
+
+    public:
+        /**
+         * \brief Creates the writer for the format given by the extension of the path. The formats are .bmp,
+         * .ppm, .png and .pfm, which holds the colors as floats. The header is written right away.
+         */
+        static std::unique_ptr<image_writer> create(const std::string& path, uint32_t width, uint32_t height);
+        /**
+         * \brief Creates the writer of a Y4M video. The frames are given one after the other, as the rows of an
+         * image that is nFrames times as tall as a frame.
+         * \param path A .y4m file, or - for the standard output.
+         */
+        static std::unique_ptr<image_writer> create_video(const std::string& path, uint32_t width, uint32_t height,
+            uint32_t nFrames);
+        /**
+         * \brief Whether create_video should be used for the path.
+         */
+        static bool is_video(const std::string& path);
+        virtual ~image_writer() = default;
+
+        image_writer(const image_writer&) = delete;
+        const image_writer& operator=(const image_writer&) = delete;
+
+        uint32_t width() const;
+        uint32_t height() const;
+        /**
+         * \brief Whether the file stores the rows from the bottom of the image.
+         */
+        virtual bool bottom_up() const;
+        /**
+         * \brief Appends rows to the image.
+         * \param pixels The first row.
+         * \param nRows The number of rows.
+         * \param stride Pixels from the start of one row to the start of the next, negative if the rows are
+         * stored the other way up in memory.
+         */
+        void write_rows(const uint32_t* pixels, uint32_t nRows, ptrdiff_t stride);
+        void write_rows(const uint32_t* pixels, uint32_t nRows);
+        /**
+         * \brief Finishes the file. Throws if any rows are missing.
+         */
+        void close();
+    };
+
+    /**
+     * \brief Reads an image written by image_writer, or any .ppm or .png with 8 bit channels, into pixels packed
+     * like the ones of the render kernels, from the top row down. Throws if the file cannot be read.
+     */
+    std::vector<uint32_t> read_image(const std::string& path, uint32_t& width, uint32_t& height);
+
+    /**
+     * \brief Feeds an image writer from a background thread, so the rows are encoded while the caller goes on
+     * with the next ones. The memory of the rows must stay valid until they are written, which is when their
+     * release callback is called on the writer thread.
+     */
+    class image_stream
+    {
+        struct job
+        {
+            const uint32_t* pixels;
+            uint32_t nRows;
+            ptrdiff_t stride;
+            std::function<void()> release;
+        };
+
+        std::unique_ptr<image_writer> m_writer;
+        std::deque<job> m_jobs; // The front job is being written.
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        bool m_closing = false;
+        const char* m_error = nullptr;
+        std::thread m_thread;
+
+        void run();
+
+    public:
+        image_stream(std::unique_ptr<image_writer> writer);
+        /**
+         * \brief Waits for the queued rows, and closes the file. Errors are only reported by finish.
+         */
+        ~image_stream();
+
+        image_stream(const image_stream&) = delete;
+        const image_stream& operator=(const image_stream&) = delete;
+
+        const image_writer& writer() const;
+        /**
+         * \brief Queues rows to be written, in the same way as image_writer::write_rows.
+         * \param release Called once the rows are written, or dropped after an error.
+         */
+        void write_rows(const uint32_t* pixels, uint32_t nRows, ptrdiff_t stride, std::function<void()> release);
+        /**
+         * \brief Waits until at most the given number of queued writes are not done.
+         */
+        void wait(size_t maxPending);
+        /**
+         * \brief Waits for all the rows, and closes the file. Throws the error of the writer, if any.
+         */
+        void finish();
+    };
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <string>
+#include <stdint.h>
+
+namespace util
+{
+    /**
+     * \brief Read-only memory mapping of a whole file. The pages are read by the OS on demand,
+     * as they are accessed. Throws if the file cannot be opened or mapped.
+     */
+    class mapped_file
+    {
+        const uint8_t* m_data = nullptr;
+        size_t m_size = 0;
+#ifdef _WIN32
+        void* m_file = nullptr;
+        void* m_mapping = nullptr;
+#else
+        int m_fd = -1;
+#endif
+
+        void close();
+
+    public:
+        mapped_file(const std::string& path);
+        ~mapped_file();
+
+        mapped_file(const mapped_file&) = delete;
+        const mapped_file& operator=(const mapped_file&) = delete;
+
+        const uint8_t* data() const;
+        size_t size() const;
+    };
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <chrono>
+#include <iostream>
+
+namespace perf
+{
+    /**
+     * \brief Number of most recent samples kept for every metric. Percentiles are computed over this window.
+     */
+    constexpr size_t WINDOW_SIZE = 512;
+
+    struct metric_summary
+    {
+        std::string name;
+        size_t count; // Total number of samples recorded, including the ones that fell out of the window.
+        double last;
+        double p50;
+        double p95;
+        double p99;
+    };
+
+    /**
+     * \brief Records a timing sample for the given metric.
+     * \param name The name of the metric.
+     * \param ms The duration in milliseconds.
+     */
+    void record(const std::string& name, double ms);
+
+    /**
+     * \brief Computes the rolling percentiles of all metrics recorded so far.
+     * \return std::vector<metric_summary> The summaries, sorted by metric name.
+     */
+    std::vector<metric_summary> summaries();
+
+    /**
+     * \brief Computes the percentiles of samples that are not recorded, like the frames of a benchmark.
+     * \param name The name of the summary.
+     * \param samples The samples, in the order they were taken.
+     */
+    metric_summary summarize(const std::string& name, const std::vector<double>& samples);
+
+    /**
+     * \brief Discards all recorded samples.
+     */
+    void reset();
+
+    /**
+     * \brief Prints a table of all metrics and their percentiles.
+     */
+    void print_stats(std::ostream& out);
+
+    /**
+     * \brief Sets the interval of the periodic log line. Zero disables it.
+     * \param seconds The interval in seconds.
+     */
+    void set_log_interval(float seconds);
+
+    /**
+     * \brief Prints a single line summary of all metrics if the log interval has elapsed since the last line.
+     * This is meant to be called once every frame from the render loop.
+     */
+    void log_if_due(std::ostream& out);
+
+    /**
+     * \brief Records the time spent in the scope it lives in.
+     */
+    class scoped_timer
+    {
+        const char* m_name;
+        std::chrono::high_resolution_clock::time_point m_start;
+
+    public:
+        scoped_timer(const char* name);
+        ~scoped_timer();
+
+        scoped_timer(const scoped_timer&) = delete;
+        const scoped_timer& operator=(const scoped_timer&) = delete;
+    };
+}
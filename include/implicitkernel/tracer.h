@@ -0,0 +1,80 @@
+#pragma once
+#include <string>
+#include <chrono>
+#include <stdint.h>
+
+/*
+Opt-in tracer that writes host and device timelines in the Chrome trace event format.
+The resulting file can be opened in chrome://tracing or https://ui.perfetto.dev.
+*/
+namespace tracer
+{
+    /**
+     * \brief Starts writing trace events to the given file.
+     * \param path The path of the json file.
+     * \return true If the file was opened.
+     */
+    bool begin(const std::string& path);
+
+    /**
+     * \brief Stops tracing and closes the file.
+     */
+    void end();
+
+    /**
+     * \brief Gets a value indicating whether the events are being recorded.
+     */
+    bool enabled();
+
+    /**
+     * \brief Microseconds elapsed on the host clock that is used for all events.
+     */
+    double now_us();
+
+    /**
+     * \brief Names the track of the calling thread. Events recorded by the calling thread
+     * are shown on this track.
+     * \param name The name of the track.
+     */
+    void set_thread_name(const char* name);
+
+    /**
+     * \brief Records a complete event on the track of the calling thread.
+     * \param name The name of the event.
+     * \param category The category of the event.
+     * \param startUs The start time in microseconds, on the clock of now_us().
+     * \param durUs The duration in microseconds.
+     * \param detail Optional string shown as an argument of the event.
+     */
+    void complete(const char* name, const char* category, double startUs, double durUs, const std::string& detail = "");
+
+    /**
+     * \brief Records a complete event on the device track.
+     * \param name The name of the event.
+     * \param startUs The start time in microseconds, on the clock of now_us().
+     * \param durUs The duration in microseconds.
+     */
+    void device(const char* name, double startUs, double durUs);
+
+    /**
+     * \brief Records an instant event on the track of the calling thread.
+     */
+    void instant(const char* name, const char* category);
+
+    /**
+     * \brief Records the scope it lives in as a complete event, if the tracer is enabled.
+     */
+    class scope
+    {
+        const char* m_name;
+        const char* m_category;
+        double m_start;
+
+    public:
+        scope(const char* name, const char* category);
+        ~scope();
+
+        scope(const scope&) = delete;
+        const scope& operator=(const scope&) = delete;
+    };
+}
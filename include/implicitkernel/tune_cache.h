@@ -0,0 +1,34 @@
+#pragma once
+#include <string>
+#include <stdint.h>
+
+namespace tune_cache
+{
+    /**
+     * \brief How the render kernels are built and launched.
+     */
+    struct launch_config
+    {
+        uint32_t tileWidth; // Work-group shape of the 2-D stages, powers of two.
+        uint32_t tileHeight;
+        std::string buildOptions; // Passed to the kernel compiler besides the include path.
+    };
+
+    /**
+     * \brief The directory the tuned configurations are saved in, created if needed. It is IMPLICIT_CACHE_DIR if
+     * that is set, or an implicit directory in the cache directory of the user.
+     */
+    std::string directory();
+
+    /**
+     * \brief Looks up the configuration saved for the key.
+     * \return bool False if there is none, or the cache cannot be read.
+     */
+    bool load(const std::string& key, launch_config& config);
+
+    /**
+     * \brief Saves the configuration for the key, replacing the one saved before. Throws if the cache cannot be
+     * written.
+     */
+    void store(const std::string& key, const launch_config& config);
+}
@@ -55,8 +55,6 @@ namespace camera
     void get_mouse_pos(uint32_t& x, uint32_t& y);
 }
 
-static bool check_format(const std::string& str, const std::string& suffix);
-
 namespace viewer
 {
     struct viewer_data
@@ -67,6 +65,7 @@ namespace viewer
         glm::vec3 camTarget;
         glm::vec3 minBounds;
         glm::vec3 maxBounds;
+        glm::vec4 viewport; // Offset of the traced pixels in the image, and the size of the whole image.
     };
 
     bool log_gl_errors(const char* function, const char* file, uint32_t line);
@@ -89,18 +88,144 @@ namespace viewer
      * \brief Initializes the OpenCL part of the environment.
      */
     void init_ocl();
+    /**
+     * \brief Initializes OpenCL without a window, on the first device of the given type found on any platform,
+     * and allocates the scene buffers. Nothing can be shown in a window after this, but the scene can be traced
+     * off screen, exported with render_image, render_path or trace_offscreen.
+     * \param deviceType CL_DEVICE_TYPE_CPU or CL_DEVICE_TYPE_GPU.
+     */
+    void init_headless(cl_device_type deviceType);
+    /**
+     * \brief The name of the device the viewer runs on.
+     */
+    std::string device_name();
     void init_buffers();
     void set_work_group_size();
     static void pause_render_loop();
     static void resume_render_loop();
-    static void add_render_data(uint8_t* bytes, size_t nBytes, uint8_t* types, uint32_t* offsets, size_t nEntities, op_step* steps, size_t nSteps);
+    static void add_render_data(uint8_t* bytes, size_t nBytes, uint8_t* types, uint32_t* offsets, size_t nEntities,
+        op_step* steps, size_t nSteps, uint8_t* scene, size_t nSceneBytes, size_t maxObjectEntities);
 
+    /**
+     * \brief Shows the entity in the viewer, replacing the previously shown entity. The objects added to the
+     * scene stay.
+     * \param entity The entity to be shown.
+     */
     void show_entity(entities::ent_ref entity);
+    /**
+     * \brief Adds the entity to the scene as an independent object, with its own render data and bounds.
+     * \param entity The entity to be added.
+     * \return uint32_t The id of the object.
+     */
+    uint32_t scene_add(entities::ent_ref entity);
+    /**
+     * \brief Removes an object from the scene.
+     * \param id The id returned by scene_add.
+     * \return bool False if there is no object with that id.
+     */
+    bool scene_remove(uint32_t id);
+    /**
+     * \brief Removes all the objects, including the shown entity, from the scene.
+     */
+    void scene_clear();
 
     void render();
     void update_LOD();
     void reset_LOD();
+    /**
+     * \brief Exports the current frame as an image file. The pixels are copied into pinned memory, and the
+     * render loop goes on as soon as they are mapped, while the file is written in the background. Exporting
+     * another frame, or stopping the viewer, waits for the file to be written.
+     * \param path The image file, .bmp, .ppm, .png or .pfm.
+     * \return bool False if the file cannot be created.
+     */
     bool exportframe(const std::string& path);
+    /**
+     * \brief Renders the scene into an image file of any size, independent of the window. The image is traced
+     * in tiles that are spread over all the devices, and streamed to the file a band of tiles at a time, so the
+     * memory used does not grow with the size of the image.
+     * \param path The image file, .bmp, .ppm, .png or .pfm.
+     * \param width The width of the image in pixels.
+     * \param height The height of the image in pixels.
+     * \param camera The camera and the bounds. The viewport is ignored.
+     */
+    void render_image(const std::string& path, uint32_t width, uint32_t height, const viewer_data& camera);
+    /**
+     * \brief Renders the scene from each of the cameras in turn, on the first device. The cameras are uploaded
+     * in one batch. Each frame is read back while the next one is traced, and written in the background while
+     * the one after that is traced.
+     * \param path The image file of each frame, with a %d for its index, like out_%05d.png. A .y4m file, or -
+     * for the standard output, writes all the frames into one Y4M video instead.
+     * \param width The width of the frames in pixels.
+     * \param height The height of the frames in pixels.
+     * \param cameras The cameras and the bounds of the frames. The viewports are ignored.
+     */
+    void render_path(const std::string& path, uint32_t width, uint32_t height,
+        const std::vector<viewer_data>& cameras);
+    /**
+     * \brief Starts writing the camera and the level of detail of every frame of the window to a text file, one
+     * line per frame, which can be replayed with replay.
+     */
+    void record_begin(const std::string& path);
+    /**
+     * \brief Stops the recording started with record_begin, and closes the file.
+     */
+    void record_end();
+    /**
+     * \brief The cost of one frame of a replay.
+     */
+    struct frame_stats
+    {
+        double traceMs; // Device time of all the stages of the tracer.
+        uint64_t iterations; // Iterations of all the rays.
+        uint64_t rays; // Pixels that were traced, the rest were interpolated.
+    };
+    /**
+     * \brief Traces the frames recorded with record_begin again, with the same cameras, levels of detail and
+     * reprojection, so the work is the same every time for the same scene.
+     * \param path The recorded file.
+     * \param windowed Whether the frames are traced by the render loop and shown in the window, or off screen at
+     * the size of the window.
+     * \return std::vector<frame_stats> The cost of every frame.
+     */
+    std::vector<frame_stats> replay(const std::string& path, bool windowed);
+    /**
+     * \brief Traces the views one after the other, off screen on the first device, and measures each of them.
+     * Each view is reprojected from the one before it, as in the window. The render loop is paused meanwhile.
+     * \param views The cameras and the bounds. The viewports are ignored.
+     * \param lods The level of detail of each view.
+     * \param image If not null, receives the pixels of the last view, with the rows going up from the bottom.
+     * \return std::vector<frame_stats> The cost of every view.
+     */
+    std::vector<frame_stats> trace_offscreen(const std::vector<viewer_data>& views, const std::vector<uint8_t>& lods,
+        uint32_t width, uint32_t height, std::vector<uint32_t>* image = nullptr);
+    /**
+     * \brief Evaluates the implicit function of the scene at the points, on the device.
+     * \param values Receives the value at every point.
+     * \return double The device time of the evaluation in milliseconds.
+     */
+    double eval_points(const std::vector<glm::vec3>& points, std::vector<float>& values);
+    /**
+     * \brief The trace time of one launch configuration tried by autotune.
+     */
+    struct tuning_result
+    {
+        uint32_t tileWidth; // Work-group shape of the 2-D stages.
+        uint32_t tileHeight;
+        std::string buildOptions;
+        double traceMs; // Median device time of a frame of the window.
+    };
+    /**
+     * \brief Traces the current view at the size of the window with every work-group shape and set of build
+     * options the device allows, and keeps the fastest. It is saved in the cache of tune_cache, per device,
+     * driver and class of scene, and used from then on whenever a scene of the same class is shown.
+     * \return std::vector<tuning_result> The configurations that were tried, the fastest first.
+     */
+    std::vector<tuning_result> autotune();
+    /**
+     * \brief The camera of the window, with the current bounds.
+     */
+    viewer_data current_view();
     void setbounds(float(&bounds)[6]);
     void adaptive_rendermode(uint8_t lod);
 
@@ -8,6 +8,7 @@ extern "C"
 #include "lualib.h"
 };
 #include <implicitkernel/viewer.h>
+#include <implicitkernel/tracer.h>
 
 static lua_State* s_luaState = nullptr;
 
@@ -22,6 +23,28 @@ namespace implicit_lua
     void luathrow(lua_State* L, const std::string& error);
     void run_cmd(const std::string& line);
 
+    /**
+     * \brief Reference to a function argument on the lua stack.
+     */
+    struct lua_function
+    {
+        int index;
+    };
+
+    /**
+     * \brief Shows the entity in the viewer, unless the display is being deferred by a batch.
+     * Inside a batch, only the last entity requested is shown when the outermost batch ends.
+     */
+    void request_show(const entities::ent_ref& ref);
+    /**
+     * \brief Starts deferring the display of entities. Batches can be nested.
+     */
+    void begin_batch();
+    /**
+     * \brief Ends a batch. The last entity requested inside the outermost batch is uploaded once.
+     */
+    void end_batch();
+
     template <typename T>
     T read_lua(lua_State* L, int i);
 
@@ -43,6 +66,7 @@ namespace implicit_lua
 
             try
             {
+                tracer::scope traceScope(functionName, "lua");
                 if constexpr (std::is_void<TReturn>::value)
                 {
                     call_fn_internal(func, L, std::make_integer_sequence<int, sizeof...(TArgs)>());
@@ -0,0 +1,434 @@
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <functional>
+#include <cmath>
+#include <glm/gtc/matrix_transform.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <implicitlua/luabindings.h>
+#include <implicitkernel/perf.h>
+#include <implicitbench/scene_suite.h>
+
+using namespace entities;
+
+static constexpr size_t NUM_POINTS = 1 << 18; // Points the scene is evaluated at by the eval benchmarks.
+static constexpr uint32_t TRACE_SIZE = 512; // Side of the image traced by the trace benchmarks.
+
+/*The time of one benchmark, over all its runs.*/
+struct bench_result
+{
+    std::string name;
+    size_t runs;
+    double median;
+    double min;
+};
+
+static std::vector<bench_result> s_results;
+static size_t s_runs = 10;
+static std::string s_filter; // Only the benchmarks whose names start with this are run.
+
+/*Whether any benchmark of the group can pass the filter, so the groups can skip building their entities.*/
+static bool selected(const std::string& group)
+{
+    size_t n = std::min(group.size(), s_filter.size());
+    return group.compare(0, n, s_filter, 0, n) == 0;
+}
+
+static double host_ms(const std::function<void()>& func)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    func();
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+/*Runs the benchmark once to warm up, then s_runs times, and records the median and the fastest run. The
+benchmark returns the time of the run in milliseconds, so the device benchmarks can leave out the host work
+around the part being measured.*/
+static void measure(const std::string& name, const std::function<double()>& run)
+{
+    if (name.compare(0, s_filter.size(), s_filter) != 0)
+        return;
+    run();
+    std::vector<double> times(s_runs);
+    for (double& t : times)
+        t = run();
+    std::sort(times.begin(), times.end());
+    bench_result result = { name, times.size(), times[times.size() / 2], times.front() };
+    std::cout << std::left << std::setw(32) << name << std::right << std::fixed << std::setprecision(4)
+        << std::setw(12) << result.median << " ms (min " << result.min << " ms)\n";
+    s_results.push_back(result);
+}
+
+static op_defn union_op(float blendRadius)
+{
+    op_defn op;
+    op.type = op_type::OP_UNION;
+    op.data.blend_radius = blendRadius;
+    return op;
+}
+
+static std::vector<glm::vec3> random_points(size_t count, float range)
+{
+    // Fixed seed, so every run evaluates the same points.
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-range, range);
+    std::vector<glm::vec3> points(count);
+    for (glm::vec3& pt : points)
+        pt = glm::vec3(dist(rng), dist(rng), dist(rng));
+    return points;
+}
+
+/*A closed octahedron, so the mesh benchmarks don't need a file.*/
+static std::shared_ptr<mesh> octahedron(float size)
+{
+    std::vector<glm::vec3> verts = {
+        { size, 0, 0 }, { -size, 0, 0 }, { 0, size, 0 }, { 0, -size, 0 }, { 0, 0, size }, { 0, 0, -size } };
+    std::vector<uint32_t> tris = {
+        0, 2, 4, 2, 1, 4, 1, 3, 4, 3, 0, 4, 2, 0, 5, 1, 2, 5, 3, 1, 5, 0, 3, 5 };
+    return std::make_shared<mesh>(verts, tris);
+}
+
+/*A cube lattice of struts, n cells along each side.*/
+static ent_ref cube_lattice(uint32_t n, float cell, float radius)
+{
+    std::vector<glm::vec3> nodes;
+    std::vector<uint32_t> edges;
+    auto index = [n](uint32_t x, uint32_t y, uint32_t z) { return x + (n + 1) * (y + (n + 1) * z); };
+    float start = -0.5f * cell * n;
+    for (uint32_t z = 0; z <= n; z++)
+    {
+        for (uint32_t y = 0; y <= n; y++)
+        {
+            for (uint32_t x = 0; x <= n; x++)
+            {
+                nodes.push_back(glm::vec3(start + x * cell, start + y * cell, start + z * cell));
+                if (x < n) edges.insert(edges.end(), { index(x, y, z), index(x + 1, y, z) });
+                if (y < n) edges.insert(edges.end(), { index(x, y, z), index(x, y + 1, z) });
+                if (z < n) edges.insert(edges.end(), { index(x, y, z), index(x, y, z + 1) });
+            }
+        }
+    }
+    return std::make_shared<beam_lattice>(nodes, edges, radius);
+}
+
+/*Spheres at random positions, filling a cube of the given size.*/
+static std::vector<ent_ref> sphere_cloud(size_t count, float size)
+{
+    std::vector<glm::vec3> centers = random_points(count, size);
+    std::vector<ent_ref> spheres;
+    spheres.reserve(count);
+    float radius = size / std::cbrt((float)count);
+    for (const glm::vec3& c : centers)
+        spheres.push_back(entity::wrap_simple(sphere3(c.x, c.y, c.z, radius)));
+    return spheres;
+}
+
+/*Balanced tree of binary unions over the entities in [first, last), so the linearization sees every node.*/
+static ent_ref union_tree(const std::vector<ent_ref>& ents, size_t first, size_t last)
+{
+    if (last - first == 1)
+        return ents[first];
+    size_t mid = first + (last - first) / 2;
+    return comp_entity::make_csg(union_tree(ents, first, mid), union_tree(ents, mid, last), op_type::OP_UNION);
+}
+
+static void bench_eval(const std::string& name, ent_ref ent, const std::vector<glm::vec3>& points)
+{
+    std::vector<float> values;
+    if (!selected(name))
+        return;
+    viewer::show_entity(ent);
+    measure(name, [&]() { return viewer::eval_points(points, values); });
+}
+
+static void bench_primitives(const std::vector<glm::vec3>& points)
+{
+    bench_eval("eval.box", entity::wrap_simple(box3(0, 0, 0, 3, 2, 1)), points);
+    bench_eval("eval.sphere", entity::wrap_simple(sphere3(0, 0, 0, 3)), points);
+    bench_eval("eval.cylinder", entity::wrap_simple(cylinder3(0, 0, -3, 0, 0, 3, 2)), points);
+    bench_eval("eval.gyroid", entity::wrap_simple(gyroid(2, 0.2f)), points);
+    bench_eval("eval.schwarz", entity::wrap_simple(schwarz(2, 0.2f)), points);
+    bench_eval("eval.halfspace", entity::wrap_simple(halfspace({ 0, 0, 0 }, { 0, 0, 1 })), points);
+    bench_eval("eval.polytope", polytope::hull(random_points(64, 4)), points);
+    bench_eval("eval.beam_lattice", cube_lattice(8, 1, 0.1f), points);
+    bench_eval("eval.bvh_union", comp_entity::make_nary(sphere_cloud(256, 5), union_op(0.0f)), points);
+    std::shared_ptr<mesh> oct = octahedron(4);
+    bench_eval("eval.mesh", oct, points);
+    bench_eval("eval.distance_grid", distance_grid::bake(*oct, 64), points);
+}
+
+/*The mesh is the only entity with a distance on the host as well.*/
+static void bench_native(const std::vector<glm::vec3>& points)
+{
+    if (!selected("native"))
+        return;
+    std::shared_ptr<mesh> oct = octahedron(4);
+    std::vector<float> values(points.size());
+    measure("native.mesh", [&]()
+        {
+            return host_ms([&]()
+                {
+                    for (size_t i = 0; i < points.size(); i++)
+                        values[i] = oct->distance(points[i]);
+                });
+        });
+}
+
+static void bench_ops(const std::vector<glm::vec3>& points)
+{
+    ent_ref a = entity::wrap_simple(box3(-1, 0, 0, 2, 2, 2));
+    ent_ref b = entity::wrap_simple(sphere3(1, 0, 0, 2.5f));
+    op_defn filleted = union_op(0.5f);
+    bench_eval("eval.op.union", comp_entity::make_csg(a, b, op_type::OP_UNION), points);
+    bench_eval("eval.op.intersection", comp_entity::make_csg(a, b, op_type::OP_INTERSECTION), points);
+    bench_eval("eval.op.subtraction", comp_entity::make_csg(a, b, op_type::OP_SUBTRACTION), points);
+    bench_eval("eval.op.filleted_union", comp_entity::make_csg(a, b, filleted), points);
+    bench_eval("eval.op.offset", comp_entity::make_offset(a, 0.5f), points);
+    bench_eval("eval.op.linblend", comp_entity::make_linblend(a, b, { -3, 0, 0 }, { 3, 0, 0 }), points);
+    bench_eval("eval.op.smoothblend", comp_entity::make_smoothblend(a, b, { -3, 0, 0 }, { 3, 0, 0 }), points);
+    std::vector<ent_ref> operands;
+    for (int i = 0; i < 8; i++)
+        operands.push_back(entity::wrap_simple(gyroid(1.0f + i, 0.2f)));
+    bench_eval("eval.op.union_all", comp_entity::make_nary(operands, union_op(0.0f)), points);
+    bench_eval("eval.op.transform",
+        comp_entity::make_transform(a, glm::rotate(glm::mat4(1.0f), 0.5f, glm::vec3(0, 0, 1))), points);
+    bench_eval("eval.op.pattern_linear", comp_entity::make_linear_pattern(b, { 6, 0, 0 }, 10), points);
+}
+
+static void bench_linearize()
+{
+    for (size_t n : { 10, 100, 1000, 10000, 100000 })
+    {
+        std::string suffix = "." + std::to_string(n);
+        if (!selected("linearize"))
+            return;
+        ent_ref tree = union_tree(sphere_cloud(n, 10), 0, n);
+        size_t nBytes = 0, nEntities = 0, nSteps = 0;
+        // render_data_size adds to the sizes, so they start from zero every run.
+        measure("linearize.size" + suffix, [&]()
+            {
+                nBytes = nEntities = nSteps = 0;
+                return host_ms([&]() { tree->render_data_size(nBytes, nEntities, nSteps); });
+            });
+        std::vector<uint8_t> bytes(nBytes), types(nEntities);
+        std::vector<uint32_t> offsets(nEntities);
+        std::vector<op_step> steps(nSteps);
+        measure("linearize.copy" + suffix, [&]()
+            {
+                return host_ms([&]()
+                    {
+                        uint8_t* b = bytes.data();
+                        uint32_t* o = offsets.data();
+                        uint8_t* t = types.data();
+                        op_step* s = steps.data();
+                        tree->copy_render_data(b, o, t, s);
+                    });
+            });
+    }
+}
+
+static void bench_upload()
+{
+    if (!selected("show_entity"))
+        return;
+    for (size_t n : { 10, 100, 1000, 10000, 100000 })
+    {
+        // One object can only have a few simple entities, so the spheres go into a bvh union.
+        ent_ref ent = comp_entity::make_nary(sphere_cloud(n, 10), union_op(0.0f));
+        measure("show_entity." + std::to_string(n), [&]() { return host_ms([&]() { viewer::show_entity(ent); }); });
+    }
+}
+
+static void bench_lua()
+{
+    if (!selected("lua"))
+        return;
+    implicit_lua::run_cmd("autoshow(0)");
+    measure("lua.construct.1000", []()
+        {
+            return host_ms([]()
+                {
+                    implicit_lua::run_cmd(
+                        "local s = {} "
+                        "for i = 1, 1000 do s[i] = sphere(i % 10, (i / 10) % 10, i / 100, 0.5) end "
+                        "local u = union_all(s) "
+                        "local b = bsubtract(box(0, 0, 0, 20, 20, 20), offset(u, 0.1))");
+                });
+        });
+}
+
+static void bench_trace()
+{
+    if (!selected("trace"))
+        return;
+    viewer::viewer_data view = viewer::current_view();
+    view.camDistance = 12.0f;
+    view.camTheta = 0.6f;
+    view.camPhi = 0.4f;
+    view.camTarget = glm::vec3(0.0f);
+    op_defn filleted = union_op(0.5f);
+    ent_ref scene = comp_entity::make_csg(
+        comp_entity::make_csg(entity::wrap_simple(box3(0, 0, 0, 3, 3, 3)), entity::wrap_simple(gyroid(1, 0.2f)),
+            op_type::OP_INTERSECTION),
+        entity::wrap_simple(sphere3(3, 3, 3, 2)), filleted);
+    viewer::show_entity(scene);
+    uint64_t iterations = 0;
+    measure("trace.fixed_camera", [&]()
+        {
+            viewer::frame_stats stats = viewer::trace_offscreen({ view }, { 0 }, TRACE_SIZE, TRACE_SIZE).front();
+            iterations = stats.iterations;
+            return stats.traceMs;
+        });
+    if (iterations)
+        std::cout << "\t" << iterations << " iterations, "
+            << (double)iterations / (TRACE_SIZE * TRACE_SIZE) << " per pixel\n";
+}
+
+static void write_json(const std::string& path)
+{
+    std::ofstream file(path);
+    if (!file)
+        throw "Cannot write the results file.";
+    file << "{\n  \"device\": \"" << viewer::device_name() << "\",\n  \"runs\": " << s_runs
+        << ",\n  \"results\": [\n";
+    file << std::setprecision(6);
+    for (size_t i = 0; i < s_results.size(); i++)
+    {
+        const bench_result& r = s_results[i];
+        file << "    { \"name\": \"" << r.name << "\", \"runs\": " << r.runs << ", \"median_ms\": " << r.median
+            << ", \"min_ms\": " << r.min << " }" << (i + 1 < s_results.size() ? ",\n" : "\n");
+    }
+    file << "  ]\n}\n";
+}
+
+/*Prints the ratio of every result to the same benchmark in the baseline, and returns whether any of them is
+slower by more than the tolerance.*/
+static bool compare(const std::string& path, double tolerance)
+{
+    boost::property_tree::ptree baseline;
+    try
+    {
+        boost::property_tree::read_json(path, baseline);
+    }
+    catch (const boost::property_tree::json_parser_error&)
+    {
+        throw "Cannot read the baseline file.";
+    }
+    std::cout << "\nCompared to " << path << " (" << baseline.get<std::string>("device", "unknown device")
+        << "):\n";
+    bool regressed = false;
+    for (const auto& entry : baseline.get_child("results"))
+    {
+        std::string name = entry.second.get<std::string>("name");
+        double base = entry.second.get<double>("median_ms");
+        auto match = std::find_if(s_results.begin(), s_results.end(),
+            [&name](const bench_result& r) { return r.name == name; });
+        if (match == s_results.end() || base <= 0.0)
+            continue;
+        double ratio = match->median / base;
+        bool slower = ratio > 1.0 + tolerance;
+        regressed |= slower;
+        std::cout << std::left << std::setw(32) << name << std::right << std::fixed << std::setprecision(3)
+            << std::setw(8) << ratio << "x" << (slower ? "  REGRESSION" : ratio < 1.0 - tolerance ? "  faster" : "")
+            << "\n";
+    }
+    return regressed;
+}
+
+static void usage()
+{
+    std::cout << "implicitbench [--device cpu|gpu] [--runs N] [--filter prefix] [--out results.json]\n"
+        "              [--compare baseline.json] [--tolerance 0.1]\n"
+        "implicitbench --scenes testfiles [--golden dir] [--update-golden] [--size 512]\n"
+        "              [--pixel-tolerance 0.001] [--device cpu|gpu] [--runs N] [--out results.json]\n";
+}
+
+int main(int argc, char** argv)
+{
+    cl_device_type deviceType = CL_DEVICE_TYPE_CPU;
+    std::string outPath, baselinePath;
+    double tolerance = 0.1;
+    scene_suite::options sceneOpts;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg(argv[i]);
+        if (arg == "--update-golden")
+        {
+            sceneOpts.update = true;
+            continue;
+        }
+        if (i + 1 == argc)
+        {
+            usage();
+            return 1;
+        }
+        std::string value(argv[++i]);
+        if (arg == "--device" && (value == "cpu" || value == "gpu"))
+            deviceType = value == "cpu" ? CL_DEVICE_TYPE_CPU : CL_DEVICE_TYPE_GPU;
+        else if (arg == "--runs")
+            s_runs = sceneOpts.runs = std::max(1, std::stoi(value));
+        else if (arg == "--filter")
+            s_filter = value;
+        else if (arg == "--out")
+            outPath = value;
+        else if (arg == "--compare")
+            baselinePath = value;
+        else if (arg == "--tolerance")
+            tolerance = std::stod(value);
+        else if (arg == "--scenes")
+            sceneOpts.scriptDir = value;
+        else if (arg == "--golden")
+            sceneOpts.goldenDir = value;
+        else if (arg == "--size")
+            sceneOpts.size = (uint32_t)std::max(1, std::stoi(value));
+        else if (arg == "--pixel-tolerance")
+            sceneOpts.pixelTolerance = std::stod(value);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    try
+    {
+        viewer::init_headless(deviceType);
+        implicit_lua::init_lua();
+        std::cout << "Benchmarking on " << viewer::device_name() << "\n\n";
+        if (!sceneOpts.scriptDir.empty())
+        {
+            if (sceneOpts.goldenDir.empty())
+                sceneOpts.goldenDir = sceneOpts.scriptDir + "/golden";
+            sceneOpts.resultsPath = outPath;
+            size_t nFailed = scene_suite::run(sceneOpts);
+            implicit_lua::stop();
+            return nFailed > 0 ? 2 : 0;
+        }
+        std::vector<glm::vec3> points = random_points(NUM_POINTS, 8);
+        bench_primitives(points);
+        bench_native(points);
+        bench_ops(points);
+        bench_linearize();
+        bench_upload();
+        bench_lua();
+        bench_trace();
+        if (!outPath.empty())
+            write_json(outPath);
+        bool regressed = !baselinePath.empty() && compare(baselinePath, tolerance);
+        implicit_lua::stop();
+        return regressed ? 2 : 0;
+    }
+    catch (const char* error)
+    {
+        std::cerr << "Error: " << error << std::endl;
+        return 1;
+    }
+}
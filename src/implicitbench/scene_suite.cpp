@@ -0,0 +1,241 @@
+#include <implicitbench/scene_suite.h>
+#include <vector>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <filesystem>
+
+#include <implicitlua/luabindings.h>
+#include <implicitkernel/image_writer.h>
+
+namespace fs = std::filesystem;
+
+/*The outcome of one scene.*/
+struct scene_result
+{
+    std::string name;
+    std::string status; // pass, fail, missing, new or updated.
+    std::string scriptError; // Empty if the script ran to the end.
+    size_t mismatched = 0; // Pixels that differ from the golden image.
+    double loadMs = 0.0; // Wall time of the script, including the upload of the entity it shows.
+    double traceMs = 0.0; // Median device time of the traces.
+    double wallMs = 0.0; // Median wall time of the traces, including the read back.
+    viewer::frame_stats stats = {};
+};
+
+static double elapsed_ms(std::chrono::high_resolution_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+static double median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+/*Runs the script like the load function of the shell, so only the last entity it creates is shown, but
+without echoing it. Returns the error of the script, if any.*/
+static std::string run_script(const std::string& path)
+{
+    lua_State* L = implicit_lua::state();
+    implicit_lua::begin_batch();
+    int ret = luaL_dofile(L, path.c_str());
+    implicit_lua::end_batch();
+    if (ret == LUA_OK)
+        return std::string();
+    std::string error = lua_tostring(L, -1);
+    lua_pop(L, 1);
+    return error;
+}
+
+/*Writes the pixels, whose rows go up like the rows of the kernels.*/
+static void write_image(const std::string& path, const std::vector<uint32_t>& pixels, uint32_t size)
+{
+    auto writer = util::image_writer::create(path, size, size);
+    writer->write_rows(pixels.data() + (size_t)(size - 1) * size, size, -(ptrdiff_t)size);
+    writer->close();
+}
+
+/*The pixels whose channels differ by more than the tolerance from the golden image.*/
+static size_t count_mismatched(const std::vector<uint32_t>& pixels, const std::vector<uint32_t>& golden,
+    uint32_t size, uint32_t channelTolerance)
+{
+    size_t count = 0;
+    for (uint32_t y = 0; y < size; y++)
+    {
+        // The golden image is read from the top row down.
+        const uint32_t* row = pixels.data() + (size_t)(size - 1 - y) * size;
+        const uint32_t* goldenRow = golden.data() + (size_t)y * size;
+        for (uint32_t x = 0; x < size; x++)
+        {
+            for (int shift = 0; shift < 24; shift += 8)
+            {
+                int a = (row[x] >> shift) & 0xff, b = (goldenRow[x] >> shift) & 0xff;
+                if ((uint32_t)std::abs(a - b) > channelTolerance)
+                {
+                    count++;
+                    break;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+static scene_result run_scene(const fs::path& script, const scene_suite::options& opts,
+    const viewer::viewer_data& view)
+{
+    scene_result result;
+    result.name = script.stem().string();
+    // Every scene starts from an empty scene, with the bounds of the default view.
+    viewer::scene_clear();
+    float bounds[6] = { view.minBounds.x, view.minBounds.y, view.minBounds.z,
+        view.maxBounds.x, view.maxBounds.y, view.maxBounds.z };
+    viewer::setbounds(bounds);
+    implicit_lua::run_cmd("autoshow(1)");
+    auto start = std::chrono::high_resolution_clock::now();
+    result.scriptError = run_script(script.string());
+    result.loadMs = elapsed_ms(start);
+    // The script may have set the bounds.
+    viewer::viewer_data sceneView = viewer::current_view();
+    sceneView.camDistance = view.camDistance;
+    sceneView.camTheta = view.camTheta;
+    sceneView.camPhi = view.camPhi;
+    sceneView.camTarget = view.camTarget;
+
+    std::vector<uint32_t> pixels;
+    viewer::trace_offscreen({ sceneView }, { 0 }, opts.size, opts.size, &pixels); // Warm up.
+    std::vector<double> traceTimes, wallTimes;
+    for (size_t i = 0; i < std::max((size_t)1, opts.runs); i++)
+    {
+        start = std::chrono::high_resolution_clock::now();
+        result.stats = viewer::trace_offscreen({ sceneView }, { 0 }, opts.size, opts.size, &pixels).front();
+        wallTimes.push_back(elapsed_ms(start));
+        traceTimes.push_back(result.stats.traceMs);
+    }
+    result.traceMs = median(traceTimes);
+    result.wallMs = median(wallTimes);
+
+    fs::path golden = fs::path(opts.goldenDir) / (result.name + ".png");
+    bool exists = fs::exists(golden);
+    if (!result.scriptError.empty())
+    {
+        // The render of a broken script is neither compared nor made a golden image.
+        result.status = "fail";
+    }
+    else if (opts.update)
+    {
+        write_image(golden.string(), pixels, opts.size);
+        result.status = exists ? "updated" : "new";
+        return result;
+    }
+    else if (!exists)
+    {
+        // Only written with update, so a missing image can't pass by comparing the code to itself.
+        result.status = "missing";
+    }
+    else
+    {
+        uint32_t width = 0, height = 0;
+        std::vector<uint32_t> expected = util::read_image(golden.string(), width, height);
+        if (width != opts.size || height != opts.size)
+        {
+            result.mismatched = (size_t)opts.size * opts.size;
+            result.status = "fail";
+        }
+        else
+        {
+            result.mismatched = count_mismatched(pixels, expected, opts.size, opts.channelTolerance);
+            result.status = result.mismatched > opts.pixelTolerance * opts.size * opts.size ? "fail" : "pass";
+        }
+    }
+    // The render is kept next to the golden image, to be looked at.
+    if (result.status != "pass")
+        write_image((fs::path(opts.goldenDir) / (result.name + ".failed.png")).string(), pixels, opts.size);
+    return result;
+}
+
+static double rays_per_second(const scene_result& r)
+{
+    return r.traceMs > 0.0 ? (double)r.stats.rays / (r.traceMs * 1.0e-3) : 0.0;
+}
+
+static std::string json_string(const std::string& str)
+{
+    std::string out = "\"";
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if ((unsigned char)c < 0x20)
+            c = ' ';
+        out += c;
+    }
+    return out + "\"";
+}
+
+static void write_results(const std::string& path, const std::vector<scene_result>& results, uint32_t size)
+{
+    std::ofstream file(path);
+    if (!file)
+        throw "Cannot write the results file.";
+    double nPixels = (double)size * size;
+    file << "{\n  \"device\": " << json_string(viewer::device_name()) << ",\n  \"width\": " << size
+        << ",\n  \"height\": " << size << ",\n  \"scenes\": [\n";
+    file << std::setprecision(6);
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const scene_result& r = results[i];
+        file << "    { \"name\": " << json_string(r.name) << ", \"status\": \"" << r.status << "\""
+            << ", \"script_error\": " << json_string(r.scriptError) << ", \"mismatched_pixels\": " << r.mismatched
+            << ", \"load_ms\": " << r.loadMs << ", \"trace_ms\": " << r.traceMs << ", \"wall_ms\": " << r.wallMs
+            << ", \"rays\": " << r.stats.rays << ", \"rays_per_sec\": " << rays_per_second(r)
+            << ", \"mean_iterations\": " << (double)r.stats.iterations / nPixels << " }"
+            << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    file << "  ]\n}\n";
+}
+
+size_t scene_suite::run(const options& opts)
+{
+    std::vector<fs::path> scripts;
+    for (const auto& entry : fs::directory_iterator(opts.scriptDir))
+    {
+        if (entry.is_regular_file() && entry.path().extension() == ".lua")
+            scripts.push_back(entry.path());
+    }
+    if (scripts.empty())
+        throw "There are no scene scripts in the directory.";
+    std::sort(scripts.begin(), scripts.end());
+    fs::create_directories(opts.goldenDir);
+    // Taken before any script runs, so every scene is seen from the same camera.
+    const viewer::viewer_data view = viewer::current_view();
+    std::cout << std::left << std::setw(24) << "scene" << std::setw(10) << "status" << std::right
+        << std::setw(12) << "trace ms" << std::setw(12) << "wall ms" << std::setw(14) << "Mrays/s"
+        << std::setw(12) << "iter/px" << "\n";
+    std::vector<scene_result> results;
+    size_t nFailed = 0;
+    for (const fs::path& script : scripts)
+    {
+        results.push_back(run_scene(script, opts, view));
+        const scene_result& r = results.back();
+        nFailed += r.status == "fail" || r.status == "missing";
+        std::cout << std::left << std::setw(24) << r.name << std::setw(10) << r.status << std::right
+            << std::fixed << std::setprecision(3) << std::setw(12) << r.traceMs << std::setw(12) << r.wallMs
+            << std::setw(14) << rays_per_second(r) * 1.0e-6 << std::setw(12)
+            << (double)r.stats.iterations / ((double)opts.size * opts.size) << "\n";
+        if (r.status == "fail" && r.mismatched > 0)
+            std::cout << "\t" << r.mismatched << " pixels differ from the golden image\n";
+        if (r.status == "missing")
+            std::cout << "\tThere is no golden image, --update-golden writes it\n";
+        if (!r.scriptError.empty())
+            std::cout << "\tThe script failed: " << r.scriptError << "\n";
+    }
+    viewer::scene_clear();
+    if (!opts.resultsPath.empty())
+        write_results(opts.resultsPath, results, opts.size);
+    return nFailed;
+}
@@ -20,10 +20,20 @@ void entities::box3::write_render_bytes(uint8_t *&bytes) const {
   bytes += sizeof(ient);
 }
 
+bool entities::box3::bounds(glm::vec3 &min, glm::vec3 &max) const {
+  min = center - halfsize;
+  max = center + halfsize;
+  return true;
+}
+
 bool entities::simp_entity::simple() const { return true; }
 
+void entities::simp_entity::collect_simple(std::vector<entity *> &ents) {
+  ents.push_back(this);
+}
+
 void entities::simp_entity::render_data_size_internal(
-    size_t &nBytes, size_t &nSteps,
+    size_t &nBytes, size_t &, size_t &nSteps,
     std::unordered_set<entity *> &simpleEntities) const {
   nBytes += num_render_bytes();
   simpleEntities.insert((entity *)this);
@@ -32,16 +42,28 @@ void entities::simp_entity::render_data_size_internal(
 void entities::simp_entity::copy_render_data_internal(
     uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types, op_step *&steps,
     size_t &entityIndex, size_t &currentOffset, uint32_t reg,
-    std::unordered_map<entity *, uint32_t> &regMap) const {
-  auto match = regMap.find((entity *)this);
-  if (match == regMap.end()) {
-    *(offsets++) = (uint32_t)currentOffset;
+    render_context &ctx) const {
+  if (ctx.regMap->find((entity *)this) != ctx.regMap->end())
+    return;
+  // The bytes are written once, and shared by all the transformed copies.
+  auto written = ctx.byteOffsets.find(this);
+  size_t byteOffset = currentOffset;
+  if (written == ctx.byteOffsets.end()) {
+    ctx.byteOffsets.emplace(this, currentOffset);
     currentOffset += num_render_bytes();
     write_render_bytes(bytes);
+  } else {
+    byteOffset = written->second;
+  }
+  if (ctx.ops.empty()) {
+    *(offsets++) = (uint32_t)byteOffset;
     *(types++) = type();
-    regMap.emplace((entity *)this, (uint32_t)entityIndex);
-    entityIndex++;
+  } else {
+    ctx.write_wrapper(bytes, offsets, types, currentOffset, byteOffset, type(),
+                      nullptr);
   }
+  ctx.regMap->emplace((entity *)this, (uint32_t)entityIndex);
+  entityIndex++;
 }
 
 entities::comp_entity::comp_entity(std::shared_ptr<entity> l,
@@ -51,56 +73,516 @@ entities::comp_entity::comp_entity(std::shared_ptr<entity> l,
 entities::comp_entity::comp_entity(std::shared_ptr<entity> a, op_defn o)
     : left(a), right(nullptr), op(o) {}
 
+entities::comp_entity::comp_entity(const std::vector<ent_ref> &ents,
+                                   op_defn o)
+    : left(nullptr), right(nullptr), operands(ents), op(o) {}
+
+entities::ent_ref
+entities::comp_entity::make_nary(const std::vector<ent_ref> &ents,
+                                 op_defn op) {
+  if (op.type != op_type::OP_UNION && op.type != op_type::OP_INTERSECTION)
+    throw "Only unions and intersections can have more than two operands.";
+  if (ents.empty())
+    throw "At least one entity is required.";
+  if (ents.size() == 1)
+    return ents.front();
+  if (op.type != op_type::OP_UNION || op.data.blend_radius != 0.0f)
+    return ent_ref(new comp_entity(ents, op));
+
+  // Finite simple operands of a plain union go into a bvh.
+  std::vector<ent_ref> prims, rest;
+  std::unordered_set<entity *> visited;
+  glm::vec3 bmin, bmax;
+  for (const ent_ref &ent : ents) {
+    if (!visited.insert(ent.get()).second)
+      continue;
+    if (ent->simple() && ent->type() != ENT_TYPE_BVH &&
+        ent->bounds(bmin, bmax))
+      prims.push_back(ent);
+    else
+      rest.push_back(ent);
+  }
+  if (prims.size() < BVH_MIN_PRIMITIVES)
+    return ent_ref(new comp_entity(ents, op));
+  ent_ref bvh = std::make_shared<bvh_union>(prims);
+  if (rest.empty())
+    return bvh;
+  rest.insert(rest.begin(), bvh);
+  return ent_ref(new comp_entity(rest, op));
+}
+
+entities::ent_ref
+entities::comp_entity::make_transform(ent_ref ent, const glm::mat4 &xform) {
+  if (xform[0][3] != 0.0f || xform[1][3] != 0.0f || xform[2][3] != 0.0f ||
+      xform[3][3] != 1.0f || glm::determinant(glm::mat3(xform)) == 0.0f)
+    throw "The transform must be an invertible affine transform.";
+  glm::mat4 combined = xform;
+  // Nested transforms are combined into one.
+  auto inner = std::dynamic_pointer_cast<comp_entity>(ent);
+  if (inner && inner->op.type == op_type::OP_TRANSFORM) {
+    combined = xform * inner->xform;
+    ent = inner->left;
+  }
+  op_defn op = {};
+  op.type = op_type::OP_TRANSFORM;
+  comp_entity *result = new comp_entity(ent, op);
+  result->xform = combined;
+  return ent_ref(result);
+}
+
+entities::ent_ref entities::comp_entity::make_pattern(ent_ref ent,
+                                                      const point_op &fold) {
+  op_defn op = {};
+  op.type = op_type::OP_PATTERN;
+  comp_entity *result = new comp_entity(ent, op);
+  result->fold = fold;
+  return ent_ref(result);
+}
+
+entities::ent_ref entities::comp_entity::make_linear_pattern(ent_ref ent,
+                                                             glm::vec3 step,
+                                                             uint32_t count) {
+  if (count == 0)
+    throw "The number of copies must be at least one.";
+  if (glm::length(step) == 0.0f)
+    throw "The step between the copies cannot be zero.";
+  if (count == 1)
+    return ent;
+  point_op fold = {};
+  fold.type = POINT_OP_LINEAR;
+  float params[] = {step.x, step.y, step.z, (float)count};
+  std::copy(params, params + 4, fold.params);
+  return make_pattern(ent, fold);
+}
+
+entities::ent_ref
+entities::comp_entity::make_grid_pattern(ent_ref ent, glm::vec3 spacing,
+                                         const uint32_t (&counts)[3]) {
+  point_op fold = {};
+  fold.type = POINT_OP_GRID;
+  bool repeated = false;
+  for (int i = 0; i < 3; i++) {
+    if (counts[i] == 0)
+      throw "The number of copies must be at least one.";
+    if (counts[i] > 1 && spacing[i] <= 0.0f)
+      throw "The spacing must be positive along the axes with more than one "
+            "copy.";
+    repeated |= counts[i] > 1;
+    fold.params[i] = spacing[i];
+    fold.params[3 + i] = (float)counts[i];
+  }
+  return repeated ? make_pattern(ent, fold) : ent;
+}
+
+entities::ent_ref entities::comp_entity::make_polar_pattern(ent_ref ent,
+                                                            glm::vec3 axis,
+                                                            uint32_t count) {
+  if (count == 0)
+    throw "The number of copies must be at least one.";
+  if (glm::length(axis) == 0.0f)
+    throw "The axis of the pattern cannot be zero.";
+  if (count == 1)
+    return ent;
+  axis = glm::normalize(axis);
+  // The sectors are centered on the entity, so that its copy is the nearest
+  // one in its own sector.
+  glm::vec3 u = glm::normalize(glm::cross(
+      axis, std::abs(axis.x) < 0.9f ? glm::vec3(1, 0, 0) : glm::vec3(0, 1, 0)));
+  glm::vec3 bmin, bmax;
+  if (ent->bounds(bmin, bmax)) {
+    glm::vec3 center = (bmin + bmax) * 0.5f;
+    glm::vec3 radial = center - glm::dot(center, axis) * axis;
+    if (glm::length(radial) > 1e-6f)
+      u = glm::normalize(radial);
+  }
+  glm::vec3 v = glm::cross(axis, u);
+  point_op fold = {};
+  fold.type = POINT_OP_POLAR;
+  float params[] = {axis.x, axis.y, axis.z, u.x, u.y, u.z,
+                    v.x,    v.y,    v.z,    6.2831853f / (float)count};
+  std::copy(params, params + 10, fold.params);
+  return make_pattern(ent, fold);
+}
+
+uint32_t entities::comp_entity::num_candidates() const {
+  if (fold.type != POINT_OP_GRID)
+    return 2;
+  uint32_t n = 1;
+  for (int i = 0; i < 3; i++)
+    n *= fold.params[3 + i] > 1.0f ? 2 : 1;
+  return n;
+}
+
+point_op entities::comp_entity::candidate(uint32_t variant) const {
+  point_op op = fold;
+  switch (fold.type) {
+  case POINT_OP_LINEAR:
+    op.params[4] = (float)variant;
+    break;
+  case POINT_OP_POLAR:
+    op.params[10] = (float)variant;
+    break;
+  case POINT_OP_GRID: {
+    // The bits of the variant pick the neighbor along the repeated axes.
+    uint32_t mask = 0;
+    for (uint32_t i = 0, bit = 0; i < 3; i++) {
+      if (fold.params[3 + i] > 1.0f)
+        mask |= ((variant >> bit++) & 1) << i;
+    }
+    op.params[6] = (float)mask;
+    break;
+  }
+  }
+  return op;
+}
+
+void entities::comp_entity::collect_simple(std::vector<entity *> &ents) {
+  if (left)
+    left->collect_simple(ents);
+  if (right)
+    right->collect_simple(ents);
+  for (const ent_ref &operand : operands)
+    operand->collect_simple(ents);
+}
+
+bool entities::comp_entity::bounds(glm::vec3 &min, glm::vec3 &max) const {
+  std::vector<entity *> children;
+  if (operands.empty()) {
+    if (left)
+      children.push_back(left.get());
+    if (right)
+      children.push_back(right.get());
+  } else {
+    for (const ent_ref &operand : operands)
+      children.push_back(operand.get());
+  }
+  if (children.empty())
+    return false;
+
+  glm::vec3 cmin, cmax;
+  switch (op.type) {
+  case op_type::OP_UNION:
+  case op_type::OP_LINBLEND:
+  case op_type::OP_SMOOTHBLEND: {
+    // Every operand must be finite.
+    for (size_t i = 0; i < children.size(); i++) {
+      if (!children[i]->bounds(cmin, cmax))
+        return false;
+      min = i == 0 ? cmin : glm::min(min, cmin);
+      max = i == 0 ? cmax : glm::max(max, cmax);
+    }
+    if (op.type == op_type::OP_UNION) {
+      glm::vec3 fillet(op.data.blend_radius);
+      min -= fillet;
+      max += fillet;
+    }
+    return true;
+  }
+  case op_type::OP_INTERSECTION: {
+    // Any finite operand bounds the intersection.
+    bool found = false;
+    for (entity *child : children) {
+      if (!child->bounds(cmin, cmax))
+        continue;
+      min = found ? glm::max(min, cmin) : cmin;
+      max = found ? glm::min(max, cmax) : cmax;
+      found = true;
+    }
+    max = glm::max(min, max);
+    return found;
+  }
+  case op_type::OP_SUBTRACTION:
+    return children.front()->bounds(min, max);
+  case op_type::OP_PATTERN: {
+    if (!children.front()->bounds(cmin, cmax))
+      return false;
+    const float *m = fold.params;
+    if (fold.type != POINT_OP_POLAR) {
+      glm::vec3 last =
+          fold.type == POINT_OP_LINEAR
+              ? glm::vec3(m[0], m[1], m[2]) * (m[3] - 1.0f)
+              : glm::vec3(m[0] * (m[3] - 1.0f), m[1] * (m[4] - 1.0f),
+                          m[2] * (m[5] - 1.0f));
+      min = glm::min(cmin, cmin + last);
+      max = glm::max(cmax, cmax + last);
+      return true;
+    }
+    glm::vec3 axis(m[0], m[1], m[2]), u(m[3], m[4], m[5]), v(m[6], m[7], m[8]);
+    uint32_t count = (uint32_t)std::round(6.2831853f / m[9]);
+    for (uint32_t k = 0; k < count; k++) {
+      float c = std::cos(k * m[9]), s = std::sin(k * m[9]);
+      for (int i = 0; i < 8; i++) {
+        glm::vec3 p((i & 1) ? cmax.x : cmin.x, (i & 2) ? cmax.y : cmin.y,
+                    (i & 4) ? cmax.z : cmin.z);
+        float x = glm::dot(p, u), y = glm::dot(p, v);
+        glm::vec3 pt = glm::dot(p, axis) * axis + (c * x - s * y) * u +
+                       (s * x + c * y) * v;
+        min = (k == 0 && i == 0) ? pt : glm::min(min, pt);
+        max = (k == 0 && i == 0) ? pt : glm::max(max, pt);
+      }
+    }
+    return true;
+  }
+  case op_type::OP_TRANSFORM: {
+    if (!children.front()->bounds(cmin, cmax))
+      return false;
+    for (int i = 0; i < 8; i++) {
+      glm::vec3 corner((i & 1) ? cmax.x : cmin.x, (i & 2) ? cmax.y : cmin.y,
+                       (i & 4) ? cmax.z : cmin.z);
+      glm::vec3 pt(xform * glm::vec4(corner, 1.0f));
+      min = i == 0 ? pt : glm::min(min, pt);
+      max = i == 0 ? pt : glm::max(max, pt);
+    }
+    return true;
+  }
+  case op_type::OP_OFFSET: {
+    if (!children.front()->bounds(min, max))
+      return false;
+    glm::vec3 grow(std::max(0.0f, op.data.offset_distance));
+    min -= grow;
+    max += grow;
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
 bool entities::comp_entity::simple() const { return false; }
 
 uint8_t entities::comp_entity::type() const { return ENT_TYPE_CSG; }
 
 void entities::comp_entity::render_data_size_internal(
-    size_t &nBytes, size_t &nSteps,
+    size_t &nBytes, size_t &nEntities, size_t &nSteps,
     std::unordered_set<entities::entity *> &simpleEntities) const {
+  if (op.type == op_type::OP_TRANSFORM) {
+    // The child is written in its own scope, with a wrapper for each of its
+    // simple entities, and its value is moved into the register by a step.
+    size_t childBytes = 0, childEntities = 0, childSteps = 0;
+    left->render_data_size(childBytes, childEntities, childSteps);
+    nBytes += childBytes + childEntities * (sizeof(i_xform) + sizeof(point_op));
+    nEntities += childEntities;
+    nSteps += childSteps + 1;
+    return;
+  }
+  if (op.type == op_type::OP_PATTERN) {
+    // The child is written once per candidate, including the simple entities
+    // it shares with the rest of the tree.
+    size_t childBytes = 0, childEntities = 0, childSteps = 0;
+    left->render_data_size(childBytes, childEntities, childSteps);
+    size_t n = num_candidates();
+    nBytes += n * (childBytes +
+                   childEntities * (sizeof(i_xform) + sizeof(point_op)));
+    nEntities += n * childEntities;
+    nSteps += n * (childSteps + 1) + 1;
+    return;
+  }
   if (left)
-    left->render_data_size_internal(nBytes, nSteps, simpleEntities);
+    left->render_data_size_internal(nBytes, nEntities, nSteps,
+                                    simpleEntities);
   if (right)
-    right->render_data_size_internal(nBytes, nSteps, simpleEntities);
-  nSteps++;
+    right->render_data_size_internal(nBytes, nEntities, nSteps,
+                                     simpleEntities);
+  for (const ent_ref &operand : operands)
+    operand->render_data_size_internal(nBytes, nEntities, nSteps,
+                                       simpleEntities);
+  // An n-ary node needs at most one step per operand.
+  nSteps += operands.empty() ? 1 : operands.size();
+}
+
+void entities::comp_entity::copy_nary_render_data(
+    uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types, op_step *&steps,
+    size_t &entityIndex, size_t &currentOffset, uint32_t regVal,
+    render_context &ctx) const {
+  if (regVal >= MAX_ENTITY_COUNT - 2) {
+    std::cerr << "Too many entities. Out of resources. Aborting...\n";
+    exit(1);
+  }
+
+  op_defn op = ctx.world_op(this->op);
+  // Simple operands that are not in the render data yet are written next to
+  // each other, so that they can be folded by a single step.
+  uint32_t first = (uint32_t)entityIndex;
+  std::vector<entity *> rest;
+  for (const ent_ref &operand : operands) {
+    if (operand->simple() &&
+        ctx.regMap->find(operand.get()) == ctx.regMap->end())
+      operand->copy_render_data_internal(bytes, offsets, types, steps,
+                                         entityIndex, currentOffset, regVal,
+                                         ctx);
+    else
+      rest.push_back(operand.get());
+  }
+
+  bool hasValue = false;
+  uint32_t count = (uint32_t)entityIndex - first;
+  if (count > 0) {
+    op_defn fold = op;
+    fold.type = op.type == op_type::OP_UNION ? op_type::OP_UNION_ALL
+                                             : op_type::OP_INTERSECTION_ALL;
+    *(steps++) = {fold,  (uint32_t)SRC_VAL, first, (uint32_t)SRC_VAL,
+                  count, regVal};
+    hasValue = true;
+  }
+
+  // The remaining operands are folded into the register one at a time.
+  for (entity *operand : rest) {
+    if (operand->simple()) {
+      uint32_t index = ctx.regMap->find(operand)->second;
+      if (hasValue) {
+        *(steps++) = {op,    (uint32_t)SRC_REG, regVal, (uint32_t)SRC_VAL,
+                      index, regVal};
+      } else {
+        op_defn none = op;
+        none.type = op_type::OP_NONE;
+        *(steps++) = {none,  (uint32_t)SRC_VAL, index, (uint32_t)SRC_VAL,
+                      index, regVal};
+      }
+    } else {
+      uint32_t dest = hasValue ? regVal + 1 : regVal;
+      operand->copy_render_data_internal(bytes, offsets, types, steps,
+                                         entityIndex, currentOffset, dest,
+                                         ctx);
+      if (hasValue)
+        *(steps++) = {op,   (uint32_t)SRC_REG, regVal, (uint32_t)SRC_REG,
+                      dest, regVal};
+    }
+    hasValue = true;
+  }
 }
 
 void entities::comp_entity::copy_render_data_internal(
     uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types, op_step *&steps,
     size_t &entityIndex, size_t &currentOffset, uint32_t regVal,
-    std::unordered_map<entity *, uint32_t> &regMap) const {
+    render_context &ctx) const {
+  if (op.type == op_type::OP_TRANSFORM) {
+    copy_transformed_render_data(bytes, offsets, types, steps, entityIndex,
+                                 currentOffset, regVal, ctx);
+    return;
+  }
+  if (op.type == op_type::OP_PATTERN) {
+    copy_pattern_render_data(bytes, offsets, types, steps, entityIndex,
+                             currentOffset, regVal, ctx);
+    return;
+  }
+  if (!operands.empty()) {
+    copy_nary_render_data(bytes, offsets, types, steps, entityIndex,
+                          currentOffset, regVal, ctx);
+    return;
+  }
+
   bool lcsg = (left) ? !left->simple() : false;
   bool rcsg = (right) ? !right->simple() : false;
-  auto lmatch = lcsg ? regMap.end() : regMap.find(left.get());
-  auto rmatch = rcsg ? regMap.end() : regMap.find(right.get());
+  auto lmatch = lcsg ? ctx.regMap->end() : ctx.regMap->find(left.get());
+  auto rmatch = rcsg ? ctx.regMap->end() : ctx.regMap->find(right.get());
 
   if (regVal >= MAX_ENTITY_COUNT - 2) {
     std::cerr << "Too many entities. Out of resources. Aborting...\n";
     exit(1);
   }
 
-  uint32_t lsrc =
-      lcsg ? regVal
-           : lmatch == regMap.end() ? (uint32_t)entityIndex : lmatch->second;
+  uint32_t lsrc = lcsg ? regVal
+                 : lmatch == ctx.regMap->end() ? (uint32_t)entityIndex
+                                               : lmatch->second;
 
   if (left)
     left->copy_render_data_internal(bytes, offsets, types, steps, entityIndex,
-                                    currentOffset, regVal, regMap);
+                                    currentOffset, regVal, ctx);
 
   uint32_t rsrc = (rcsg && lcsg)
                       ? regVal + 1
                       : rcsg ? regVal
-                             : rmatch == regMap.end() ? (uint32_t)entityIndex
-                                                      : rmatch->second;
+                             : rmatch == ctx.regMap->end()
+                                   ? (uint32_t)entityIndex
+                                   : rmatch->second;
 
   if (right)
     right->copy_render_data_internal(
         bytes, offsets, types, steps, entityIndex, currentOffset,
-        (lcsg && rcsg) ? (regVal + 1) : regVal, regMap);
+        (lcsg && rcsg) ? (regVal + 1) : regVal, ctx);
 
-  *(steps++) = {op,   lcsg ? (uint32_t)SRC_REG : (uint32_t)SRC_VAL,
-                lsrc, rcsg ? (uint32_t)SRC_REG : (uint32_t)SRC_VAL,
-                rsrc, regVal};
+  *(steps++) = {ctx.world_op(op),
+                lcsg ? (uint32_t)SRC_REG : (uint32_t)SRC_VAL,
+                lsrc,
+                rcsg ? (uint32_t)SRC_REG : (uint32_t)SRC_VAL,
+                rsrc,
+                regVal};
+}
+
+void entities::comp_entity::copy_transformed_render_data(
+    uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types, op_step *&steps,
+    size_t &entityIndex, size_t &currentOffset, uint32_t regVal,
+    render_context &ctx) const {
+  if (regVal >= MAX_ENTITY_COUNT - 2) {
+    std::cerr << "Too many entities. Out of resources. Aborting...\n";
+    exit(1);
+  }
+  ctx.push_affine(this, xform);
+  left->copy_render_data_internal(bytes, offsets, types, steps, entityIndex,
+                                  currentOffset, regVal, ctx);
+  if (left->simple()) {
+    // The value of the wrapper is moved into the register.
+    uint32_t index = ctx.regMap->find(left.get())->second;
+    op_defn none = {};
+    none.type = op_type::OP_NONE;
+    *(steps++) = {none,  (uint32_t)SRC_VAL, index, (uint32_t)SRC_VAL,
+                  index, regVal};
+  }
+  ctx.pop();
+}
+
+void entities::comp_entity::copy_pattern_render_data(
+    uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types, op_step *&steps,
+    size_t &entityIndex, size_t &currentOffset, uint32_t regVal,
+    render_context &ctx) const {
+  if (regVal >= MAX_ENTITY_COUNT - 2) {
+    std::cerr << "Too many entities. Out of resources. Aborting...\n";
+    exit(1);
+  }
+  // The pattern is the union of the child evaluated at the nearest copy and
+  // at its neighbors.
+  uint32_t n = num_candidates();
+  op_defn unite = {};
+  unite.type = op_type::OP_UNION;
+  if (!left->simple()) {
+    for (uint32_t v = 0; v < n; v++) {
+      uint32_t dest = v == 0 ? regVal : regVal + 1;
+      ctx.push_fold(this, v, candidate(v));
+      left->copy_render_data_internal(bytes, offsets, types, steps, entityIndex,
+                                      currentOffset, dest, ctx);
+      ctx.pop();
+      if (v > 0)
+        *(steps++) = {unite, (uint32_t)SRC_REG, regVal, (uint32_t)SRC_REG,
+                      dest,  regVal};
+    }
+    return;
+  }
+
+  std::vector<uint32_t> indices;
+  for (uint32_t v = 0; v < n; v++) {
+    ctx.push_fold(this, v, candidate(v));
+    left->copy_render_data_internal(bytes, offsets, types, steps, entityIndex,
+                                    currentOffset, regVal, ctx);
+    indices.push_back(ctx.regMap->find(left.get())->second);
+    ctx.pop();
+  }
+  bool contiguous = true;
+  for (uint32_t v = 1; v < n; v++)
+    contiguous &= indices[v] == indices[0] + v;
+  if (contiguous) {
+    // The wrappers are next to each other, and are folded by one step.
+    unite.type = op_type::OP_UNION_ALL;
+    *(steps++) = {unite, (uint32_t)SRC_VAL, indices[0], (uint32_t)SRC_VAL,
+                  n,     regVal};
+    return;
+  }
+  op_defn none = {};
+  none.type = op_type::OP_NONE;
+  *(steps++) = {none,       (uint32_t)SRC_VAL, indices[0], (uint32_t)SRC_VAL,
+                indices[0], regVal};
+  for (uint32_t v = 1; v < n; v++)
+    *(steps++) = {unite,      (uint32_t)SRC_REG, regVal,
+                  (uint32_t)SRC_VAL, indices[v], regVal};
 }
 
 entities::sphere3::sphere3(float xcenter, float ycenter, float zcenter,
@@ -109,6 +591,13 @@ entities::sphere3::sphere3(float xcenter, float ycenter, float zcenter,
 
 uint8_t entities::sphere3::type() const { return ENT_TYPE_SPHERE; }
 
+bool entities::sphere3::bounds(glm::vec3 &min, glm::vec3 &max) const {
+  glm::vec3 r(std::fabs(radius));
+  min = center - r;
+  max = center + r;
+  return true;
+}
+
 size_t entities::sphere3::num_render_bytes() const { return sizeof(i_sphere); }
 
 void entities::sphere3::write_render_bytes(uint8_t *&bytes) const {
@@ -137,6 +626,13 @@ entities::cylinder3::cylinder3(float p1x, float p1y, float p1z, float p2x,
 
 uint8_t entities::cylinder3::type() const { return ENT_TYPE_CYLINDER; }
 
+bool entities::cylinder3::bounds(glm::vec3 &min, glm::vec3 &max) const {
+  glm::vec3 r(radius);
+  min = glm::min(point1, point2) - r;
+  max = glm::max(point1, point2) + r;
+  return true;
+}
+
 size_t entities::cylinder3::num_render_bytes() const {
   return sizeof(i_cylinder);
 }
@@ -176,11 +672,403 @@ void entities::halfspace::write_render_bytes(uint8_t *&bytes) const {
   bytes += sizeof(ient);
 }
 
+static void build_bvh_node(std::vector<bvh_node> &nodes, uint32_t nodeIndex,
+                           size_t begin, size_t end,
+                           const std::vector<glm::vec3> &mins,
+                           const std::vector<glm::vec3> &maxs,
+                           std::vector<uint32_t> &order, size_t leafSize) {
+  glm::vec3 bmin = mins[order[begin]], bmax = maxs[order[begin]];
+  glm::vec3 cmin = (bmin + bmax) * 0.5f, cmax = cmin;
+  for (size_t i = begin + 1; i < end; i++) {
+    bmin = glm::min(bmin, mins[order[i]]);
+    bmax = glm::max(bmax, maxs[order[i]]);
+    glm::vec3 c = (mins[order[i]] + maxs[order[i]]) * 0.5f;
+    cmin = glm::min(cmin, c);
+    cmax = glm::max(cmax, c);
+  }
+  nodes[nodeIndex] = {{bmin.x, bmin.y, bmin.z, bmax.x, bmax.y, bmax.z},
+                      (uint32_t)begin,
+                      (uint32_t)(end - begin)};
+  if (end - begin <= leafSize)
+    return;
+
+  // Split at the median centroid along the longest axis of the centroids.
+  glm::vec3 extent = cmax - cmin;
+  int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2)
+                                 : (extent.y > extent.z ? 1 : 2);
+  size_t mid = (begin + end) / 2;
+  std::nth_element(order.begin() + begin, order.begin() + mid,
+                   order.begin() + end, [&](uint32_t a, uint32_t b) {
+                     return mins[a][axis] + maxs[a][axis] <
+                            mins[b][axis] + maxs[b][axis];
+                   });
+
+  // Children are stored next to each other.
+  uint32_t child = (uint32_t)nodes.size();
+  nodes[nodeIndex].first = child;
+  nodes[nodeIndex].count = 0;
+  nodes.emplace_back();
+  nodes.emplace_back();
+  build_bvh_node(nodes, child, begin, mid, mins, maxs, order, leafSize);
+  build_bvh_node(nodes, child + 1, mid, end, mins, maxs, order, leafSize);
+}
+
+std::vector<bvh_node> entities::build_bvh(const std::vector<glm::vec3> &mins,
+                                          const std::vector<glm::vec3> &maxs,
+                                          std::vector<uint32_t> &order,
+                                          size_t leafSize) {
+  order.resize(mins.size());
+  for (size_t i = 0; i < order.size(); i++)
+    order[i] = (uint32_t)i;
+  std::vector<bvh_node> nodes;
+  if (mins.empty())
+    return nodes;
+  nodes.reserve(2 * (mins.size() / leafSize + 1));
+  nodes.emplace_back();
+  build_bvh_node(nodes, 0, 0, mins.size(), mins, maxs, order, leafSize);
+  return nodes;
+}
+
+entities::bvh_union::bvh_union(const std::vector<ent_ref> &prims) {
+  std::vector<glm::vec3> mins(prims.size()), maxs(prims.size());
+  for (size_t i = 0; i < prims.size(); i++)
+    prims[i]->bounds(mins[i], maxs[i]);
+  std::vector<uint32_t> order;
+  nodes = build_bvh(mins, maxs, order);
+  primitives.reserve(prims.size());
+  for (uint32_t i : order)
+    primitives.push_back(prims[i]);
+
+  m_numBytes = sizeof(i_bvh) + sizeof(bvh_node) * nodes.size() +
+               sizeof(bvh_prim) * primitives.size();
+  for (const ent_ref &prim : primitives)
+    m_numBytes += ((simp_entity *)prim.get())->num_render_bytes();
+}
+
+uint8_t entities::bvh_union::type() const { return ENT_TYPE_BVH; }
+
+void entities::bvh_union::collect_simple(std::vector<entity *> &ents) {
+  ents.push_back(this);
+  for (const ent_ref &prim : primitives)
+    prim->collect_simple(ents);
+}
+
+bool entities::bvh_union::bounds(glm::vec3 &min, glm::vec3 &max) const {
+  const float *b = nodes.front().bounds;
+  min = {b[0], b[1], b[2]};
+  max = {b[3], b[4], b[5]};
+  return true;
+}
+
+size_t entities::bvh_union::num_render_bytes() const { return m_numBytes; }
+
+void entities::bvh_union::write_render_bytes(uint8_t *&bytes) const {
+  i_bvh header = {(uint32_t)nodes.size(), (uint32_t)primitives.size()};
+  std::memcpy(bytes, &header, sizeof(header));
+  std::memcpy(bytes + sizeof(header), nodes.data(),
+              sizeof(bvh_node) * nodes.size());
+  bvh_prim *table = (bvh_prim *)(bytes + sizeof(header) +
+                                 sizeof(bvh_node) * nodes.size());
+  uint8_t *dst = (uint8_t *)(table + primitives.size());
+  for (const ent_ref &prim : primitives) {
+    *(table++) = {(uint32_t)(dst - bytes), (uint32_t)prim->type()};
+    ((simp_entity *)prim.get())->write_render_bytes(dst);
+  }
+  bytes = dst;
+}
+
+entities::beam_lattice::beam_lattice(const std::vector<glm::vec3> &nodes,
+                                     const std::vector<uint32_t> &edges,
+                                     float radius)
+    : nodes(nodes), edges(edges), radius(radius) {
+  if (edges.empty() || edges.size() % 2)
+    throw "A beam lattice needs at least one edge, given as pairs of indices.";
+  for (uint32_t i : edges) {
+    if (i >= nodes.size())
+      throw "Beam lattice edge refers to a node that does not exist.";
+  }
+  build_grid();
+}
+
+void entities::beam_lattice::build_grid() {
+  size_t nEdges = edges.size() / 2;
+  glm::vec3 r(std::fabs(radius));
+  std::vector<glm::vec3> mins(nEdges), maxs(nEdges);
+  for (size_t ei = 0; ei < nEdges; ei++) {
+    const glm::vec3 &a = nodes[edges[2 * ei]];
+    const glm::vec3 &b = nodes[edges[2 * ei + 1]];
+    mins[ei] = glm::min(a, b) - r;
+    maxs[ei] = glm::max(a, b) + r;
+    m_min = ei == 0 ? mins[ei] : glm::min(m_min, mins[ei]);
+    m_max = ei == 0 ? maxs[ei] : glm::max(m_max, maxs[ei]);
+  }
+
+  // Roughly one edge per cell, growing the cells if there are too many.
+  glm::vec3 extent = glm::max(m_max - m_min, glm::vec3(1e-6f));
+  m_cellSize = std::cbrt(extent.x * extent.y * extent.z / (float)nEdges);
+  m_cellSize = std::max(m_cellSize, std::max(extent.x, std::max(extent.y, extent.z)) /
+                                        (float)LATTICE_MAX_CELLS);
+  while (true) {
+    size_t nCells = 1;
+    for (int a = 0; a < 3; a++) {
+      m_dims[a] = std::max(1u, (uint32_t)std::ceil(extent[a] / m_cellSize));
+      nCells *= m_dims[a];
+    }
+    if (nCells <= LATTICE_MAX_CELLS)
+      break;
+    m_cellSize *= 1.25f;
+  }
+
+  // Every edge is listed in all the cells overlapped by its bounding box.
+  auto cell_range = [&](size_t ei, uint32_t lo[3], uint32_t hi[3]) {
+    for (int a = 0; a < 3; a++) {
+      lo[a] = (uint32_t)std::clamp(
+          (int64_t)std::floor((mins[ei][a] - m_min[a]) / m_cellSize), (int64_t)0,
+          (int64_t)m_dims[a] - 1);
+      hi[a] = (uint32_t)std::clamp(
+          (int64_t)std::floor((maxs[ei][a] - m_min[a]) / m_cellSize), (int64_t)0,
+          (int64_t)m_dims[a] - 1);
+    }
+  };
+  size_t nCells = (size_t)m_dims[0] * m_dims[1] * m_dims[2];
+  m_cellStarts.assign(nCells + 1, 0);
+  uint32_t lo[3], hi[3];
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t ei = 0; ei < nEdges; ei++) {
+      cell_range(ei, lo, hi);
+      for (uint32_t z = lo[2]; z <= hi[2]; z++) {
+        for (uint32_t y = lo[1]; y <= hi[1]; y++) {
+          for (uint32_t x = lo[0]; x <= hi[0]; x++) {
+            size_t ci = x + m_dims[0] * (y + (size_t)m_dims[1] * z);
+            if (pass == 0)
+              m_cellStarts[ci + 1]++;
+            else
+              m_cellEdges[m_cellStarts[ci]++] = (uint32_t)ei;
+          }
+        }
+      }
+    }
+    if (pass == 0) {
+      for (size_t ci = 0; ci < nCells; ci++)
+        m_cellStarts[ci + 1] += m_cellStarts[ci];
+      m_cellEdges.resize(m_cellStarts.back());
+    }
+  }
+  // The second pass advanced every start to the end of its cell.
+  for (size_t ci = nCells; ci > 0; ci--)
+    m_cellStarts[ci] = m_cellStarts[ci - 1];
+  m_cellStarts[0] = 0;
+}
+
+uint8_t entities::beam_lattice::type() const { return ENT_TYPE_LATTICE; }
+
+bool entities::beam_lattice::bounds(glm::vec3 &min, glm::vec3 &max) const {
+  min = m_min;
+  max = m_max;
+  return true;
+}
+
+size_t entities::beam_lattice::num_render_bytes() const {
+  return sizeof(i_lattice) + sizeof(float) * 3 * edges.size() +
+         sizeof(uint32_t) * (m_cellStarts.size() + m_cellEdges.size());
+}
+
+void entities::beam_lattice::write_render_bytes(uint8_t *&bytes) const {
+  i_lattice header = {std::fabs(radius),
+                      {m_min.x, m_min.y, m_min.z},
+                      m_cellSize,
+                      {m_dims[0], m_dims[1], m_dims[2]},
+                      (uint32_t)(edges.size() / 2)};
+  std::memcpy(bytes, &header, sizeof(header));
+  bytes += sizeof(header);
+  float *coords = (float *)bytes;
+  for (uint32_t ni : edges) {
+    const glm::vec3 &node = nodes[ni];
+    *(coords++) = node.x;
+    *(coords++) = node.y;
+    *(coords++) = node.z;
+  }
+  bytes = (uint8_t *)coords;
+  std::memcpy(bytes, m_cellStarts.data(),
+              sizeof(uint32_t) * m_cellStarts.size());
+  bytes += sizeof(uint32_t) * m_cellStarts.size();
+  std::memcpy(bytes, m_cellEdges.data(), sizeof(uint32_t) * m_cellEdges.size());
+  bytes += sizeof(uint32_t) * m_cellEdges.size();
+}
+
+static glm::mat4 affine_matrix(const point_op &op) {
+  glm::mat4 m(1.0f);
+  for (int r = 0; r < 3; r++) {
+    for (int c = 0; c < 4; c++)
+      m[c][r] = op.params[r * 4 + c];
+  }
+  return m;
+}
+
+static point_op affine_op(const glm::mat4 &m) {
+  point_op op = {};
+  op.type = POINT_OP_AFFINE;
+  for (int r = 0; r < 3; r++) {
+    for (int c = 0; c < 4; c++)
+      op.params[r * 4 + c] = m[c][r];
+  }
+  return op;
+}
+
+/* The largest singular value of the matrix, from the closed form of the largest
+ * eigenvalue of its symmetric square. It is exact, so the distances scaled by
+ * its inverse stay lower bounds, which an iterative estimate from below doesn't
+ * guarantee. */
+static double largest_stretch(const glm::mat3 &m) {
+  double a[3][3];
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      a[i][j] = 0.0;
+      for (int k = 0; k < 3; k++)
+        a[i][j] += (double)m[i][k] * (double)m[j][k];
+    }
+  }
+  double off = a[0][1] * a[0][1] + a[0][2] * a[0][2] + a[1][2] * a[1][2];
+  double eig;
+  if (off == 0.0) {
+    eig = std::max(a[0][0], std::max(a[1][1], a[2][2]));
+  } else {
+    double q = (a[0][0] + a[1][1] + a[2][2]) / 3.0;
+    double d0 = a[0][0] - q, d1 = a[1][1] - q, d2 = a[2][2] - q;
+    double p = std::sqrt((d0 * d0 + d1 * d1 + d2 * d2 + 2.0 * off) / 6.0);
+    // Half the determinant of (a - q * I) / p, which is within [-1, 1].
+    double r = (d0 * (d1 * d2 - a[1][2] * a[1][2]) -
+                a[0][1] * (a[0][1] * d2 - a[1][2] * a[0][2]) +
+                a[0][2] * (a[0][1] * a[1][2] - d1 * a[0][2])) /
+               (2.0 * p * p * p);
+    double phi = std::acos(std::min(1.0, std::max(-1.0, r))) / 3.0;
+    eig = q + 2.0 * p * std::cos(phi);
+  }
+  return std::sqrt(std::max(eig, 0.0));
+}
+
+entities::render_context::render_context() { regMap = &m_regMaps[m_scope]; }
+
+void entities::render_context::push(const entity *node, uint32_t variant,
+                                    const point_op &op, float distScale,
+                                    const glm::mat4 &toParent) {
+  m_frames.push_back({dist_scale, to_world, affine, regMap});
+  m_scope.emplace_back(node, variant);
+  regMap = &m_regMaps[m_scope];
+  ops.push_back(op);
+  dist_scale *= distScale;
+  to_world = to_world * toParent;
+}
+
+void entities::render_context::push_affine(const entity *node,
+                                           const glm::mat4 &toParent) {
+  glm::mat4 inv = glm::inverse(toParent);
+  // The largest stretch of the inverse converts child distances into lower
+  // bounds of the distances in the parent space.
+  float stretch = (float)largest_stretch(glm::mat3(inv));
+  push(node, 0, affine_op(inv), 1.0f / stretch, toParent);
+}
+
+void entities::render_context::push_fold(const entity *node, uint32_t variant,
+                                         const point_op &op) {
+  push(node, variant, op, 1.0f, glm::mat4(1.0f));
+  affine = false;
+}
+
+void entities::render_context::pop() {
+  const frame &f = m_frames.back();
+  dist_scale = f.dist_scale;
+  to_world = f.to_world;
+  affine = f.affine;
+  regMap = f.regMap;
+  m_frames.pop_back();
+  m_scope.pop_back();
+  ops.pop_back();
+}
+
+op_defn entities::render_context::world_op(op_defn op) const {
+  if (ops.empty())
+    return op;
+  if (!affine && (op.type == op_type::OP_LINBLEND ||
+                  op.type == op_type::OP_SMOOTHBLEND))
+    throw "Linear and smooth blends cannot be used inside a pattern.";
+  auto mapPoint = [this](float *p) {
+    glm::vec3 pt(to_world * glm::vec4(p[0], p[1], p[2], 1.0f));
+    p[0] = pt.x;
+    p[1] = pt.y;
+    p[2] = pt.z;
+  };
+  switch (op.type) {
+  case op_type::OP_OFFSET:
+    op.data.offset_distance *= dist_scale;
+    break;
+  case op_type::OP_LINBLEND:
+    mapPoint(op.data.lin_blend.p1);
+    mapPoint(op.data.lin_blend.p2);
+    break;
+  case op_type::OP_SMOOTHBLEND:
+    mapPoint(op.data.smooth_blend.p1);
+    mapPoint(op.data.smooth_blend.p2);
+    break;
+  case op_type::OP_NONE:
+    break;
+  default:
+    op.data.blend_radius *= dist_scale;
+    break;
+  }
+  return op;
+}
+
+void entities::render_context::write_wrapper(
+    uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types,
+    size_t &currentOffset, size_t innerOffset, uint8_t innerType,
+    const uint8_t *innerBytes) const {
+  std::vector<point_op> chain;
+  auto append = [&chain](const point_op &op) {
+    // Consecutive affine maps are combined into one.
+    if (op.type == POINT_OP_AFFINE && !chain.empty() &&
+        chain.back().type == POINT_OP_AFFINE)
+      chain.back() = affine_op(affine_matrix(op) * affine_matrix(chain.back()));
+    else
+      chain.push_back(op);
+  };
+  for (const point_op &op : ops)
+    append(op);
+  float scale = dist_scale;
+  if (innerType == ENT_TYPE_XFORM) {
+    i_xform inner;
+    std::memcpy(&inner, innerBytes, sizeof(inner));
+    for (uint32_t i = 0; i < inner.num_ops; i++) {
+      point_op op;
+      std::memcpy(&op, innerBytes + sizeof(inner) + i * sizeof(point_op),
+                  sizeof(op));
+      append(op);
+    }
+    scale *= inner.dist_scale;
+    innerOffset -= inner.inner_back;
+    innerType = (uint8_t)inner.inner_type;
+  }
+  i_xform header = {(uint32_t)(currentOffset - innerOffset),
+                    (uint32_t)innerType, (uint32_t)chain.size(), scale};
+  *(offsets++) = (uint32_t)currentOffset;
+  *(types++) = ENT_TYPE_XFORM;
+  std::memcpy(bytes, &header, sizeof(header));
+  bytes += sizeof(header);
+  std::memcpy(bytes, chain.data(), sizeof(point_op) * chain.size());
+  bytes += sizeof(point_op) * chain.size();
+  currentOffset += sizeof(header) + sizeof(point_op) * chain.size();
+}
+
+bool entities::entity::bounds(glm::vec3 &, glm::vec3 &) const {
+  return false;
+}
+
 void entities::entity::render_data_size(size_t &nBytes, size_t &nEntities,
                                         size_t &nSteps) const {
   std::unordered_set<entity *> simples;
-  render_data_size_internal(nBytes, nSteps, simples);
-  nEntities = simples.size();
+  size_t nUnshared = 0;
+  render_data_size_internal(nBytes, nUnshared, nSteps, simples);
+  nEntities = nUnshared + simples.size();
 }
 
 void entities::entity::copy_render_data(uint8_t *&bytes, uint32_t *&offsets,
@@ -188,7 +1076,7 @@ void entities::entity::copy_render_data(uint8_t *&bytes, uint32_t *&offsets,
                                         op_step *&steps) const {
   size_t entityIndex = 0;
   size_t currentOffset = 0;
-  std::unordered_map<entity *, uint32_t> regMap;
+  render_context ctx;
   copy_render_data_internal(bytes, offsets, types, steps, entityIndex,
-                            currentOffset, 0, regMap);
+                            currentOffset, 0, ctx);
 }
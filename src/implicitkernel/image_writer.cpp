@@ -0,0 +1,630 @@
+#include <implicitkernel/image_writer.h>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <zlib.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+static bool has_extension(const std::string& path, const std::string& ext)
+{
+    if (path.size() < ext.size())
+        return false;
+    return std::equal(ext.begin(), ext.end(), path.end() - ext.size(),
+        [](char a, char b) { return a == std::tolower((unsigned char)b); });
+}
+
+static void write_le(std::ostream& file, uint32_t value, size_t nBytes)
+{
+    for (size_t i = 0; i < nBytes; i++)
+        file.put((char)((value >> (8 * i)) & 0xff));
+}
+
+/*Binary PPM. The rows are stored from the top, so they are written as they come.*/
+class ppm_writer : public util::image_writer
+{
+protected:
+    void write_row(const uint32_t* pixels) override
+    {
+        uint8_t* dst = m_row.data();
+        for (uint32_t x = 0; x < m_width; x++)
+        {
+            *(dst++) = (uint8_t)(pixels[x]);
+            *(dst++) = (uint8_t)(pixels[x] >> 8);
+            *(dst++) = (uint8_t)(pixels[x] >> 16);
+        }
+        m_file.write((const char*)m_row.data(), m_row.size());
+    }
+
+public:
+    ppm_writer(const std::string& path, uint32_t width, uint32_t height)
+        : image_writer(path, width, height)
+    {
+        m_row.resize((size_t)width * 3);
+        m_file << "P6\n" << width << " " << height << "\n255\n";
+    }
+};
+
+/*24 bit BMP. A negative height in the header stores the rows from the top, so they are written as they
+come. The rows are padded to multiples of 4 bytes.*/
+class bmp_writer : public util::image_writer
+{
+protected:
+    void write_row(const uint32_t* pixels) override
+    {
+        uint8_t* dst = m_row.data();
+        for (uint32_t x = 0; x < m_width; x++)
+        {
+            *(dst++) = (uint8_t)(pixels[x] >> 16);
+            *(dst++) = (uint8_t)(pixels[x] >> 8);
+            *(dst++) = (uint8_t)(pixels[x]);
+        }
+        m_file.write((const char*)m_row.data(), m_row.size());
+    }
+
+public:
+    bmp_writer(const std::string& path, uint32_t width, uint32_t height)
+        : image_writer(path, width, height)
+    {
+        static constexpr uint32_t headerSize = 14 + 40;
+        uint64_t rowSize = ((uint64_t)width * 3 + 3) / 4 * 4;
+        uint64_t fileSize = headerSize + rowSize * height;
+        if (fileSize > UINT32_MAX || height > INT32_MAX)
+            throw "The image is too large for a BMP file.";
+        m_row.resize((size_t)rowSize, 0);
+        // File header.
+        m_file.put('B');
+        m_file.put('M');
+        write_le(m_file, (uint32_t)fileSize, 4);
+        write_le(m_file, 0, 4);
+        write_le(m_file, headerSize, 4);
+        // Info header.
+        write_le(m_file, 40, 4);
+        write_le(m_file, width, 4);
+        write_le(m_file, (uint32_t)(-(int32_t)height), 4);
+        write_le(m_file, 1, 2); // Planes.
+        write_le(m_file, 24, 2); // Bits per pixel.
+        write_le(m_file, 0, 4); // No compression.
+        write_le(m_file, (uint32_t)(rowSize * height), 4);
+        write_le(m_file, 2835, 4); // 72 dpi.
+        write_le(m_file, 2835, 4);
+        write_le(m_file, 0, 4);
+        write_le(m_file, 0, 4);
+    }
+};
+
+/*24 bit PNG, compressed with the fastest level of zlib because the images are written while rendering. The
+rows are not filtered, and the compressed data is written in IDAT chunks as it comes out of zlib.*/
+class png_writer : public util::image_writer
+{
+    static constexpr size_t CHUNK_SIZE = 1 << 16;
+    z_stream m_stream;
+    std::vector<uint8_t> m_chunk;
+
+    void write_chunk(const char* type, const uint8_t* data, uint32_t size)
+    {
+        for (int i = 3; i >= 0; i--)
+            m_file.put((char)((size >> (8 * i)) & 0xff));
+        m_file.write(type, 4);
+        uLong crc = crc32(0L, (const Bytef*)type, 4);
+        if (size > 0)
+        {
+            m_file.write((const char*)data, size);
+            crc = crc32(crc, data, size);
+        }
+        for (int i = 3; i >= 0; i--)
+            m_file.put((char)((crc >> (8 * i)) & 0xff));
+    }
+
+    /*Runs zlib on the pending input, and writes every chunk it fills.*/
+    void deflate_pending(int flush)
+    {
+        int status;
+        do
+        {
+            status = deflate(&m_stream, flush);
+            if (status == Z_STREAM_ERROR)
+                throw "Failed to compress the image.";
+            size_t size = CHUNK_SIZE - m_stream.avail_out;
+            if (m_stream.avail_out == 0 || (flush == Z_FINISH && size > 0))
+            {
+                write_chunk("IDAT", m_chunk.data(), (uint32_t)size);
+                m_stream.next_out = m_chunk.data();
+                m_stream.avail_out = (uInt)CHUNK_SIZE;
+            }
+        } while (m_stream.avail_in > 0 || (flush == Z_FINISH && status != Z_STREAM_END));
+    }
+
+protected:
+    void write_row(const uint32_t* pixels) override
+    {
+        uint8_t* dst = m_row.data();
+        *(dst++) = 0; // No filter.
+        for (uint32_t x = 0; x < m_width; x++)
+        {
+            *(dst++) = (uint8_t)(pixels[x]);
+            *(dst++) = (uint8_t)(pixels[x] >> 8);
+            *(dst++) = (uint8_t)(pixels[x] >> 16);
+        }
+        m_stream.next_in = m_row.data();
+        m_stream.avail_in = (uInt)m_row.size();
+        deflate_pending(Z_NO_FLUSH);
+    }
+
+    void write_end() override
+    {
+        deflate_pending(Z_FINISH);
+        write_chunk("IEND", nullptr, 0);
+    }
+
+public:
+    png_writer(const std::string& path, uint32_t width, uint32_t height)
+        : image_writer(path, width, height)
+    {
+        if (width > INT32_MAX || height > INT32_MAX || (uint64_t)width * 3 + 1 > UINT32_MAX)
+            throw "The image is too large for a PNG file.";
+        m_row.resize((size_t)width * 3 + 1);
+        m_chunk.resize(CHUNK_SIZE);
+        std::memset(&m_stream, 0, sizeof(m_stream));
+        if (deflateInit(&m_stream, Z_BEST_SPEED) != Z_OK)
+            throw "Failed to initialize the compression of the image.";
+        m_stream.next_out = m_chunk.data();
+        m_stream.avail_out = (uInt)CHUNK_SIZE;
+
+        static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        m_file.write((const char*)signature, sizeof(signature));
+        uint8_t header[13];
+        for (int i = 0; i < 4; i++)
+        {
+            header[i] = (uint8_t)(width >> (8 * (3 - i)));
+            header[4 + i] = (uint8_t)(height >> (8 * (3 - i)));
+        }
+        header[8] = 8;  // Bits per channel.
+        header[9] = 2;  // RGB.
+        header[10] = 0; // Deflate.
+        header[11] = 0; // Adaptive filtering.
+        header[12] = 0; // Not interlaced.
+        write_chunk("IHDR", header, sizeof(header));
+    }
+
+    ~png_writer() override
+    {
+        deflateEnd(&m_stream);
+    }
+};
+
+/*Portable float map, with three little endian floats per pixel. The rows are stored from the bottom. The
+kernels only produce 8 bit colors, so this is for tools that want the colors as floats.*/
+class pfm_writer : public util::image_writer
+{
+protected:
+    void write_row(const uint32_t* pixels) override
+    {
+        uint8_t* dst = m_row.data();
+        for (uint32_t x = 0; x < m_width; x++)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                float value = (float)((pixels[x] >> (8 * c)) & 0xff) / 255.0f;
+                uint32_t bits;
+                std::memcpy(&bits, &value, sizeof(bits));
+                for (int i = 0; i < 4; i++)
+                    *(dst++) = (uint8_t)(bits >> (8 * i));
+            }
+        }
+        m_file.write((const char*)m_row.data(), m_row.size());
+    }
+
+public:
+    pfm_writer(const std::string& path, uint32_t width, uint32_t height)
+        : image_writer(path, width, height)
+    {
+        m_row.resize((size_t)width * 12);
+        // The negative scale means little endian.
+        m_file << "PF\n" << width << " " << height << "\n-1.0\n";
+    }
+
+    bool bottom_up() const override
+    {
+        return true;
+    }
+};
+
+/*Y4M video with 4:2:0 chroma, which every encoder reads from a pipe. The planes of a frame are written after
+all its rows have come in. The colors are converted with BT.601 in the limited range.*/
+class y4m_writer : public util::image_writer
+{
+    static constexpr uint32_t FPS = 30; // Encoders can override the rate of the stream.
+    uint32_t m_frameHeight;
+    uint32_t m_frameRow = 0;
+    std::vector<uint8_t> m_y, m_u, m_v;
+    std::vector<uint32_t> m_evenRow; // Chroma is averaged over pairs of rows.
+
+    /*Averages the colors of up to 2x2 pixels into one chroma sample.*/
+    void write_chroma(const uint32_t* rowA, const uint32_t* rowB)
+    {
+        uint32_t cw = (m_width + 1) / 2;
+        size_t offset = (size_t)(m_frameRow / 2) * cw;
+        for (uint32_t cx = 0; cx < cw; cx++)
+        {
+            int sum[3] = { 0, 0, 0 };
+            int count = 0;
+            for (uint32_t x = 2 * cx; x < std::min(2 * cx + 2, m_width); x++)
+            {
+                for (const uint32_t* row : { rowA, rowB })
+                {
+                    if (!row)
+                        continue;
+                    for (int c = 0; c < 3; c++)
+                        sum[c] += (row[x] >> (8 * c)) & 0xff;
+                    count++;
+                }
+            }
+            int r = sum[0] / count, g = sum[1] / count, b = sum[2] / count;
+            m_u[offset + cx] = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            m_v[offset + cx] = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
+    }
+
+protected:
+    void write_row(const uint32_t* pixels) override
+    {
+        uint8_t* y = m_y.data() + (size_t)m_frameRow * m_width;
+        for (uint32_t x = 0; x < m_width; x++)
+        {
+            int r = pixels[x] & 0xff, g = (pixels[x] >> 8) & 0xff, b = (pixels[x] >> 16) & 0xff;
+            y[x] = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+        }
+        if (m_frameRow % 2)
+            write_chroma(m_evenRow.data(), pixels);
+        else if (m_frameRow + 1 == m_frameHeight)
+            write_chroma(pixels, nullptr);
+        else
+            std::copy_n(pixels, m_width, m_evenRow.data());
+        if (++m_frameRow < m_frameHeight)
+            return;
+        m_frameRow = 0;
+        m_file << "FRAME\n";
+        m_file.write((const char*)m_y.data(), m_y.size());
+        m_file.write((const char*)m_u.data(), m_u.size());
+        m_file.write((const char*)m_v.data(), m_v.size());
+    }
+
+public:
+    y4m_writer(const std::string& path, uint32_t width, uint32_t height, uint32_t nFrames)
+        : image_writer(path, width, height * nFrames), m_frameHeight(height)
+    {
+        size_t chromaSize = (size_t)((width + 1) / 2) * ((height + 1) / 2);
+        m_y.resize((size_t)width * height);
+        m_u.resize(chromaSize);
+        m_v.resize(chromaSize);
+        m_evenRow.resize(width);
+        m_file << "YUV4MPEG2 W" << width << " H" << height << " F" << FPS << ":1 Ip A1:1 C420jpeg\n";
+    }
+};
+
+util::image_writer::image_writer(const std::string& path, uint32_t width, uint32_t height)
+    : m_file(path == "-" ? (std::ostream&)std::cout : m_fileStream), m_width(width), m_height(height)
+{
+    if (width == 0 || height == 0)
+        throw "The image must have at least one pixel.";
+    if (path == "-")
+    {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        return;
+    }
+    m_fileStream.open(path, std::ios::binary | std::ios::trunc);
+    if (!m_fileStream)
+        throw "Cannot open the image file for writing.";
+}
+
+std::unique_ptr<util::image_writer> util::image_writer::create(const std::string& path, uint32_t width,
+    uint32_t height)
+{
+    if (has_extension(path, ".ppm"))
+        return std::make_unique<ppm_writer>(path, width, height);
+    if (has_extension(path, ".bmp"))
+        return std::make_unique<bmp_writer>(path, width, height);
+    if (has_extension(path, ".png"))
+        return std::make_unique<png_writer>(path, width, height);
+    if (has_extension(path, ".pfm"))
+        return std::make_unique<pfm_writer>(path, width, height);
+    throw "Cannot write images of this format.";
+}
+
+std::unique_ptr<util::image_writer> util::image_writer::create_video(const std::string& path, uint32_t width,
+    uint32_t height, uint32_t nFrames)
+{
+    if (!is_video(path))
+        throw "Cannot write videos of this format.";
+    if (nFrames == 0)
+        throw "The video must have at least one frame.";
+    if ((uint64_t)height * nFrames > UINT32_MAX)
+        throw "The video has too many frames.";
+    return std::make_unique<y4m_writer>(path, width, height, nFrames);
+}
+
+bool util::image_writer::is_video(const std::string& path)
+{
+    return path == "-" || has_extension(path, ".y4m");
+}
+
+uint32_t util::image_writer::width() const
+{
+    return m_width;
+}
+
+uint32_t util::image_writer::height() const
+{
+    return m_height;
+}
+
+bool util::image_writer::bottom_up() const
+{
+    return false;
+}
+
+void util::image_writer::write_end()
+{
+}
+
+void util::image_writer::write_rows(const uint32_t* pixels, uint32_t nRows, ptrdiff_t stride)
+{
+    if (m_rowsWritten + nRows > m_height)
+        throw "Too many rows for the image.";
+    for (uint32_t r = 0; r < nRows; r++)
+        write_row(pixels + (ptrdiff_t)r * stride);
+    m_rowsWritten += nRows;
+    if (!m_file)
+        throw "Cannot write the image file.";
+}
+
+void util::image_writer::write_rows(const uint32_t* pixels, uint32_t nRows)
+{
+    write_rows(pixels, nRows, (ptrdiff_t)m_width);
+}
+
+void util::image_writer::close()
+{
+    if (m_rowsWritten != m_height)
+        throw "The image is missing rows.";
+    write_end();
+    if (m_fileStream.is_open())
+        m_fileStream.close();
+    else
+        m_file.flush();
+    if (!m_file)
+        throw "Cannot write the image file.";
+}
+
+util::image_stream::image_stream(std::unique_ptr<image_writer> writer)
+    : m_writer(std::move(writer))
+{
+    m_thread = std::thread(&image_stream::run, this);
+}
+
+util::image_stream::~image_stream()
+{
+    try
+    {
+        finish();
+    }
+    catch (const char*)
+    {
+    }
+}
+
+void util::image_stream::run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        m_cv.wait(lock, [this]() { return !m_jobs.empty() || m_closing; });
+        if (m_jobs.empty())
+            break;
+        job& next = m_jobs.front();
+        if (!m_error)
+        {
+            // The rows are written without the lock, so more can be queued meanwhile. The front job stays
+            // in the queue until it is done.
+            lock.unlock();
+            const char* error = nullptr;
+            try
+            {
+                m_writer->write_rows(next.pixels, next.nRows, next.stride);
+            }
+            catch (const char* e)
+            {
+                error = e;
+            }
+            lock.lock();
+            if (error)
+                m_error = error;
+        }
+        std::function<void()> release = std::move(next.release);
+        m_jobs.pop_front();
+        if (release)
+            release();
+        m_cv.notify_all();
+    }
+    if (!m_error)
+    {
+        try
+        {
+            m_writer->close();
+        }
+        catch (const char* e)
+        {
+            m_error = e;
+        }
+    }
+}
+
+const util::image_writer& util::image_stream::writer() const
+{
+    return *m_writer;
+}
+
+void util::image_stream::write_rows(const uint32_t* pixels, uint32_t nRows, ptrdiff_t stride,
+    std::function<void()> release)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_closing)
+        throw "The image is already finished.";
+    m_jobs.push_back({pixels, nRows, stride, std::move(release)});
+    m_cv.notify_all();
+}
+
+void util::image_stream::wait(size_t maxPending)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this, maxPending]() { return m_jobs.size() <= maxPending; });
+}
+
+void util::image_stream::finish()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closing = true;
+        m_cv.notify_all();
+    }
+    if (m_thread.joinable())
+        m_thread.join();
+    if (m_error)
+        throw m_error;
+}
+
+/*Reads the pixels of a binary PPM with 8 bit channels.*/
+static std::vector<uint32_t> read_ppm(std::istream& file, uint32_t& width, uint32_t& height)
+{
+    std::string magic;
+    uint32_t maxValue = 0;
+    file >> magic >> width >> height >> maxValue;
+    if (!file || magic != "P6" || maxValue != 255 || width == 0 || height == 0)
+        throw "Only binary PPM files with 8 bit channels can be read.";
+    file.get(); // The single whitespace before the pixels.
+    std::vector<uint8_t> row((size_t)width * 3);
+    std::vector<uint32_t> pixels((size_t)width * height);
+    for (uint32_t y = 0; y < height; y++)
+    {
+        if (!file.read((char*)row.data(), row.size()))
+            throw "The image file is truncated.";
+        for (uint32_t x = 0; x < width; x++)
+        {
+            const uint8_t* px = row.data() + 3 * x;
+            pixels[(size_t)y * width + x] = px[0] | (px[1] << 8) | (px[2] << 16) | 0xff000000u;
+        }
+    }
+    return pixels;
+}
+
+static uint32_t read_be(const uint8_t* bytes)
+{
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+/*Reverses the filter of one row of a PNG in place. prev is the previous row after its filter was reversed,
+or zeros for the first row.*/
+static void unfilter_png_row(uint8_t filter, uint8_t* row, const uint8_t* prev, size_t size, size_t bpp)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        int a = i >= bpp ? row[i - bpp] : 0;
+        int b = prev[i];
+        int c = i >= bpp ? prev[i - bpp] : 0;
+        int pred = 0;
+        switch (filter)
+        {
+        case 0: pred = 0; break;
+        case 1: pred = a; break;
+        case 2: pred = b; break;
+        case 3: pred = (a + b) / 2; break;
+        case 4:
+        {
+            int p = a + b - c;
+            int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+            pred = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+            break;
+        }
+        default: throw "The PNG file has an unknown filter.";
+        }
+        row[i] = (uint8_t)(row[i] + pred);
+    }
+}
+
+/*Reads the pixels of a PNG with 8 bit gray, RGB or RGBA channels, that is not interlaced.*/
+static std::vector<uint32_t> read_png(std::istream& file, uint32_t& width, uint32_t& height)
+{
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    uint8_t head[8];
+    if (!file.read((char*)head, 8) || std::memcmp(head, signature, 8) != 0)
+        throw "The file is not a PNG image.";
+    size_t channels = 0;
+    std::vector<uint8_t> compressed;
+    while (true)
+    {
+        if (!file.read((char*)head, 8))
+            throw "The image file is truncated.";
+        uint32_t size = read_be(head);
+        std::string type((const char*)head + 4, 4);
+        std::vector<uint8_t> data(size);
+        if (!file.read((char*)data.data(), size) || !file.ignore(4)) // The CRC is not checked.
+            throw "The image file is truncated.";
+        if (type == "IHDR")
+        {
+            if (size < 13)
+                throw "The PNG header is too short.";
+            width = read_be(data.data());
+            height = read_be(data.data() + 4);
+            uint8_t colorType = data[9];
+            channels = colorType == 0 ? 1 : colorType == 2 ? 3 : colorType == 6 ? 4 : 0;
+            if (data[8] != 8 || channels == 0 || data[12] != 0 || width == 0 || height == 0)
+                throw "Only PNG files with 8 bit gray, RGB or RGBA channels, not interlaced, can be read.";
+        }
+        else if (type == "IDAT")
+            compressed.insert(compressed.end(), data.begin(), data.end());
+        else if (type == "IEND")
+            break;
+    }
+    if (channels == 0)
+        throw "The PNG file has no header.";
+    size_t rowSize = (size_t)width * channels;
+    std::vector<uint8_t> raw((rowSize + 1) * height);
+    uLongf rawSize = (uLongf)raw.size();
+    if (uncompress(raw.data(), &rawSize, compressed.data(), (uLong)compressed.size()) != Z_OK ||
+        rawSize != raw.size())
+        throw "Failed to decompress the image.";
+    std::vector<uint8_t> zeros(rowSize, 0);
+    std::vector<uint32_t> pixels((size_t)width * height);
+    for (uint32_t y = 0; y < height; y++)
+    {
+        uint8_t* row = raw.data() + (size_t)y * (rowSize + 1);
+        const uint8_t* prev = y > 0 ? row - rowSize : zeros.data();
+        unfilter_png_row(row[0], row + 1, prev, rowSize, channels);
+        for (uint32_t x = 0; x < width; x++)
+        {
+            const uint8_t* px = row + 1 + x * channels;
+            uint32_t r = px[0], g = channels < 3 ? px[0] : px[1], b = channels < 3 ? px[0] : px[2];
+            pixels[(size_t)y * width + x] = r | (g << 8) | (b << 16) | 0xff000000u;
+        }
+    }
+    return pixels;
+}
+
+std::vector<uint32_t> util::read_image(const std::string& path, uint32_t& width, uint32_t& height)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        throw "Cannot open the image file for reading.";
+    if (has_extension(path, ".ppm"))
+        return read_ppm(file, width, height);
+    if (has_extension(path, ".png"))
+        return read_png(file, width, height);
+    throw "Only .ppm and .png images can be read.";
+}
@@ -0,0 +1,100 @@
+#include <implicitkernel/mapped_file.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+util::mapped_file::mapped_file(const std::string& path)
+{
+#ifdef _WIN32
+    m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+    {
+        m_file = nullptr;
+        throw "Cannot open the file.";
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(m_file, &fileSize))
+    {
+        close();
+        throw "Cannot read the size of the file.";
+    }
+    m_size = (size_t)fileSize.QuadPart;
+    if (m_size == 0)
+        return;
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!m_mapping)
+    {
+        close();
+        throw "Cannot map the file.";
+    }
+    m_data = (const uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!m_data)
+    {
+        close();
+        throw "Cannot map the file.";
+    }
+#else
+    m_fd = open(path.c_str(), O_RDONLY);
+    if (m_fd < 0)
+        throw "Cannot open the file.";
+    struct stat info;
+    if (fstat(m_fd, &info) != 0)
+    {
+        close();
+        throw "Cannot read the size of the file.";
+    }
+    m_size = (size_t)info.st_size;
+    if (m_size == 0)
+        return;
+    void* ptr = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+    if (ptr == MAP_FAILED)
+    {
+        close();
+        throw "Cannot map the file.";
+    }
+    m_data = (const uint8_t*)ptr;
+#endif
+}
+
+util::mapped_file::~mapped_file()
+{
+    close();
+}
+
+void util::mapped_file::close()
+{
+#ifdef _WIN32
+    if (m_data)
+        UnmapViewOfFile(m_data);
+    if (m_mapping)
+        CloseHandle(m_mapping);
+    if (m_file)
+        CloseHandle(m_file);
+    m_mapping = nullptr;
+    m_file = nullptr;
+#else
+    if (m_data)
+        munmap((void*)m_data, m_size);
+    if (m_fd >= 0)
+        ::close(m_fd);
+    m_fd = -1;
+#endif
+    m_data = nullptr;
+    m_size = 0;
+}
+
+const uint8_t* util::mapped_file::data() const
+{
+    return m_data;
+}
+
+size_t util::mapped_file::size() const
+{
+    return m_size;
+}
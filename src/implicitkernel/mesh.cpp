@@ -0,0 +1,433 @@
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <implicitkernel/host_primitives.h>
+#include <implicitkernel/mapped_file.h>
+#include <map>
+#include <thread>
+
+namespace {
+struct vec3_hash {
+  size_t operator()(const glm::vec3 &v) const {
+    // Adding zero turns -0 into +0, so the equal positions hash the same.
+    glm::vec3 key(v.x + 0.0f, v.y + 0.0f, v.z + 0.0f);
+    uint32_t bits[3];
+    std::memcpy(bits, &key, sizeof(bits));
+    return (size_t)bits[0] * 73856093u ^ (size_t)bits[1] * 19349663u ^
+           (size_t)bits[2] * 83492791u;
+  }
+};
+
+glm::vec3 closest_on_triangle(const glm::vec3 &p, const glm::vec3 &a,
+                              const glm::vec3 &b, const glm::vec3 &c,
+                              int &feature) {
+  // Same as the kernel. Features: 0 interior, 1 to 3 vertices, 4 to 6 edges.
+  glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+  float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+  if (d1 <= 0.0f && d2 <= 0.0f) {
+    feature = 1;
+    return a;
+  }
+  glm::vec3 bp = p - b;
+  float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+  if (d3 >= 0.0f && d4 <= d3) {
+    feature = 2;
+    return b;
+  }
+  float vc = d1 * d4 - d3 * d2;
+  if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+    feature = 4;
+    return a + ab * (d1 / (d1 - d3));
+  }
+  glm::vec3 cp = p - c;
+  float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+  if (d6 >= 0.0f && d5 <= d6) {
+    feature = 3;
+    return c;
+  }
+  float vb = d5 * d2 - d1 * d6;
+  if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+    feature = 6;
+    return a + ac * (d2 / (d2 - d6));
+  }
+  float va = d3 * d6 - d5 * d4;
+  if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) {
+    feature = 5;
+    return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+  }
+  float denom = 1.0f / (va + vb + vc);
+  feature = 0;
+  return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+float box_distance(const bvh_node &node, const glm::vec3 &p) {
+  glm::vec3 lo(node.bounds[0], node.bounds[1], node.bounds[2]);
+  glm::vec3 hi(node.bounds[3], node.bounds[4], node.bounds[5]);
+  glm::vec3 d = glm::max(glm::max(lo - p, p - hi), glm::vec3(0.0f));
+  return std::sqrt(glm::dot(d, d));
+}
+
+const char *skip_space(const char *pos, const char *end) {
+  while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\r'))
+    pos++;
+  return pos;
+}
+
+const char *next_line(const char *pos, const char *end) {
+  while (pos < end && *pos != '\n')
+    pos++;
+  return pos < end ? pos + 1 : end;
+}
+
+bool starts_with(const char *pos, const char *end, const char *word) {
+  size_t len = std::strlen(word);
+  return (size_t)(end - pos) >= len && std::memcmp(pos, word, len) == 0;
+}
+
+const char *read_floats(const char *pos, const char *end, float *vals,
+                        int count) {
+  for (int i = 0; i < count; i++) {
+    pos = skip_space(pos, end);
+    if (pos < end && *pos == '+')
+      pos++;
+    auto result = std::from_chars(pos, end, vals[i]);
+    if (result.ec != std::errc())
+      throw "Cannot read the coordinates of a vertex.";
+    pos = result.ptr;
+  }
+  return pos;
+}
+
+void read_binary_stl(const uint8_t *data, uint32_t nTris,
+                     std::vector<glm::vec3> &verts) {
+  // Each record has a normal, three vertices and a 2 byte attribute.
+  verts.resize((size_t)nTris * 3);
+  const uint8_t *record = data + 84;
+  for (uint32_t ti = 0; ti < nTris; ti++, record += 50)
+    std::memcpy(&verts[3 * ti], record + 12, sizeof(float) * 9);
+}
+
+void read_ascii_stl(const char *pos, const char *end,
+                    std::vector<glm::vec3> &verts) {
+  while (pos < end) {
+    pos = skip_space(pos, end);
+    if (starts_with(pos, end, "vertex")) {
+      float coords[3];
+      read_floats(pos + 6, end, coords, 3);
+      verts.emplace_back(coords[0], coords[1], coords[2]);
+    }
+    pos = next_line(pos, end);
+  }
+  if (verts.size() % 3)
+    throw "The STL file has an incomplete facet.";
+}
+
+void read_obj(const char *pos, const char *end, std::vector<glm::vec3> &verts,
+              std::vector<uint32_t> &tris) {
+  std::vector<uint32_t> face;
+  while (pos < end) {
+    pos = skip_space(pos, end);
+    if (starts_with(pos, end, "v ") || starts_with(pos, end, "v\t")) {
+      float coords[3];
+      read_floats(pos + 2, end, coords, 3);
+      verts.emplace_back(coords[0], coords[1], coords[2]);
+    } else if (starts_with(pos, end, "f ") || starts_with(pos, end, "f\t")) {
+      // Polygons are triangulated as fans. Texture and normal indices are
+      // ignored.
+      face.clear();
+      pos += 2;
+      while (true) {
+        pos = skip_space(pos, end);
+        if (pos == end || *pos == '\n' || *pos == '#')
+          break;
+        long index = 0;
+        auto result = std::from_chars(pos, end, index);
+        if (result.ec != std::errc())
+          throw "Cannot read the vertex index of a face.";
+        pos = result.ptr;
+        while (pos < end && !std::isspace((unsigned char)*pos))
+          pos++;
+        long vi = index < 0 ? (long)verts.size() + index : index - 1;
+        if (vi < 0 || vi >= (long)verts.size())
+          throw "A face refers to a vertex that does not exist.";
+        face.push_back((uint32_t)vi);
+      }
+      for (size_t i = 2; i < face.size(); i++) {
+        tris.push_back(face[0]);
+        tris.push_back(face[i - 1]);
+        tris.push_back(face[i]);
+      }
+      continue;
+    }
+    pos = next_line(pos, end);
+  }
+}
+} // namespace
+
+entities::mesh::mesh(const std::vector<glm::vec3> &verts,
+                     const std::vector<uint32_t> &tris) {
+  // Weld coincident vertices.
+  std::unordered_map<glm::vec3, uint32_t, vec3_hash> welded;
+  std::vector<uint32_t> remap(verts.size());
+  for (size_t i = 0; i < verts.size(); i++) {
+    auto match = welded.emplace(verts[i], (uint32_t)vertices.size());
+    if (match.second)
+      vertices.push_back(verts[i]);
+    remap[i] = match.first->second;
+  }
+
+  // Face normals and angle weighted vertex normals.
+  std::vector<std::array<uint32_t, 3>> faces;
+  std::vector<glm::vec3> faceNormals;
+  faces.reserve(tris.size() / 3);
+  faceNormals.reserve(tris.size() / 3);
+  vertex_normals.assign(vertices.size(), glm::vec3(0.0f));
+  for (size_t i = 0; i + 2 < tris.size(); i += 3) {
+    std::array<uint32_t, 3> f = {remap[tris[i]], remap[tris[i + 1]],
+                                 remap[tris[i + 2]]};
+    if (f[0] == f[1] || f[1] == f[2] || f[2] == f[0])
+      continue;
+    glm::vec3 n = glm::cross(vertices[f[1]] - vertices[f[0]],
+                             vertices[f[2]] - vertices[f[0]]);
+    float len = std::sqrt(glm::dot(n, n));
+    if (len == 0.0f)
+      continue;
+    n = n / len;
+    for (int k = 0; k < 3; k++) {
+      glm::vec3 e1 = glm::normalize(vertices[f[(k + 1) % 3]] - vertices[f[k]]);
+      glm::vec3 e2 = glm::normalize(vertices[f[(k + 2) % 3]] - vertices[f[k]]);
+      float angle = std::acos(std::clamp(glm::dot(e1, e2), -1.0f, 1.0f));
+      vertex_normals[f[k]] += n * angle;
+    }
+    faces.push_back(f);
+    faceNormals.push_back(n);
+  }
+  if (faces.empty())
+    throw "The mesh has no valid triangles.";
+  for (glm::vec3 &n : vertex_normals) {
+    float len = std::sqrt(glm::dot(n, n));
+    if (len > 0.0f)
+      n = n / len;
+  }
+
+  // Edge normals are the sums of the normals of the faces sharing the edge.
+  std::unordered_map<uint64_t, glm::vec3> edgeNormals;
+  auto edge_key = [](uint32_t a, uint32_t b) {
+    return a < b ? ((uint64_t)a << 32) | b : ((uint64_t)b << 32) | a;
+  };
+  for (size_t fi = 0; fi < faces.size(); fi++) {
+    for (int k = 0; k < 3; k++) {
+      auto match = edgeNormals.emplace(
+          edge_key(faces[fi][k], faces[fi][(k + 1) % 3]), glm::vec3(0.0f));
+      match.first->second += faceNormals[fi];
+    }
+  }
+
+  std::vector<glm::vec3> mins(faces.size()), maxs(faces.size());
+  for (size_t fi = 0; fi < faces.size(); fi++) {
+    const auto &f = faces[fi];
+    mins[fi] = glm::min(vertices[f[0]], glm::min(vertices[f[1]], vertices[f[2]]));
+    maxs[fi] = glm::max(vertices[f[0]], glm::max(vertices[f[1]], vertices[f[2]]));
+  }
+  std::vector<uint32_t> order;
+  nodes = build_bvh(mins, maxs, order);
+  triangles.resize(faces.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    const auto &f = faces[order[i]];
+    const glm::vec3 &n = faceNormals[order[i]];
+    mesh_tri &tri = triangles[i];
+    tri = {{f[0], f[1], f[2]}, {n.x, n.y, n.z}, {}};
+    for (int k = 0; k < 3; k++) {
+      glm::vec3 en = edgeNormals[edge_key(f[k], f[(k + 1) % 3])];
+      float len = std::sqrt(glm::dot(en, en));
+      en = len > 0.0f ? en / len : n;
+      tri.edge_normals[3 * k] = en.x;
+      tri.edge_normals[3 * k + 1] = en.y;
+      tri.edge_normals[3 * k + 2] = en.z;
+    }
+  }
+}
+
+std::shared_ptr<entities::mesh> entities::mesh::load(const std::string &path) {
+  util::mapped_file file(path);
+  const uint8_t *data = file.data();
+  size_t size = file.size();
+  const char *text = (const char *)data;
+  std::vector<glm::vec3> verts;
+  std::vector<uint32_t> tris;
+  std::string ext = path.size() > 4 ? path.substr(path.size() - 4) : "";
+  std::transform(ext.begin(), ext.end(), ext.begin(),
+                 [](char c) { return (char)std::tolower(c); });
+  if (ext == ".obj") {
+    read_obj(text, text + size, verts, tris);
+  } else {
+    uint32_t nTris = 0;
+    if (size >= 84)
+      std::memcpy(&nTris, data + 80, sizeof(nTris));
+    if (size >= 84 && size == 84 + (size_t)nTris * 50)
+      read_binary_stl(data, nTris, verts);
+    else if (starts_with(text, text + size, "solid"))
+      read_ascii_stl(text, text + size, verts);
+    else
+      throw "Unrecognized mesh file. Expected an STL or OBJ file.";
+    tris.resize(verts.size());
+    for (size_t i = 0; i < tris.size(); i++)
+      tris[i] = (uint32_t)i;
+  }
+  return std::make_shared<mesh>(verts, tris);
+}
+
+float entities::mesh::distance(const glm::vec3 &pt) const {
+  float best = INFINITY;
+  glm::vec3 closest(0.0f);
+  uint32_t bestTri = 0;
+  int bestFeature = 0;
+  std::vector<uint32_t> stack;
+  stack.reserve(64);
+  stack.push_back(0);
+  while (!stack.empty()) {
+    const bvh_node &node = nodes[stack.back()];
+    stack.pop_back();
+    if (box_distance(node, pt) >= best)
+      continue;
+    if (node.count > 0) {
+      for (uint32_t i = node.first; i < node.first + node.count; i++) {
+        const mesh_tri &tri = triangles[i];
+        int feature;
+        glm::vec3 q = closest_on_triangle(pt, vertices[tri.verts[0]],
+                                          vertices[tri.verts[1]],
+                                          vertices[tri.verts[2]], feature);
+        glm::vec3 d = pt - q;
+        float dist = std::sqrt(glm::dot(d, d));
+        if (dist < best) {
+          best = dist;
+          closest = q;
+          bestTri = i;
+          bestFeature = feature;
+        }
+      }
+      continue;
+    }
+    bool leftNear = box_distance(nodes[node.first], pt) <
+                    box_distance(nodes[node.first + 1], pt);
+    stack.push_back(leftNear ? node.first + 1 : node.first);
+    stack.push_back(leftNear ? node.first : node.first + 1);
+  }
+
+  const mesh_tri &tri = triangles[bestTri];
+  glm::vec3 normal;
+  if (bestFeature == 0)
+    normal = glm::vec3(tri.normal[0], tri.normal[1], tri.normal[2]);
+  else if (bestFeature < 4)
+    normal = vertex_normals[tri.verts[bestFeature - 1]];
+  else {
+    const float *en = tri.edge_normals + 3 * (bestFeature - 4);
+    normal = glm::vec3(en[0], en[1], en[2]);
+  }
+  return glm::dot(pt - closest, normal) < 0.0f ? -best : best;
+}
+
+uint8_t entities::mesh::type() const { return ENT_TYPE_MESH; }
+
+bool entities::mesh::bounds(glm::vec3 &min, glm::vec3 &max) const {
+  const float *b = nodes.front().bounds;
+  min = {b[0], b[1], b[2]};
+  max = {b[3], b[4], b[5]};
+  return true;
+}
+
+size_t entities::mesh::num_render_bytes() const {
+  return sizeof(i_mesh) + sizeof(float) * 6 * vertices.size() +
+         sizeof(bvh_node) * nodes.size() + sizeof(mesh_tri) * triangles.size();
+}
+
+void entities::mesh::write_render_bytes(uint8_t *&bytes) const {
+  i_mesh header = {(uint32_t)vertices.size(), (uint32_t)triangles.size(),
+                   (uint32_t)nodes.size()};
+  std::memcpy(bytes, &header, sizeof(header));
+  bytes += sizeof(header);
+  float *coords = (float *)bytes;
+  for (const glm::vec3 &v : vertices) {
+    *(coords++) = v.x;
+    *(coords++) = v.y;
+    *(coords++) = v.z;
+  }
+  for (const glm::vec3 &n : vertex_normals) {
+    *(coords++) = n.x;
+    *(coords++) = n.y;
+    *(coords++) = n.z;
+  }
+  bytes = (uint8_t *)coords;
+  std::memcpy(bytes, nodes.data(), sizeof(bvh_node) * nodes.size());
+  bytes += sizeof(bvh_node) * nodes.size();
+  std::memcpy(bytes, triangles.data(), sizeof(mesh_tri) * triangles.size());
+  bytes += sizeof(mesh_tri) * triangles.size();
+}
+
+std::shared_ptr<entities::distance_grid>
+entities::distance_grid::bake(const mesh &m, uint32_t resolution) {
+  if (resolution == 0)
+    throw "The resolution of the grid must be at least 1.";
+  glm::vec3 bmin, bmax;
+  m.bounds(bmin, bmax);
+  glm::vec3 extent = bmax - bmin;
+  float longest = std::max(extent.x, std::max(extent.y, extent.z));
+  auto grid = std::make_shared<distance_grid>();
+  grid->spacing = longest / (float)resolution;
+  // Two cells of margin on every side, so the surface is always inside.
+  constexpr uint32_t MARGIN = 2;
+  grid->origin = bmin - glm::vec3(grid->spacing * MARGIN);
+  for (int a = 0; a < 3; a++) {
+    grid->dims[a] =
+        (uint32_t)std::ceil(extent[a] / grid->spacing) + 1 + 2 * MARGIN;
+  }
+  size_t nx = grid->dims[0], ny = grid->dims[1], nz = grid->dims[2];
+  grid->values.resize(nx * ny * nz);
+
+  // Every thread fills interleaved z slices.
+  size_t nThreads =
+      std::max(1u, std::min(std::thread::hardware_concurrency(), (uint32_t)nz));
+  std::vector<std::thread> workers;
+  for (size_t ti = 0; ti < nThreads; ti++) {
+    workers.emplace_back([&, ti]() {
+      for (size_t z = ti; z < nz; z += nThreads) {
+        for (size_t y = 0; y < ny; y++) {
+          for (size_t x = 0; x < nx; x++) {
+            glm::vec3 pt = grid->origin +
+                           glm::vec3((float)x, (float)y, (float)z) * grid->spacing;
+            grid->values[x + nx * (y + ny * z)] = m.distance(pt);
+          }
+        }
+      }
+    });
+  }
+  for (std::thread &worker : workers)
+    worker.join();
+  return grid;
+}
+
+uint8_t entities::distance_grid::type() const { return ENT_TYPE_DISTGRID; }
+
+bool entities::distance_grid::bounds(glm::vec3 &min, glm::vec3 &max) const {
+  // The field extrapolates beyond the grid, but the surface is inside it.
+  min = origin;
+  max = origin + glm::vec3((float)(dims[0] - 1), (float)(dims[1] - 1),
+                           (float)(dims[2] - 1)) *
+                     spacing;
+  return true;
+}
+
+size_t entities::distance_grid::num_render_bytes() const {
+  return sizeof(i_distgrid) + sizeof(float) * values.size();
+}
+
+void entities::distance_grid::write_render_bytes(uint8_t *&bytes) const {
+  i_distgrid header = {{origin.x, origin.y, origin.z},
+                       spacing,
+                       {dims[0], dims[1], dims[2]}};
+  std::memcpy(bytes, &header, sizeof(header));
+  bytes += sizeof(header);
+  std::memcpy(bytes, values.data(), sizeof(float) * values.size());
+  bytes += sizeof(float) * values.size();
+}
@@ -0,0 +1,156 @@
+#include <implicitkernel/perf.h>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <iomanip>
+#include <map>
+#include <mutex>
+
+struct sample_window
+{
+    std::array<double, perf::WINDOW_SIZE> samples;
+    size_t count = 0;
+
+    void push(double val)
+    {
+        samples[(count++) % perf::WINDOW_SIZE] = val;
+    }
+};
+
+static std::mutex s_perfMutex;
+static std::map<std::string, sample_window> s_metrics;
+static float s_logInterval = 0.0f;
+static std::chrono::steady_clock::time_point s_lastLog = std::chrono::steady_clock::now();
+
+static double percentile(std::vector<double>& sorted, double fraction)
+{
+    // Nearest rank percentile.
+    size_t rank = (size_t)std::ceil(fraction * (double)sorted.size());
+    return sorted[std::min(sorted.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+void perf::record(const std::string& name, double ms)
+{
+    std::lock_guard<std::mutex> lock(s_perfMutex);
+    s_metrics[name].push(ms);
+}
+
+std::vector<perf::metric_summary> perf::summaries()
+{
+    std::vector<metric_summary> result;
+    std::vector<double> sorted;
+    std::lock_guard<std::mutex> lock(s_perfMutex);
+    result.reserve(s_metrics.size());
+    for (const auto& pair : s_metrics)
+    {
+        const sample_window& window = pair.second;
+        if (window.count == 0)
+            continue;
+        size_t n = std::min(window.count, WINDOW_SIZE);
+        sorted.assign(window.samples.begin(), window.samples.begin() + n);
+        std::sort(sorted.begin(), sorted.end());
+        result.push_back({
+            pair.first,
+            window.count,
+            window.samples[(window.count - 1) % WINDOW_SIZE],
+            percentile(sorted, 0.50),
+            percentile(sorted, 0.95),
+            percentile(sorted, 0.99),
+            });
+    }
+    return result;
+}
+
+perf::metric_summary perf::summarize(const std::string& name, const std::vector<double>& samples)
+{
+    if (samples.empty())
+        return { name, 0, 0.0, 0.0, 0.0, 0.0 };
+    std::vector<double> sorted(samples);
+    std::sort(sorted.begin(), sorted.end());
+    return {
+        name,
+        samples.size(),
+        samples.back(),
+        percentile(sorted, 0.50),
+        percentile(sorted, 0.95),
+        percentile(sorted, 0.99),
+    };
+}
+
+void perf::reset()
+{
+    std::lock_guard<std::mutex> lock(s_perfMutex);
+    s_metrics.clear();
+}
+
+void perf::print_stats(std::ostream& out)
+{
+    auto stats = summaries();
+    if (stats.empty())
+    {
+        out << "No timings recorded yet.\n";
+        return;
+    }
+    size_t nameWidth = 8;
+    for (const auto& s : stats)
+        nameWidth = std::max(nameWidth, s.name.size() + 2);
+
+    auto flags = out.flags();
+    out << std::endl << std::left << std::setw(nameWidth) << "Metric" << std::right
+        << std::setw(10) << "Count"
+        << std::setw(12) << "Last(ms)"
+        << std::setw(12) << "p50(ms)"
+        << std::setw(12) << "p95(ms)"
+        << std::setw(12) << "p99(ms)" << std::endl;
+    out << std::fixed << std::setprecision(3);
+    for (const auto& s : stats)
+    {
+        out << std::left << std::setw(nameWidth) << s.name << std::right
+            << std::setw(10) << s.count
+            << std::setw(12) << s.last
+            << std::setw(12) << s.p50
+            << std::setw(12) << s.p95
+            << std::setw(12) << s.p99 << std::endl;
+    }
+    out.flags(flags);
+}
+
+void perf::set_log_interval(float seconds)
+{
+    std::lock_guard<std::mutex> lock(s_perfMutex);
+    s_logInterval = std::max(0.0f, seconds);
+    s_lastLog = std::chrono::steady_clock::now();
+}
+
+void perf::log_if_due(std::ostream& out)
+{
+    {
+        std::lock_guard<std::mutex> lock(s_perfMutex);
+        if (s_logInterval <= 0.0f)
+            return;
+        auto now = std::chrono::steady_clock::now();
+        if (std::chrono::duration<float>(now - s_lastLog).count() < s_logInterval)
+            return;
+        s_lastLog = now;
+    }
+    auto stats = summaries();
+    if (stats.empty())
+        return;
+    auto flags = out.flags();
+    out << "[stats]" << std::fixed << std::setprecision(2);
+    for (const auto& s : stats)
+        out << " " << s.name << " " << s.p50 << "/" << s.p95 << "/" << s.p99;
+    out << " (p50/p95/p99 ms)" << std::endl;
+    out.flags(flags);
+}
+
+perf::scoped_timer::scoped_timer(const char* name)
+    : m_name(name), m_start(std::chrono::high_resolution_clock::now())
+{
+}
+
+perf::scoped_timer::~scoped_timer()
+{
+    auto end = std::chrono::high_resolution_clock::now();
+    record(m_name, std::chrono::duration<double, std::milli>(end - m_start).count());
+}
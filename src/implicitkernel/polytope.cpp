@@ -0,0 +1,264 @@
+#include <array>
+#include <cmath>
+#include <implicitkernel/host_primitives.h>
+#include <unordered_set>
+
+namespace {
+// Half size of the box that is clipped by the planes to find the bounds.
+constexpr double CLIP_EXTENT = 1e7;
+
+struct hull_face {
+  std::array<uint32_t, 3> verts;
+  glm::dvec3 normal;
+  double offset;
+};
+
+hull_face make_face(const std::vector<glm::dvec3> &pts, uint32_t a, uint32_t b,
+                    uint32_t c) {
+  glm::dvec3 n = glm::cross(pts[b] - pts[a], pts[c] - pts[a]);
+  n = glm::normalize(n);
+  return {{a, b, c}, n, glm::dot(n, pts[a])};
+}
+
+uint64_t edge_key(uint32_t a, uint32_t b) { return (uint64_t)a << 32 | b; }
+
+// Incremental convex hull. The faces are wound counter-clockwise when seen
+// from outside.
+std::vector<hull_face> convex_hull(const std::vector<glm::dvec3> &pts,
+                                   double eps) {
+  // Initial tetrahedron from the extreme points.
+  uint32_t i0 = 0, i1 = 0, i2 = 0, i3 = 0;
+  for (uint32_t i = 1; i < pts.size(); i++) {
+    if (pts[i].x < pts[i0].x)
+      i0 = i;
+  }
+  double best = 0;
+  for (uint32_t i = 0; i < pts.size(); i++) {
+    double d = glm::length(pts[i] - pts[i0]);
+    if (d > best) {
+      best = d;
+      i1 = i;
+    }
+  }
+  best = 0;
+  glm::dvec3 dir = glm::normalize(pts[i1] - pts[i0]);
+  for (uint32_t i = 0; i < pts.size(); i++) {
+    glm::dvec3 v = pts[i] - pts[i0];
+    double d = glm::length(v - dir * glm::dot(v, dir));
+    if (d > best) {
+      best = d;
+      i2 = i;
+    }
+  }
+  if (best <= eps)
+    throw "The points do not enclose any volume.";
+  best = 0;
+  glm::dvec3 n =
+      glm::normalize(glm::cross(pts[i1] - pts[i0], pts[i2] - pts[i0]));
+  for (uint32_t i = 0; i < pts.size(); i++) {
+    double d = std::abs(glm::dot(pts[i] - pts[i0], n));
+    if (d > best) {
+      best = d;
+      i3 = i;
+    }
+  }
+  if (best <= eps)
+    throw "The points do not enclose any volume.";
+
+  glm::dvec3 inside = (pts[i0] + pts[i1] + pts[i2] + pts[i3]) * 0.25;
+  std::vector<hull_face> faces;
+  uint32_t tet[4][3] = {{i0, i1, i2}, {i0, i3, i1}, {i1, i3, i2}, {i2, i3, i0}};
+  for (auto &t : tet) {
+    hull_face f = make_face(pts, t[0], t[1], t[2]);
+    if (glm::dot(f.normal, inside) > f.offset)
+      f = make_face(pts, t[0], t[2], t[1]);
+    faces.push_back(f);
+  }
+
+  std::vector<hull_face> kept;
+  std::unordered_set<uint64_t> visibleEdges;
+  for (uint32_t pi = 0; pi < pts.size(); pi++) {
+    if (pi == i0 || pi == i1 || pi == i2 || pi == i3)
+      continue;
+    const glm::dvec3 &p = pts[pi];
+    kept.clear();
+    visibleEdges.clear();
+    for (const hull_face &f : faces) {
+      if (glm::dot(f.normal, p) - f.offset > eps) {
+        for (int e = 0; e < 3; e++)
+          visibleEdges.insert(edge_key(f.verts[e], f.verts[(e + 1) % 3]));
+      } else {
+        kept.push_back(f);
+      }
+    }
+    if (visibleEdges.empty())
+      continue;
+    // The edges of the visible faces whose twins are not visible form the
+    // horizon, which is connected to the new point.
+    for (uint64_t key : visibleEdges) {
+      uint32_t a = (uint32_t)(key >> 32), b = (uint32_t)key;
+      if (visibleEdges.count(edge_key(b, a)) == 0)
+        kept.push_back(make_face(pts, a, b, pi));
+    }
+    faces.swap(kept);
+  }
+  return faces;
+}
+
+// Clips a convex polygon to the back of the plane, and collects the points on
+// the plane.
+std::vector<glm::dvec3> clip_polygon(const std::vector<glm::dvec3> &poly,
+                                     const glm::dvec3 &n, double offset,
+                                     std::vector<glm::dvec3> &cut) {
+  std::vector<glm::dvec3> result;
+  for (size_t i = 0; i < poly.size(); i++) {
+    const glm::dvec3 &a = poly[i];
+    const glm::dvec3 &b = poly[(i + 1) % poly.size()];
+    double da = glm::dot(n, a) - offset, db = glm::dot(n, b) - offset;
+    if (da <= 0)
+      result.push_back(a);
+    if (da == 0)
+      cut.push_back(a);
+    if ((da < 0 && db > 0) || (da > 0 && db < 0)) {
+      glm::dvec3 x = a + (b - a) * (da / (da - db));
+      result.push_back(x);
+      cut.push_back(x);
+    }
+  }
+  return result;
+}
+
+// Clips a large box by all the planes, and returns the vertices of the result.
+std::vector<glm::dvec3> clip_box(const std::vector<glm::vec4> &planes) {
+  const double e = CLIP_EXTENT;
+  std::vector<std::vector<glm::dvec3>> faces;
+  for (int axis = 0; axis < 3; axis++) {
+    for (double side : {-e, e}) {
+      std::vector<glm::dvec3> quad;
+      for (int k = 0; k < 4; k++) {
+        glm::dvec3 p;
+        p[axis] = side;
+        p[(axis + 1) % 3] = (k == 0 || k == 3) ? -e : e;
+        p[(axis + 2) % 3] = (k < 2) ? -e : e;
+        quad.push_back(p);
+      }
+      faces.push_back(quad);
+    }
+  }
+  for (const glm::vec4 &plane : planes) {
+    glm::dvec3 n(plane.x, plane.y, plane.z);
+    std::vector<std::vector<glm::dvec3>> clipped;
+    std::vector<glm::dvec3> cut;
+    for (const auto &face : faces) {
+      auto poly = clip_polygon(face, n, plane.w, cut);
+      if (poly.size() >= 3)
+        clipped.push_back(poly);
+    }
+    if (cut.size() >= 3) {
+      // The cap is the convex polygon of the cut points, ordered by angle.
+      glm::dvec3 center(0.0);
+      for (const glm::dvec3 &p : cut)
+        center += p;
+      center /= (double)cut.size();
+      glm::dvec3 u = glm::normalize(glm::cross(
+          n, std::abs(n.x) < 0.9 ? glm::dvec3(1, 0, 0) : glm::dvec3(0, 1, 0)));
+      glm::dvec3 v = glm::cross(n, u);
+      std::sort(cut.begin(), cut.end(),
+                [&](const glm::dvec3 &a, const glm::dvec3 &b) {
+                  return std::atan2(glm::dot(a - center, v),
+                                    glm::dot(a - center, u)) <
+                         std::atan2(glm::dot(b - center, v),
+                                    glm::dot(b - center, u));
+                });
+      clipped.push_back(cut);
+    }
+    faces.swap(clipped);
+    if (faces.empty())
+      break;
+  }
+  std::vector<glm::dvec3> verts;
+  for (const auto &face : faces)
+    verts.insert(verts.end(), face.begin(), face.end());
+  return verts;
+}
+} // namespace
+
+entities::polytope::polytope(const std::vector<glm::vec4> &planeList) {
+  for (const glm::vec4 &plane : planeList) {
+    glm::vec3 n(plane.x, plane.y, plane.z);
+    float len = glm::length(n);
+    if (len == 0.0f)
+      throw "The normal of a plane cannot be zero.";
+    glm::vec4 unit(n / len, plane.w / len);
+    float tolerance = 1e-6f * (1.0f + std::abs(unit.w));
+    bool duplicate = false;
+    for (const glm::vec4 &other : planes) {
+      duplicate = glm::dot(glm::vec3(other.x, other.y, other.z), n / len) >
+                      1.0f - 1e-6f &&
+                  std::abs(other.w - unit.w) <= tolerance;
+      if (duplicate)
+        break;
+    }
+    if (!duplicate)
+      planes.push_back(unit);
+  }
+  if (planes.empty())
+    throw "At least one plane is required.";
+  if (planes.size() > POLYTOPE_MAX_PLANES)
+    throw "The polytope has too many planes.";
+
+  std::vector<glm::dvec3> verts = clip_box(planes);
+  if (verts.empty())
+    throw "The planes do not enclose any volume.";
+  glm::dvec3 lo = verts.front(), hi = verts.front();
+  for (const glm::dvec3 &v : verts) {
+    lo = glm::min(lo, v);
+    hi = glm::max(hi, v);
+  }
+  // Polytopes that reach the clipping box are not bounded.
+  double reach = CLIP_EXTENT * 0.5;
+  m_bounded = std::max({-lo.x, -lo.y, -lo.z, hi.x, hi.y, hi.z}) < reach;
+  m_min = glm::vec3(lo);
+  m_max = glm::vec3(hi);
+}
+
+std::shared_ptr<entities::polytope>
+entities::polytope::hull(const std::vector<glm::vec3> &points) {
+  if (points.size() < 4)
+    throw "At least four points are required.";
+  std::vector<glm::dvec3> pts(points.size());
+  glm::dvec3 lo(points.front()), hi(points.front());
+  for (size_t i = 0; i < points.size(); i++) {
+    pts[i] = glm::dvec3(points[i]);
+    lo = glm::min(lo, pts[i]);
+    hi = glm::max(hi, pts[i]);
+  }
+  double eps = 1e-9 * std::max(1.0, glm::length(hi - lo));
+  std::vector<hull_face> faces = convex_hull(pts, eps);
+  std::vector<glm::vec4> planes;
+  for (const hull_face &f : faces)
+    planes.emplace_back(glm::vec3(f.normal), (float)f.offset);
+  return std::make_shared<polytope>(planes);
+}
+
+uint8_t entities::polytope::type() const { return ENT_TYPE_POLYTOPE; }
+
+bool entities::polytope::bounds(glm::vec3 &min, glm::vec3 &max) const {
+  if (!m_bounded)
+    return false;
+  min = m_min;
+  max = m_max;
+  return true;
+}
+
+size_t entities::polytope::num_render_bytes() const {
+  return sizeof(i_polytope) + sizeof(glm::vec4) * planes.size();
+}
+
+void entities::polytope::write_render_bytes(uint8_t *&bytes) const {
+  i_polytope header = {(uint32_t)planes.size()};
+  std::memcpy(bytes, &header, sizeof(header));
+  bytes += sizeof(header);
+  std::memcpy(bytes, planes.data(), sizeof(glm::vec4) * planes.size());
+  bytes += sizeof(glm::vec4) * planes.size();
+}
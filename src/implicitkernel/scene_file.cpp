@@ -0,0 +1,277 @@
+#include <fstream>
+#include <implicitkernel/host_primitives.h>
+
+static uint64_t align_up(uint64_t pos) {
+  return (pos + SCENE_ALIGNMENT - 1) / SCENE_ALIGNMENT * SCENE_ALIGNMENT;
+}
+
+static void write_section(std::ofstream &file, uint64_t offset,
+                          const void *data, size_t size) {
+  static const char zeros[SCENE_ALIGNMENT] = {};
+  uint64_t pos = (uint64_t)file.tellp();
+  file.write(zeros, (std::streamsize)(offset - pos));
+  file.write((const char *)data, (std::streamsize)size);
+}
+
+/* Whether the section of the given length at the offset lies within the file,
+ * without overflowing. */
+static bool section_fits(uint64_t offset, uint64_t length, uint64_t size) {
+  return offset <= size && length <= size - offset;
+}
+
+/* The size of the fixed part of the render data of a simple entity, or zero if
+ * the type is not one of a simple entity. */
+static size_t fixed_render_size(uint8_t type) {
+  switch (type) {
+  case ENT_TYPE_BOX: return sizeof(i_box);
+  case ENT_TYPE_SPHERE: return sizeof(i_sphere);
+  case ENT_TYPE_CYLINDER: return sizeof(i_cylinder);
+  case ENT_TYPE_HALFSPACE: return sizeof(i_halfspace);
+  case ENT_TYPE_GYROID: return sizeof(i_gyroid);
+  case ENT_TYPE_SCHWARZ: return sizeof(i_schwarz);
+  case ENT_TYPE_POLYFACE: return sizeof(uint32_t);
+  case ENT_TYPE_BVH: return sizeof(i_bvh);
+  case ENT_TYPE_LATTICE: return sizeof(i_lattice);
+  case ENT_TYPE_MESH: return sizeof(i_mesh);
+  case ENT_TYPE_DISTGRID: return sizeof(i_distgrid);
+  case ENT_TYPE_VOXELGRID: return sizeof(i_voxelgrid);
+  case ENT_TYPE_XFORM: return sizeof(i_xform);
+  case ENT_TYPE_POLYTOPE: return sizeof(i_polytope);
+  default: return 0;
+  }
+}
+
+/* Checks that the entities and the steps of a mapped scene only refer to data
+ * within the scene, so a corrupt file can't make the viewer or the kernels read
+ * out of bounds. Throws otherwise. */
+static void validate_render_data(const entities::compiled_entity &scene) {
+  const entities::scene_header &header = scene.header;
+  for (uint32_t ei = 0; ei < header.num_entities; ei++) {
+    uint8_t type = scene.types[ei];
+    uint32_t offset = scene.offsets[ei];
+    size_t fixed = fixed_render_size(type);
+    if (fixed == 0)
+      throw "The scene file has an entity of an unknown type.";
+    if (!section_fits(offset, fixed, header.num_bytes))
+      throw "The scene file has an entity outside its render data.";
+    if (type != ENT_TYPE_XFORM)
+      continue;
+    i_xform xform;
+    std::memcpy(&xform, scene.bytes + offset, sizeof(xform));
+    size_t innerFixed = fixed_render_size((uint8_t)xform.inner_type);
+    if (xform.inner_back > offset || innerFixed == 0 ||
+        xform.inner_type == ENT_TYPE_XFORM ||
+        !section_fits(offset - xform.inner_back, innerFixed,
+                      header.num_bytes) ||
+        !section_fits(offset + sizeof(xform),
+                      (uint64_t)sizeof(point_op) * xform.num_ops,
+                      header.num_bytes))
+      throw "The scene file has an invalid transformed entity.";
+  }
+  if (header.num_steps == 0) {
+    if (header.num_entities != 1)
+      throw "The scene file has several entities but no steps.";
+    return;
+  }
+  for (uint32_t si = 0; si < header.num_steps; si++) {
+    const op_step &step = scene.steps[si];
+    if (step.dest >= header.num_registers)
+      throw "The scene file has a step writing outside its registers.";
+    if (step.op.type == op_type::OP_UNION_ALL ||
+        step.op.type == op_type::OP_INTERSECTION_ALL) {
+      // A fold reads right_index values starting at left_index.
+      if (step.left_src != SRC_VAL ||
+          step.left_index > header.num_entities ||
+          step.right_index > header.num_entities - step.left_index)
+        throw "The scene file has a fold outside its entities.";
+      continue;
+    }
+    for (uint32_t side = 0; side < 2; side++) {
+      uint32_t src = side == 0 ? step.left_src : step.right_src;
+      uint32_t index = side == 0 ? step.left_index : step.right_index;
+      if (!(src == SRC_REG && index < header.num_registers) &&
+          !(src == SRC_VAL && index < header.num_entities))
+        throw "The scene file has a step reading outside its entities or "
+              "registers.";
+    }
+  }
+}
+
+void entities::compiled_entity::save(const ent_ref &ent,
+                                     const std::string &path) {
+  std::vector<entity *> simples;
+  ent->collect_simple(simples);
+  for (entity *simple : simples) {
+    if (simple->type() == ENT_TYPE_VOXELGRID)
+      throw "Voxel grids are sampled from files, and cannot be saved in a "
+            "scene.";
+  }
+
+  size_t nBytes = 0, nEntities = 0, nSteps = 0;
+  ent->render_data_size(nBytes, nEntities, nSteps);
+  std::vector<uint8_t> bytes(nBytes);
+  std::vector<uint32_t> offsets(nEntities);
+  std::vector<uint8_t> types(nEntities);
+  std::vector<op_step> steps(nSteps);
+  uint8_t *bptr = bytes.data();
+  uint32_t *optr = offsets.data();
+  uint8_t *tptr = types.data();
+  op_step *sptr = steps.data();
+  ent->copy_render_data(bptr, optr, tptr, sptr);
+
+  scene_header header = {};
+  std::memcpy(header.magic, "ISCN", 4);
+  header.version = SCENE_VERSION;
+  header.num_entities = (uint32_t)(optr - offsets.data());
+  header.num_steps = (uint32_t)(sptr - steps.data());
+  header.num_bytes = (uint64_t)(bptr - bytes.data());
+  for (uint32_t si = 0; si < header.num_steps; si++) {
+    const op_step &step = steps[si];
+    uint32_t last = step.dest;
+    if (step.left_src == SRC_REG)
+      last = std::max(last, step.left_index);
+    if (step.right_src == SRC_REG)
+      last = std::max(last, step.right_index);
+    header.num_registers = std::max(header.num_registers, last + 1);
+  }
+  glm::vec3 bmin, bmax;
+  header.has_bounds = ent->bounds(bmin, bmax) ? 1 : 0;
+  if (header.has_bounds) {
+    float bounds[6] = {bmin.x, bmin.y, bmin.z, bmax.x, bmax.y, bmax.z};
+    std::copy(bounds, bounds + 6, header.bounds);
+  }
+  header.bytes_offset = align_up(sizeof(header));
+  header.types_offset = align_up(header.bytes_offset + header.num_bytes);
+  header.offsets_offset = align_up(header.types_offset + header.num_entities);
+  header.steps_offset = align_up(header.offsets_offset +
+                                 sizeof(uint32_t) * header.num_entities);
+
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file.is_open())
+    throw "Cannot open the scene file for writing.";
+  file.write((const char *)&header, sizeof(header));
+  write_section(file, header.bytes_offset, bytes.data(), header.num_bytes);
+  write_section(file, header.types_offset, types.data(), header.num_entities);
+  write_section(file, header.offsets_offset, offsets.data(),
+                sizeof(uint32_t) * header.num_entities);
+  write_section(file, header.steps_offset, steps.data(),
+                sizeof(op_step) * header.num_steps);
+  if (!file.good())
+    throw "Failed to write the scene file.";
+}
+
+std::shared_ptr<entities::compiled_entity>
+entities::compiled_entity::load(const std::string &path) {
+  auto scene = std::make_shared<compiled_entity>();
+  scene->m_file = std::make_shared<util::mapped_file>(path);
+  const uint8_t *data = scene->m_file->data();
+  size_t size = scene->m_file->size();
+  scene_header &header = scene->header;
+  if (size < sizeof(header))
+    throw "The file is too small to be a scene file.";
+  std::memcpy(&header, data, sizeof(header));
+  if (std::memcmp(header.magic, "ISCN", 4) != 0)
+    throw "Not a scene file.";
+  if (header.version != SCENE_VERSION)
+    throw "The scene file was written by an incompatible version.";
+  if (header.num_entities == 0)
+    throw "The scene file is empty.";
+  // The same limits as the entities of one object shown in the viewer.
+  if (header.num_entities > MAX_ENTITY_COUNT ||
+      header.num_registers > MAX_ENTITY_COUNT - 2)
+    throw "The scene file has too many entities.";
+  if (!section_fits(header.bytes_offset, header.num_bytes, size) ||
+      !section_fits(header.types_offset, header.num_entities, size) ||
+      !section_fits(header.offsets_offset,
+                    (uint64_t)sizeof(uint32_t) * header.num_entities, size) ||
+      !section_fits(header.steps_offset,
+                    (uint64_t)sizeof(op_step) * header.num_steps, size))
+    throw "The scene file is truncated.";
+  if (header.offsets_offset % alignof(uint32_t))
+    throw "The scene file is misaligned.";
+  scene->bytes = data + header.bytes_offset;
+  scene->types = data + header.types_offset;
+  scene->offsets = (const uint32_t *)(data + header.offsets_offset);
+  scene->steps = (const op_step *)(data + header.steps_offset);
+  validate_render_data(*scene);
+  return scene;
+}
+
+uint8_t entities::compiled_entity::type() const { return ENT_TYPE_CSG; }
+
+bool entities::compiled_entity::simple() const { return false; }
+
+bool entities::compiled_entity::bounds(glm::vec3 &min, glm::vec3 &max) const {
+  if (!header.has_bounds)
+    return false;
+  min = {header.bounds[0], header.bounds[1], header.bounds[2]};
+  max = {header.bounds[3], header.bounds[4], header.bounds[5]};
+  return true;
+}
+
+void entities::compiled_entity::collect_simple(std::vector<entity *> &) {
+  // The simple entities only exist as render data.
+}
+
+void entities::compiled_entity::render_data_size_internal(
+    size_t &nBytes, size_t &nEntities, size_t &nSteps,
+    std::unordered_set<entity *> &) const {
+  nBytes += header.num_bytes;
+  nEntities += header.num_entities;
+  nSteps += std::max(header.num_steps, 1u);
+}
+
+void entities::compiled_entity::copy_render_data_internal(
+    uint8_t *&bytes, uint32_t *&offsets, uint8_t *&types, op_step *&steps,
+    size_t &entityIndex, size_t &currentOffset, uint32_t regVal,
+    render_context &ctx) const {
+  if (regVal + std::max(header.num_registers, 1u) > MAX_ENTITY_COUNT - 2) {
+    std::cerr << "Too many entities. Out of resources. Aborting...\n";
+    exit(1);
+  }
+
+  // The bytes are written once, and shared by all the transformed copies.
+  auto written = ctx.byteOffsets.find(this);
+  size_t byteOffset = currentOffset;
+  if (written == ctx.byteOffsets.end()) {
+    ctx.byteOffsets.emplace(this, currentOffset);
+    std::memcpy(bytes, this->bytes, header.num_bytes);
+    bytes += header.num_bytes;
+    currentOffset += header.num_bytes;
+  } else {
+    byteOffset = written->second;
+  }
+  uint32_t first = (uint32_t)entityIndex;
+  for (uint32_t ei = 0; ei < header.num_entities; ei++) {
+    if (ctx.ops.empty()) {
+      *(offsets++) = (uint32_t)(byteOffset + this->offsets[ei]);
+      *(types++) = this->types[ei];
+    } else {
+      ctx.write_wrapper(bytes, offsets, types, currentOffset,
+                        byteOffset + this->offsets[ei], this->types[ei],
+                        this->bytes + this->offsets[ei]);
+    }
+  }
+  entityIndex += header.num_entities;
+
+  if (header.num_steps == 0) {
+    // A single simple entity, its value is moved into the register.
+    op_defn none = {};
+    none.type = op_type::OP_NONE;
+    *(steps++) = {none, (uint32_t)SRC_VAL, first, (uint32_t)SRC_VAL, first,
+                  regVal};
+    return;
+  }
+  for (uint32_t si = 0; si < header.num_steps; si++) {
+    op_step step = this->steps[si];
+    step.op = ctx.world_op(step.op);
+    bool fold = step.op.type == op_type::OP_UNION_ALL ||
+                step.op.type == op_type::OP_INTERSECTION_ALL;
+    step.left_index += step.left_src == SRC_REG ? regVal : first;
+    // The right index of a fold is the number of values folded.
+    if (!fold)
+      step.right_index += step.right_src == SRC_REG ? regVal : first;
+    step.dest += regVal;
+    *(steps++) = step;
+  }
+}
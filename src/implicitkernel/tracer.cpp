@@ -0,0 +1,185 @@
+#include <implicitkernel/tracer.h>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+static constexpr int DEVICE_TRACK = 100;
+
+static std::mutex s_traceMutex;
+static std::ofstream s_traceFile;
+static std::atomic<bool> s_tracing = false;
+static bool s_firstEvent = true;
+static const std::chrono::steady_clock::time_point s_clockStart = std::chrono::steady_clock::now();
+static std::map<int, std::string> s_trackNames;
+static int s_nextTrack = 1;
+static thread_local int t_track = 0;
+
+static std::string json_escape(const std::string& str)
+{
+    std::ostringstream ss;
+    for (char c : str)
+    {
+        switch (c)
+        {
+        case '"': ss << "\\\""; break;
+        case '\\': ss << "\\\\"; break;
+        case '\n': ss << "\\n"; break;
+        case '\r': ss << "\\r"; break;
+        case '\t': ss << "\\t"; break;
+        default:
+            if ((unsigned char)c < 0x20)
+                ss << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c << std::dec;
+            else
+                ss << c;
+        }
+    }
+    return ss.str();
+}
+
+/*Must be called with the mutex locked.*/
+static void write_event(const std::string& json)
+{
+    if (!s_firstEvent)
+        s_traceFile << ",\n";
+    s_firstEvent = false;
+    s_traceFile << json;
+}
+
+/*Must be called with the mutex locked.*/
+static void write_track_name(int track, const std::string& name)
+{
+    std::ostringstream ss;
+    ss << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << track
+        << ",\"args\":{\"name\":\"" << json_escape(name) << "\"}}";
+    write_event(ss.str());
+}
+
+/*Must be called with the mutex locked.*/
+static int current_track()
+{
+    if (t_track == 0)
+    {
+        t_track = s_nextTrack++;
+        std::string name = "thread " + std::to_string(t_track);
+        s_trackNames.emplace(t_track, name);
+        if (s_tracing)
+            write_track_name(t_track, name);
+    }
+    return t_track;
+}
+
+static void write_complete(int track, const char* name, const char* category, double startUs, double durUs, const std::string& detail)
+{
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(3)
+        << "{\"name\":\"" << json_escape(name) << "\",\"cat\":\"" << category
+        << "\",\"ph\":\"X\",\"ts\":" << startUs << ",\"dur\":" << durUs
+        << ",\"pid\":1,\"tid\":" << track;
+    if (!detail.empty())
+        ss << ",\"args\":{\"detail\":\"" << json_escape(detail) << "\"}";
+    ss << "}";
+    write_event(ss.str());
+}
+
+bool tracer::begin(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(s_traceMutex);
+    if (s_tracing)
+    {
+        s_traceFile << "\n]}\n";
+        s_traceFile.close();
+        s_tracing = false;
+    }
+    s_traceFile.open(path, std::ios::out | std::ios::trunc);
+    if (!s_traceFile.is_open())
+        return false;
+    s_firstEvent = true;
+    s_traceFile << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    write_event("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"implicitshell\"}}");
+    write_track_name(DEVICE_TRACK, "device");
+    for (const auto& track : s_trackNames)
+        write_track_name(track.first, track.second);
+    s_tracing = true;
+    return true;
+}
+
+void tracer::end()
+{
+    std::lock_guard<std::mutex> lock(s_traceMutex);
+    if (!s_tracing)
+        return;
+    s_tracing = false;
+    s_traceFile << "\n]}\n";
+    s_traceFile.close();
+}
+
+bool tracer::enabled()
+{
+    return s_tracing;
+}
+
+double tracer::now_us()
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - s_clockStart).count();
+}
+
+void tracer::set_thread_name(const char* name)
+{
+    std::lock_guard<std::mutex> lock(s_traceMutex);
+    if (t_track == 0)
+        t_track = s_nextTrack++;
+    s_trackNames[t_track] = name;
+    if (s_tracing)
+        write_track_name(t_track, name);
+}
+
+void tracer::complete(const char* name, const char* category, double startUs, double durUs, const std::string& detail)
+{
+    if (!s_tracing)
+        return;
+    std::lock_guard<std::mutex> lock(s_traceMutex);
+    if (!s_tracing)
+        return;
+    write_complete(current_track(), name, category, startUs, durUs, detail);
+}
+
+void tracer::device(const char* name, double startUs, double durUs)
+{
+    if (!s_tracing)
+        return;
+    std::lock_guard<std::mutex> lock(s_traceMutex);
+    if (!s_tracing)
+        return;
+    write_complete(DEVICE_TRACK, name, "device", startUs, durUs, "");
+}
+
+void tracer::instant(const char* name, const char* category)
+{
+    if (!s_tracing)
+        return;
+    double ts = now_us();
+    std::lock_guard<std::mutex> lock(s_traceMutex);
+    if (!s_tracing)
+        return;
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(3)
+        << "{\"name\":\"" << json_escape(name) << "\",\"cat\":\"" << category
+        << "\",\"ph\":\"i\",\"s\":\"t\",\"ts\":" << ts << ",\"pid\":1,\"tid\":" << current_track() << "}";
+    write_event(ss.str());
+}
+
+tracer::scope::scope(const char* name, const char* category)
+    : m_name(name), m_category(category), m_start(s_tracing ? now_us() : -1.0)
+{
+}
+
+tracer::scope::~scope()
+{
+    if (m_start < 0.0)
+        return;
+    complete(m_name, m_category, m_start, now_us() - m_start);
+}
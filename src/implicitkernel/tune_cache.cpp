@@ -0,0 +1,114 @@
+#include <implicitkernel/tune_cache.h>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+
+namespace fs = std::filesystem;
+
+static constexpr char CACHE_FILE[] = "launch_configs.txt";
+static std::mutex s_cacheMutex;
+
+/*The keys hold device names, so they are cleaned of the tabs and line breaks that separate the fields.*/
+static std::string clean_key(std::string key)
+{
+    for (char& c : key)
+    {
+        if (c == '\t' || c == '\n' || c == '\r')
+            c = ' ';
+    }
+    return key;
+}
+
+/*Every line of the file is a key, the width and height of the tiles, and the build options, separated by
+tabs.*/
+static std::map<std::string, tune_cache::launch_config> read_all(const fs::path& path)
+{
+    std::map<std::string, tune_cache::launch_config> configs;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream fields(line);
+        std::string key, width, height, options;
+        if (!std::getline(fields, key, '\t') || !std::getline(fields, width, '\t') ||
+            !std::getline(fields, height, '\t'))
+            continue;
+        std::getline(fields, options);
+        uint32_t w = (uint32_t)std::strtoul(width.c_str(), nullptr, 10);
+        uint32_t h = (uint32_t)std::strtoul(height.c_str(), nullptr, 10);
+        // Ignore lines that were edited into shapes the kernels can't be launched with.
+        if (w == 0 || h == 0 || (w & (w - 1)) || (h & (h - 1)))
+            continue;
+        configs[key] = { w, h, options };
+    }
+    return configs;
+}
+
+std::string tune_cache::directory()
+{
+    fs::path path;
+    const char* dir = std::getenv("IMPLICIT_CACHE_DIR");
+    if (dir && *dir)
+        path = dir;
+    else
+    {
+#ifdef _WIN32
+        const char* base = std::getenv("LOCALAPPDATA");
+        if (base && *base)
+            path = fs::path(base) / "implicit";
+#else
+        const char* base = std::getenv("XDG_CACHE_HOME");
+        const char* home = std::getenv("HOME");
+        if (base && *base)
+            path = fs::path(base) / "implicit";
+        else if (home && *home)
+            path = fs::path(home) / ".cache" / "implicit";
+#endif
+    }
+    if (path.empty())
+        path = fs::temp_directory_path() / "implicit";
+    std::error_code err;
+    fs::create_directories(path, err);
+    return path.string();
+}
+
+bool tune_cache::load(const std::string& key, launch_config& config)
+{
+    std::lock_guard<std::mutex> lock(s_cacheMutex);
+    auto configs = read_all(fs::path(directory()) / CACHE_FILE);
+    auto match = configs.find(clean_key(key));
+    if (match == configs.end())
+        return false;
+    config = match->second;
+    return true;
+}
+
+void tune_cache::store(const std::string& key, const launch_config& config)
+{
+    std::lock_guard<std::mutex> lock(s_cacheMutex);
+    fs::path path = fs::path(directory()) / CACHE_FILE;
+    auto configs = read_all(path);
+    configs[clean_key(key)] = { config.tileWidth, config.tileHeight, clean_key(config.buildOptions) };
+    // Written next to the file and moved over it, so an interrupted write doesn't lose the other entries.
+    fs::path temp = path;
+    temp += ".tmp";
+    {
+        std::ofstream file(temp, std::ios::trunc);
+        if (!file)
+            throw "Cannot write the tuning cache.";
+        for (const auto& entry : configs)
+        {
+            file << entry.first << '\t' << entry.second.tileWidth << '\t' << entry.second.tileHeight << '\t'
+                << entry.second.buildOptions << '\n';
+        }
+        if (!file)
+            throw "Cannot write the tuning cache.";
+    }
+    std::error_code err;
+    fs::rename(temp, path, err);
+    if (err)
+        throw "Cannot write the tuning cache.";
+}
@@ -2,19 +2,22 @@
 #include <thread>
 #include <mutex>
 #include <algorithm>
+#include <atomic>
+#include <map>
+#include <deque>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
 #include <condition_variable>
 #include <cmath>
 #include <math.h>
 #include <implicitkernel/kernel_sources.h>
 #include <implicitkernel/viewer.h>
-#pragma warning(push)
-#pragma warning(disable: 4244 4996)
-#include <boost/gil/image.hpp>
-#include <boost/gil/typedefs.hpp>
-#include <boost/gil/extension/io/bmp.hpp>
-namespace bgil = boost::gil;
-#include <boost/algorithm/string/case_conv.hpp>
-#pragma warning(pop)
+#include <implicitkernel/perf.h>
+#include <implicitkernel/tracer.h>
+#include <implicitkernel/image_writer.h>
+#include <implicitkernel/tune_cache.h>
 
 #ifndef _WIN32
        #include <GL/glx.h>
@@ -28,6 +31,19 @@ std::cerr << "OpenCL Error: " << viewer::cl_err_str(err.err()) << std::endl;\
 exit(err.err());\
 }
 
+/*Records the time the device spent executing the command of the given event, and returns it in milliseconds.
+The command is also added to the device track of the tracer, with the device timestamps mapped to the host
+clock using the host time at which the command was enqueued. The event must have completed and the queue
+must have been created with profiling enabled.*/
+static double record_device_event(const char* name, const cl::Event& event, double hostQueuedUs)
+{
+    cl_ulong queued = event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+    cl_ulong start = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+    cl_ulong end = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+    tracer::device(name, hostQueuedUs + (double)(start - queued) * 1.0e-3, (double)(end - start) * 1.0e-3);
+    return (double)(end - start) * 1.0e-6;
+}
+
 static constexpr float CAM_DIST = 10.0f;
 static constexpr float CAM_THETA = 0.6f;
 static constexpr float CAM_PHI = 0.77f;
@@ -53,26 +69,137 @@ static cl::Context s_context;
 static cl::CommandQueue s_queue;
 static uint32_t s_pboId = 0; // Pixel buffer to be rendered to screen, controlled by OpenGL.
 static cl::Program s_program;
-static cl::make_kernel<
-    cl::BufferGL&, cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::LocalSpaceArg,
-    cl::LocalSpaceArg, cl_uint, cl::Buffer&, cl_uint, cl::Buffer&, cl_uchar
+// The stages of the wavefront tracer. The debug builds also pass the index of the pixel under the mouse.
 #ifdef CLDEBUG
-    , cl_uint2
+#define DEBUG_PIXEL_ARG , cl_uint
+#define DEBUG_PIXEL , s_mousePixel
+static cl_uint s_mousePixel = UINT32_MAX;
+#else
+#define DEBUG_PIXEL_ARG
+#define DEBUG_PIXEL
 #endif // CLDEBUG
->* s_kernel;
-static cl::make_kernel<cl::BufferGL&, cl_uchar>* s_repeatPixelKernel;
+typedef cl::make_kernel<
+    cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::LocalSpaceArg, cl::LocalSpaceArg, cl::Buffer&, cl::Buffer&,
+    cl::Image3D&, cl::Buffer&, cl_uint2, cl_uint, cl::Buffer&
+> cone_kernel;
+typedef cl::make_kernel<cl::Buffer&, cl::Buffer&, cl::Buffer&, cl_uint2, cl::Buffer&> reproject_kernel;
+// k_generate and k_refine take the same arguments.
+typedef cl::make_kernel<
+    cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::Buffer&, cl_uint2, cl_uint, cl::Buffer&, cl_uint, cl::Buffer&,
+    cl::Buffer&, cl::Buffer& DEBUG_PIXEL_ARG
+> generate_kernel;
+typedef cl::make_kernel<
+    cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::LocalSpaceArg, cl::LocalSpaceArg, cl::Buffer&,
+    cl::Buffer&, cl::Image3D&, cl::Buffer&, cl_uint, cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::Buffer&,
+    cl::Buffer& DEBUG_PIXEL_ARG
+> march_kernel;
+typedef cl::make_kernel<
+    cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::LocalSpaceArg, cl::LocalSpaceArg,
+    cl::Buffer&, cl::Buffer&, cl::Image3D&, cl::Buffer&, cl_uint2, cl::Buffer&, cl::Buffer&, cl_uint
+    DEBUG_PIXEL_ARG
+> shade_kernel;
+
+/*The stages of the wavefront tracer. The arguments are set on the kernel objects, so every thread that traces
+needs its own.*/
+struct trace_kernels
+{
+    cone_kernel cone;
+    reproject_kernel reproject;
+    generate_kernel generate;
+    generate_kernel refine;
+    march_kernel march;
+    shade_kernel shade;
+
+    trace_kernels(const cl::Program& program)
+        : cone(program, "k_cone_prepass"), reproject(program, "k_reproject"), generate(program, "k_generate"),
+        refine(program, "k_refine"), march(program, "k_march"), shade(program, "k_shade")
+    {
+    }
+};
+static trace_kernels* s_kernels = nullptr;
+// Evaluates the scene at a batch of points, without tracing anything.
+typedef cl::make_kernel<
+    cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::LocalSpaceArg, cl::LocalSpaceArg, cl::Buffer&, cl::Buffer&,
+    cl::Image3D&, cl::Buffer&, cl_uint, cl::Buffer&
+> eval_kernel;
+
+static constexpr uint32_t CONE_BLOCK_SIZE = 8; // Pixels along the side of a block sharing a cone in the depth prepass.
+
+/*The buffers the wavefront tracer needs to trace an image, or a tile of an image. They are allocated once for
+a ray per pixel and reused. The pixels are not included, because the window traces into the buffer shared
+with OpenGL.*/
+struct trace_target
+{
+    cl_uint2 dims = { 0, 0 }; // The most pixels the buffers have room for.
+    cl::Buffer viewerData; // Camera position, direction, build volume bounds and the viewport.
+    cl::Buffer rays[2]; // The live rays, the march stage reads one and writes the other.
+    cl::Buffer gbuffer; // Depth and object of the hits, written by the march and read by the shading.
+    cl::Buffer hits; // The pixels waiting to be shaded.
+    cl::Buffer counters; // The number of live rays and hits pushed by the current stage.
+    cl::Buffer blockDepths; // Depth up to which the cone of each block is empty.
+    cl::Buffer samples; // Hit depth and normal of every pixel, compared by the refinement.
+    cl::Buffer reprojected; // Depths of the previous frame moved into the current view.
+    cl::Buffer iters; // Iterations of the ray of every traced pixel. Only cleared when they are counted.
+
+    trace_target() = default;
+
+    trace_target(const cl::Context& context, uint32_t width, uint32_t height)
+    {
+        dims.s[0] = width;
+        dims.s[1] = height;
+        size_t nPixels = (size_t)width * height;
+        size_t nBlocks = (size_t)((width + CONE_BLOCK_SIZE - 1) / CONE_BLOCK_SIZE) *
+            ((height + CONE_BLOCK_SIZE - 1) / CONE_BLOCK_SIZE);
+        cl_mem_flags deviceOnly = CL_MEM_HOST_NO_ACCESS | CL_MEM_READ_WRITE;
+        viewerData = cl::Buffer(context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, sizeof(viewer::viewer_data));
+        rays[0] = cl::Buffer(context, deviceOnly, nPixels * sizeof(ray_state));
+        rays[1] = cl::Buffer(context, deviceOnly, nPixels * sizeof(ray_state));
+        gbuffer = cl::Buffer(context, deviceOnly, nPixels * sizeof(gbuffer_texel));
+        hits = cl::Buffer(context, deviceOnly, nPixels * sizeof(cl_uint));
+        counters = cl::Buffer(context, CL_MEM_READ_WRITE, 2 * sizeof(cl_uint));
+        blockDepths = cl::Buffer(context, deviceOnly, nBlocks * sizeof(cl_float));
+        samples = cl::Buffer(context, deviceOnly, nPixels * sizeof(cl_float4));
+        reprojected = cl::Buffer(context, deviceOnly, nPixels * sizeof(cl_uint));
+        iters = cl::Buffer(context, CL_MEM_HOST_READ_ONLY | CL_MEM_READ_WRITE, nPixels * sizeof(cl_uint));
+    }
+};
 
 static cl::BufferGL s_pBuffer; // Pixels to be rendered to the screen. Controlled by OpenCL.
+static cl::Buffer s_readbackBuf; // Pinned host memory the pixels are copied into when the frame is exported.
+static std::unique_ptr<util::image_stream> s_exportStream; // The exported frame, while it is being written.
 static cl::Buffer s_packedBuf; // Packed bytes of simple entities.
 static cl::Buffer s_typeBuf; // The types of simple entities.
 static cl::Buffer s_offsetBuf; // Offsets where the simple entities start in the packedBuf.
 static cl::Buffer s_opStepBuf; // Buffer containing csg operators.
-static cl::Buffer s_viewerDataBuf; // Buffer contains viewer data, camera position, direction and build volume bounds.
+static cl::Buffer s_sceneBuf; // Top level bvh over the objects and the table of their programs.
+static cl::Image3D s_voxelAtlas; // Samples of all voxel grids being rendered, stacked along z.
+static trace_target s_frame; // The buffers the window is traced with.
+static cl::Buffer s_prevViewerDataBuf; // Camera of the previous frame.
+static viewer::viewer_data s_prevViewerData;
+static bool s_hasPrevFrame = false; // Whether the samples hold the current scene, seen from s_prevViewerData.
 static uint8_t s_levelOfDetail = s_lowestLOD;
 static cl::LocalSpaceArg s_valueBuf; // Local buffer for storing the values of implicit functions when computing csg operations.
 static cl::LocalSpaceArg s_regBuf; // Register to store intermediate csg values.
-static size_t s_numCurrentEntities = 0;
-static size_t s_opStepCount = 0;
+static size_t s_numCurrentEntities = 0; // The most simple entities in any one object.
+
+/*An independent object of the scene. Its render data is linearized when it is added, and kept until it
+is removed, so changing one object doesn't linearize the others again.*/
+struct scene_entry
+{
+    uint32_t id;
+    entities::ent_ref entity;
+    bool bounded;
+    glm::vec3 min, max;
+    bool hasGrids; // The render data holds offsets into the voxel atlas.
+    std::vector<uint8_t> bytes;
+    std::vector<uint8_t> types;
+    std::vector<uint32_t> offsets;
+    std::vector<op_step> steps;
+};
+static constexpr uint32_t SHOWN_OBJECT_ID = 0; // The object replaced by show_entity.
+static std::vector<scene_entry> s_scene;
+static uint32_t s_nextObjectId = SHOWN_OBJECT_ID + 1;
+static std::vector<entities::voxelgrid*> s_atlasGrids; // The grids currently in the voxel atlas.
 
 static size_t s_globalMemSize = 0;
 static size_t s_localMemSize = 0;
@@ -81,6 +208,10 @@ static size_t s_maxBufSize = 0;
 static size_t s_maxLocalBufSize = 0;
 static size_t s_maxWorkGroupSize = 0;
 static size_t s_workGroupSize = 0;
+static uint32_t s_tileW = 8, s_tileH = 8; // Work-group shape of the 2-D stages, powers of two.
+static std::string s_buildOptions; // Options s_program was built with, besides the include path.
+static std::string s_tunedClass; // The class of scene the launch configuration was last looked up for.
+static std::mutex s_launchMutex; // Held while a frame of the window is traced, and while the kernels or their shapes change.
 
 static std::mutex s_mutex;
 static std::condition_variable s_cv;
@@ -357,6 +488,9 @@ bool viewer::window_should_close()
 
 void viewer::acquire_lock()
 {
+    if (!s_pauseRender)
+        return;
+    tracer::scope waitScope("paused", "render");
     while (s_pauseRender)
     {
         std::unique_lock<std::mutex> lock(s_mutex);
@@ -377,6 +511,7 @@ uint32_t viewer::win_width()
 
 void viewer::render_loop()
 {
+    tracer::set_thread_name("render");
     /* Loop until the user closes the window */
     while (!viewer::window_should_close() && !s_shouldExit)
     {
@@ -385,19 +520,26 @@ void viewer::render_loop()
         if (s_debugMode) s_framestart = std::chrono::high_resolution_clock::now();
 #endif
         viewer::render();
-        GL_CALL(glClear(GL_COLOR_BUFFER_BIT));
-        GL_CALL(glDisable(GL_DEPTH_TEST));
+        {
+            tracer::scope presentScope("present", "render");
+            GL_CALL(glClear(GL_COLOR_BUFFER_BIT));
+            GL_CALL(glDisable(GL_DEPTH_TEST));
 
-        GL_CALL(glRasterPos2i(-1, -1));
-        GL_CALL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, s_pboId));
-        GL_CALL(glDrawPixels(WIN_W, WIN_H, GL_RGBA, GL_UNSIGNED_BYTE, nullptr));
-        GL_CALL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+            GL_CALL(glRasterPos2i(-1, -1));
+            GL_CALL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, s_pboId));
+            {
+                perf::scoped_timer timer("host.glDrawPixels");
+                GL_CALL(glDrawPixels(WIN_W, WIN_H, GL_RGBA, GL_UNSIGNED_BYTE, nullptr));
+            }
+            GL_CALL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
 
-        /* Swap front and back buffers */
-        GL_CALL(glfwSwapBuffers(s_window));
+            /* Swap front and back buffers */
+            GL_CALL(glfwSwapBuffers(s_window));
+        }
 
         /* Poll for and process events */
         GL_CALL(glfwPollEvents());
+        perf::log_if_due(std::cout);
 
 #ifdef CLDEBUG
         if (s_debugMode)
@@ -413,68 +555,288 @@ void viewer::render_loop()
     }
 }
 
+static bool finish_export();
+
 void viewer::stop()
 {
+    finish_export();
     GL_CALL(glfwSetWindowShouldClose(s_window, GL_TRUE));
     glfwTerminate();
-    delete s_kernel;
-    delete s_repeatPixelKernel;
+    delete s_kernels;
+}
+
+/*Rounds the number of rays up to a whole number of work-groups.*/
+static size_t ray_launch_size(size_t nRays)
+{
+    return (nRays + s_workGroupSize - 1) / s_workGroupSize * s_workGroupSize;
+}
+
+/*Launches a 2-D stage over nx by ny cells, in tiles of the tuned shape. The launch is rounded up to whole
+tiles, and the kernels skip the cells outside.*/
+static cl::EnqueueArgs tile_launch(cl::CommandQueue& queue, size_t nx, size_t ny)
+{
+    return cl::EnqueueArgs(queue,
+        cl::NDRange((nx + s_tileW - 1) / s_tileW * s_tileW, (ny + s_tileH - 1) / s_tileH * s_tileH),
+        cl::NDRange(s_tileW, s_tileH));
+}
+
+/*Whether the camera moved little enough since the previous frame for its depths to be worth reprojecting.
+After larger moves most of the pixels would fall back to a full march anyway.*/
+static bool camera_moved_slightly(const viewer::viewer_data& prev, const viewer::viewer_data& cur)
+{
+    static constexpr float maxAngle = 0.2f;
+    static constexpr float maxZoom = 1.5f;
+    float zoom = cur.camDistance / prev.camDistance;
+    return std::abs(cur.camTheta - prev.camTheta) < maxAngle && std::abs(cur.camPhi - prev.camPhi) < maxAngle &&
+        zoom < maxZoom && zoom > 1.0f / maxZoom &&
+        glm::length(cur.camTarget - prev.camTarget) < maxAngle * prev.camDistance;
+}
+
+/*A device command of the current frame. Its time is recorded once the frame is finished.*/
+struct frame_event
+{
+    const char* name;
+    double queued;
+    cl::Event event;
+};
+
+template <typename TKernel, typename... TArgs>
+static void enqueue_stage(std::vector<frame_event>& events, const char* name, TKernel& kernel,
+    const cl::EnqueueArgs& args, TArgs&&... kernelArgs)
+{
+    double queued = tracer::now_us();
+    events.push_back({ name, queued, kernel(args, std::forward<TArgs>(kernelArgs)...) });
+}
+
+/*Marches the queued rays until none are left, then shades the hits. Each launch of the march only covers
+the rays that survived the previous one, so the lanes are not held up by the rays that already finished.
+The hits are shaded from the G-buffer after all the rays are done, so the shading is not held up by the
+march either.
+The counters are zero again when this returns.*/
+static void trace_queued_rays(cl::CommandQueue& queue, trace_kernels& kernels, trace_target& target,
+    cl::Buffer& pixels, cl_uint2 dims, std::vector<frame_event>& events)
+{
+    cl_uint counts[2];
+    queue.enqueueReadBuffer(target.counters, CL_TRUE, 0, sizeof(counts), counts);
+    size_t in = 0;
+    while (counts[0] > 0)
+    {
+        cl_uint nRays = counts[0];
+        counts[0] = 0;
+        queue.enqueueWriteBuffer(target.counters, CL_TRUE, 0, sizeof(cl_uint), counts);
+        enqueue_stage(events, "k_march", kernels.march,
+            cl::EnqueueArgs(queue, cl::NDRange(ray_launch_size(nRays)), cl::NDRange(s_workGroupSize)),
+            pixels, s_packedBuf, s_typeBuf, s_offsetBuf, s_valueBuf, s_regBuf, s_opStepBuf, s_sceneBuf,
+            s_voxelAtlas, target.rays[in], nRays, target.rays[1 - in], target.gbuffer, target.hits,
+            target.counters, target.iters DEBUG_PIXEL);
+        queue.enqueueReadBuffer(target.counters, CL_TRUE, 0, sizeof(counts), counts);
+        in = 1 - in;
+    }
+    if (counts[1] > 0)
+    {
+        enqueue_stage(events, "k_shade", kernels.shade,
+            cl::EnqueueArgs(queue, cl::NDRange(ray_launch_size(counts[1])), cl::NDRange(s_workGroupSize)),
+            pixels, target.samples, s_packedBuf, s_typeBuf, s_offsetBuf, s_valueBuf, s_regBuf, s_opStepBuf,
+            s_sceneBuf, s_voxelAtlas, target.viewerData, dims, target.gbuffer, target.hits, counts[1]
+            DEBUG_PIXEL);
+        counts[1] = 0;
+        queue.enqueueWriteBuffer(target.counters, CL_TRUE, 0, sizeof(counts), counts);
+    }
+}
+
+/*Traces dims pixels into the target, seen from the camera in its viewer data. The depths in target.reprojected
+must be written, or cleared, before this is called. Only every step-th pixel is traced first, then the spacing
+of the samples is halved until every pixel has one. The pixels between samples that agree are interpolated,
+only the rest are traced.*/
+static void trace_pixels(cl::CommandQueue& queue, trace_kernels& kernels, trace_target& target,
+    cl::Buffer& pixels, cl_uint2 dims, cl_uint step, std::vector<frame_event>& events)
+{
+    cl_uint counts[2] = { 0, 0 };
+    queue.enqueueWriteBuffer(target.counters, CL_TRUE, 0, sizeof(counts), counts);
+    // March one cone per block of pixels first, so the rays don't start at the screen.
+    size_t nBlocks = (size_t)((dims.s[0] + CONE_BLOCK_SIZE - 1) / CONE_BLOCK_SIZE) *
+        ((dims.s[1] + CONE_BLOCK_SIZE - 1) / CONE_BLOCK_SIZE);
+    enqueue_stage(events, "k_cone_prepass", kernels.cone,
+        cl::EnqueueArgs(queue, cl::NDRange(ray_launch_size(nBlocks)), cl::NDRange(s_workGroupSize)),
+        s_packedBuf, s_typeBuf, s_offsetBuf, s_valueBuf, s_regBuf, s_opStepBuf, s_sceneBuf, s_voxelAtlas,
+        target.viewerData, dims, CONE_BLOCK_SIZE, target.blockDepths);
+
+    enqueue_stage(events, "k_generate", kernels.generate,
+        tile_launch(queue, (dims.s[0] + step - 2) / step + 1, (dims.s[1] + step - 2) / step + 1),
+        pixels, target.samples, s_sceneBuf, target.viewerData, dims, step, target.blockDepths, CONE_BLOCK_SIZE,
+        target.reprojected, target.rays[0], target.counters DEBUG_PIXEL);
+    trace_queued_rays(queue, kernels, target, pixels, dims, events);
+    for (cl_uint half = step / 2; half > 0; half /= 2)
+    {
+        enqueue_stage(events, "k_refine", kernels.refine,
+            tile_launch(queue, (dims.s[0] + 2 * half - 2) / (2 * half), (dims.s[1] + 2 * half - 2) / (2 * half)),
+            pixels, target.samples, s_sceneBuf, target.viewerData, dims, half, target.blockDepths,
+            CONE_BLOCK_SIZE, target.reprojected, target.rays[0], target.counters DEBUG_PIXEL);
+        trace_queued_rays(queue, kernels, target, pixels, dims, events);
+    }
+}
+
+/*Records the device time of the events of a frame, per stage and in total, and returns the total in
+milliseconds.*/
+static double record_frame_events(const std::vector<frame_event>& events)
+{
+    if (events.empty())
+        return 0.0;
+    std::map<std::string, double> stageTimes;
+    double traceTime = 0.0;
+    for (const frame_event& fe : events)
+    {
+        double time = record_device_event(fe.name, fe.event, fe.queued);
+        stageTimes[fe.name] += time;
+        traceTime += time;
+    }
+    for (const auto& stage : stageTimes)
+        perf::record("device." + stage.first, stage.second);
+    // The time of all the stages, comparable to the single trace kernel they replaced.
+    perf::record("device.k_trace", traceTime);
+    return traceTime;
+}
+
+/*Traces the frame seen from vdata into the pixels. The depths of the previous frame, seen from prev, are moved
+into this one first if the camera moved little since.*/
+static void trace_frame(cl::CommandQueue& queue, trace_kernels& kernels, trace_target& target, cl::Buffer& pixels,
+    cl::Buffer& prevViewerDataBuf, const viewer::viewer_data* prev, const viewer::viewer_data& vdata, cl_uint step,
+    std::vector<frame_event>& events)
+{
+    queue.enqueueWriteBuffer(target.viewerData, CL_TRUE, 0, sizeof(vdata), &vdata);
+    size_t nPixels = (size_t)target.dims.s[0] * target.dims.s[1];
+    queue.enqueueFillBuffer(target.reprojected, (cl_uint)UINT32_MAX, 0, nPixels * sizeof(cl_uint));
+    if (prev && camera_moved_slightly(*prev, vdata))
+    {
+        queue.enqueueWriteBuffer(prevViewerDataBuf, CL_TRUE, 0, sizeof(*prev), prev);
+        enqueue_stage(events, "k_reproject", kernels.reproject,
+            tile_launch(queue, target.dims.s[0], target.dims.s[1]),
+            target.samples, prevViewerDataBuf, target.viewerData, target.dims, target.reprojected);
+    }
+    trace_pixels(queue, kernels, target, pixels, target.dims, step, events);
+}
+
+/*The stats of the frame traced in the given time, with the rays and iterations counted from target.iters,
+which must have been cleared before the frame. The pixels that were interpolated have no iterations.*/
+static viewer::frame_stats frame_stats_of(cl::CommandQueue& queue, trace_target& target, double traceMs)
+{
+    std::vector<cl_uint> iters((size_t)target.dims.s[0] * target.dims.s[1]);
+    queue.enqueueReadBuffer(target.iters, CL_TRUE, 0, iters.size() * sizeof(cl_uint), iters.data());
+    viewer::frame_stats stats = { traceMs, 0, 0 };
+    for (cl_uint n : iters)
+    {
+        stats.iterations += n;
+        stats.rays += n > 0;
+    }
+    return stats;
+}
+
+/*The camera and the level of detail of a frame of the window, as they are recorded and replayed.*/
+struct recorded_frame
+{
+    float distance, theta, phi;
+    glm::vec3 target;
+    uint8_t lod;
+};
+
+static std::mutex s_recordMutex;
+static std::ofstream s_recordFile; // Receives a line per frame while the camera is being recorded.
+
+/*A replay of recorded frames in the window. The render loop traces them in place of the camera.*/
+struct window_replay
+{
+    std::vector<recorded_frame> frames;
+    std::vector<viewer::frame_stats> stats; // One per frame traced so far.
+};
+static std::mutex s_replayMutex;
+static std::condition_variable s_replayCv;
+static std::shared_ptr<window_replay> s_replay; // Shared with the frame being traced.
+
+static void record_frame(const viewer::viewer_data& vdata, uint8_t lod)
+{
+    std::lock_guard<std::mutex> lock(s_recordMutex);
+    if (!s_recordFile.is_open())
+        return;
+    s_recordFile << vdata.camDistance << ' ' << vdata.camTheta << ' ' << vdata.camPhi << ' ' << vdata.camTarget.x
+        << ' ' << vdata.camTarget.y << ' ' << vdata.camTarget.z << ' ' << (int)lod << '\n';
 }
 
 void viewer::render()
 {
+    tracer::scope renderScope("render", "render");
+    std::lock_guard<std::mutex> launchLock(s_launchMutex);
     try
     {
         cl_mem mem = s_pBuffer();
         clEnqueueAcquireGLObjects(s_queue(), 1, &mem, 0, 0, 0);
         s_queue.flush();
         s_queue.finish();
-        if (s_kernel)
+        std::vector<frame_event> events;
+        std::shared_ptr<window_replay> replay;
+        if (s_kernels)
         {
 #ifdef CLDEBUG
-            cl_uint2 mousePos = { UINT32_MAX, UINT32_MAX };
+            s_mousePixel = UINT32_MAX;
             if (viewer::getdebugmode())
             {
                 uint32_t x, y;
                 camera::get_mouse_pos(x, y);
-                mousePos = { x, WIN_H - y };
+                s_mousePixel = x + (WIN_H - y) * WIN_W;
             }
 #endif // CLDEBUG
-            cl::EnqueueArgs args = cl::EnqueueArgs(s_queue, cl::NDRange(WIN_W, WIN_H), cl::NDRange(s_workGroupSize, 1ULL));
             viewer_data vdata
             {
                 camera::distance(), camera::theta(), camera::phi(),
                 camera::target(),
                 s_minBounds,
-                s_maxBounds
+                s_maxBounds,
+                { 0.0f, 0.0f, (float)WIN_W, (float)WIN_H }
             };
-            s_queue.enqueueWriteBuffer(s_viewerDataBuf, CL_TRUE, 0, sizeof(vdata), &vdata);
-            (*s_kernel)(
-                args,
-                s_pBuffer,
-                s_packedBuf,
-                s_typeBuf,
-                s_offsetBuf,
-                s_valueBuf,
-                s_regBuf,
-                (cl_uint)s_numCurrentEntities,
-                s_opStepBuf,
-                (cl_uint)s_opStepCount,
-                s_viewerDataBuf,
-                (cl_uchar)s_levelOfDetail
-#ifdef CLDEBUG
-                , mousePos
-#endif // CLDEBUG
-            );
-            if (s_repeatPixelKernel && s_levelOfDetail > 0)
             {
-                (*s_repeatPixelKernel)(args, s_pBuffer, (cl_uchar)s_levelOfDetail);
+                std::lock_guard<std::mutex> lock(s_replayMutex);
+                replay = s_replay;
+            }
+            if (replay)
+            {
+                // The replay starts from scratch, like the session it was recorded in.
+                if (replay->stats.empty())
+                    s_hasPrevFrame = false;
+                const recorded_frame& frame = replay->frames[replay->stats.size()];
+                vdata.camDistance = frame.distance;
+                vdata.camTheta = frame.theta;
+                vdata.camPhi = frame.phi;
+                vdata.camTarget = frame.target;
+                s_levelOfDetail = frame.lod;
+                s_queue.enqueueFillBuffer(s_frame.iters, (cl_uint)0, 0, WIN_W * WIN_H * sizeof(cl_uint));
             }
+            record_frame(vdata, s_levelOfDetail);
+            // Move the hits of the previous frame into this one, so the rays start close to the surfaces.
+            trace_frame(s_queue, *s_kernels, s_frame, s_pBuffer, s_prevViewerDataBuf,
+                s_hasPrevFrame ? &s_prevViewerData : nullptr, vdata, 1u << s_levelOfDetail, events);
+            s_prevViewerData = vdata;
+            s_hasPrevFrame = true;
             update_LOD();
         }
         clEnqueueReleaseGLObjects(s_queue(), 1, &mem, 0, 0, 0);
         s_queue.flush();
         s_queue.finish();
+        // The events are complete after the queue is finished, so the profiling info is available.
+        double traceTime = record_frame_events(events);
+        if (replay)
+        {
+            viewer::frame_stats stats = frame_stats_of(s_queue, s_frame, traceTime);
+            std::lock_guard<std::mutex> lock(s_replayMutex);
+            // The replay is abandoned if the window is closing.
+            if (s_replay == replay)
+            {
+                replay->stats.push_back(stats);
+                if (replay->stats.size() == replay->frames.size())
+                {
+                    s_replay = nullptr;
+                    s_replayCv.notify_all();
+                }
+            }
+        }
     }
     CATCH_EXIT_CL_ERR;
 }
@@ -490,49 +852,510 @@ void viewer::reset_LOD()
     s_levelOfDetail = s_lowestLOD;
 }
 
+/*Waits for the exported frame to be written, and reports whether that failed.*/
+static bool finish_export()
+{
+    if (!s_exportStream)
+        return true;
+    std::unique_ptr<util::image_stream> stream = std::move(s_exportStream);
+    try
+    {
+        stream->finish();
+        return true;
+    }
+    catch (const char* error)
+    {
+        std::cerr << "Failed to export the frame: " << error << std::endl;
+        return false;
+    }
+}
+
 bool viewer::exportframe(const std::string& path)
 {
+    // The previous frame must be written before the pinned buffer is used again.
+    finish_export();
+    std::unique_ptr<util::image_writer> writer;
+    try
+    {
+        writer = util::image_writer::create(path, WIN_W, WIN_H);
+    }
+    catch (const char* error)
+    {
+        std::cerr << error << std::endl;
+        return false;
+    }
     try
     {
-        size_t nPixels = WIN_W * WIN_H;
-        std::vector<uint8_t> pdata(nPixels * 4); // 4 channels per pixel.
+        size_t nBytes = WIN_W * WIN_H * sizeof(uint32_t);
+        uint32_t* pixels = nullptr;
         {
             cl_mem mem = s_pBuffer();
             pause_render_loop();
+            cl::Event copyEvent;
             clEnqueueAcquireGLObjects(s_queue(), 1, &mem, 0, 0, 0);
-            s_queue.enqueueReadBuffer(s_pBuffer, true, 0, nPixels * sizeof(uint32_t), pdata.data());
+            double copyQueued = tracer::now_us();
+            s_queue.enqueueCopyBuffer(s_pBuffer, s_readbackBuf, 0, 0, nBytes, nullptr, &copyEvent);
             clEnqueueReleaseGLObjects(s_queue(), 1, &mem, 0, 0, 0);
+            // The map waits for the copy, after that the renderer can go on while the frame is encoded.
+            pixels = (uint32_t*)s_queue.enqueueMapBuffer(s_readbackBuf, CL_TRUE, CL_MAP_READ, 0, nBytes);
             resume_render_loop();
+            perf::record("device.readback", record_device_event("readback", copyEvent, copyQueued));
         }
-        bgil::rgba8_image_t img(WIN_W, WIN_H);
-        auto dataIt = pdata.cbegin();
-        // We need the flipped view because the y-axis in boost goes from bottom to top.
-        auto flippedView = bgil::flipped_up_down_view(bgil::view(img));
-        auto imgIt = flippedView.begin();
-        auto imgEnd = flippedView.end();
-        while (dataIt != pdata.cend() && imgIt != imgEnd)
+        s_exportStream = std::make_unique<util::image_stream>(std::move(writer));
+        // The rows of the kernels go up.
+        bool bottomUp = s_exportStream->writer().bottom_up();
+        s_exportStream->write_rows(bottomUp ? pixels : pixels + (size_t)(WIN_H - 1) * WIN_W, WIN_H,
+            bottomUp ? (ptrdiff_t)WIN_W : -(ptrdiff_t)WIN_W, [pixels]()
+            {
+                try
+                {
+                    s_queue.enqueueUnmapMemObject(s_readbackBuf, pixels);
+                }
+                CATCH_EXIT_CL_ERR;
+            });
+        return true;
+    }
+    CATCH_EXIT_CL_ERR;
+}
+
+static constexpr uint32_t TILE_SIZE = 256; // Pixels along the side of a tile of an offline render.
+// Tiles traced at the same time on every device, so one can be read back while the others are traced.
+static constexpr size_t QUEUES_PER_DEVICE = 2;
+
+/*Traces tiles of an offline render on its own queue, with its own kernels and buffers.*/
+struct tile_worker
+{
+    cl::CommandQueue queue;
+    trace_kernels kernels;
+    trace_target target;
+    cl::Buffer pixels; // Pinned, so the tile is read back by mapping it.
+
+    tile_worker(const cl::Device& device)
+        : queue(s_context, device, CL_QUEUE_PROFILING_ENABLE), kernels(s_program),
+        target(s_context, TILE_SIZE, TILE_SIZE),
+        pixels(s_context, CL_MEM_ALLOC_HOST_PTR | CL_MEM_HOST_READ_ONLY | CL_MEM_WRITE_ONLY,
+            TILE_SIZE * TILE_SIZE * sizeof(cl_uint))
+    {
+    }
+
+    /*Traces the tile whose bottom left pixel is at (x0, y0) in the image, and copies it into the band, which
+    is a block of rows of the image. The rows of the band go up, like the rows of the kernels.*/
+    void trace_tile(const viewer::viewer_data& camera, uint32_t width, uint32_t height, uint32_t x0, uint32_t y0,
+        cl_uint2 dims, uint32_t* band)
+    {
+        viewer::viewer_data vdata = camera;
+        vdata.viewport = { (float)x0, (float)y0, (float)width, (float)height };
+        queue.enqueueWriteBuffer(target.viewerData, CL_TRUE, 0, sizeof(vdata), &vdata);
+        queue.enqueueFillBuffer(target.reprojected, (cl_uint)UINT32_MAX, 0,
+            (size_t)dims.s[0] * dims.s[1] * sizeof(cl_uint));
+        std::vector<frame_event> events;
+        trace_pixels(queue, kernels, target, pixels, dims, 1, events);
+        size_t nBytes = (size_t)dims.s[0] * dims.s[1] * sizeof(cl_uint);
+        const uint32_t* tile = (const uint32_t*)queue.enqueueMapBuffer(pixels, CL_TRUE, CL_MAP_READ, 0, nBytes);
+        for (uint32_t r = 0; r < dims.s[1]; r++)
+            std::copy_n(tile + (size_t)r * dims.s[0], dims.s[0], band + (size_t)r * width + x0);
+        queue.enqueueUnmapMemObject(pixels, (void*)tile);
+    }
+};
+
+viewer::viewer_data viewer::current_view()
+{
+    return
+    {
+        camera::distance(), camera::theta(), camera::phi(),
+        camera::target(),
+        s_minBounds,
+        s_maxBounds,
+        { 0.0f, 0.0f, (float)WIN_W, (float)WIN_H }
+    };
+}
+
+void viewer::render_image(const std::string& path, uint32_t width, uint32_t height, const viewer_data& camera)
+{
+    if (!s_kernels)
+        throw "The render kernels are not built.";
+    tracer::scope renderScope("render_image", "render");
+    perf::scoped_timer timer("host.render_image");
+    // One band is written in the background while the next one is traced. The stream only keeps pointers to
+    // the rows, so the bands must outlive it.
+    std::vector<uint32_t> bands[2];
+    util::image_stream stream(util::image_writer::create(path, width, height));
+    bool bottomUp = stream.writer().bottom_up();
+    try
+    {
+        std::vector<std::unique_ptr<tile_worker>> workers;
+        for (const cl::Device& device : s_context.getInfo<CL_CONTEXT_DEVICES>())
         {
-            uint8_t r = *(dataIt++);
-            uint8_t g = *(dataIt++);
-            uint8_t b = *(dataIt++);
-            uint8_t a = *(dataIt++);
-            *(imgIt++) = bgil::rgba8_pixel_t(r, g, b, a);
+            for (size_t i = 0; i < QUEUES_PER_DEVICE; i++)
+                workers.push_back(std::make_unique<tile_worker>(device));
         }
-        if (check_format(path, ".bmp"))
+        uint32_t nTilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+        uint32_t nBands = (height + TILE_SIZE - 1) / TILE_SIZE;
+        for (uint32_t bi = 0; bi < nBands; bi++)
         {
-            bgil::write_view(path, bgil::view(img), bgil::bmp_tag{});
+            // The bands go in the order of the rows of the file.
+            uint32_t nRows = std::min(TILE_SIZE, height - bi * TILE_SIZE);
+            uint32_t y0 = bottomUp ? bi * TILE_SIZE : height - bi * TILE_SIZE - nRows;
+            // The band traced before the previous one must be written before its memory is reused.
+            stream.wait(1);
+            std::vector<uint32_t>& band = bands[bi % 2];
+            band.resize((size_t)width * nRows);
+            // The workers take the tiles of the band one at a time, until none are left.
+            std::atomic<uint32_t> nextTile(0);
+            std::vector<std::thread> threads;
+            for (auto& worker : workers)
+            {
+                threads.emplace_back([&, w = worker.get()]()
+                    {
+                        try
+                        {
+                            for (uint32_t ti = nextTile++; ti < nTilesX; ti = nextTile++)
+                            {
+                                uint32_t x0 = ti * TILE_SIZE;
+                                cl_uint2 dims = { std::min(TILE_SIZE, width - x0), nRows };
+                                w->trace_tile(camera, width, height, x0, y0, dims, band.data());
+                            }
+                        }
+                        CATCH_EXIT_CL_ERR;
+                    });
+            }
+            for (std::thread& t : threads)
+                t.join();
+            stream.write_rows(bottomUp ? band.data() : band.data() + (size_t)(nRows - 1) * width, nRows,
+                bottomUp ? (ptrdiff_t)width : -(ptrdiff_t)width, nullptr);
         }
-        else
+    }
+    CATCH_EXIT_CL_ERR;
+    stream.finish();
+}
+
+/*The file of one frame of a path. The pattern must have exactly one %d, optionally with a zero padded width
+like %05d, which is replaced by the index of the frame. %% stands for a percent sign.*/
+static std::string frame_path(const std::string& pattern, uint32_t index)
+{
+    std::string path;
+    size_t nIndices = 0;
+    for (size_t i = 0; i < pattern.size(); i++)
+    {
+        if (pattern[i] != '%')
         {
-            std::cerr << "Cannot export this format." << std::endl;
-            return false;
+            path += pattern[i];
+            continue;
         }
+        if (++i < pattern.size() && pattern[i] == '%')
+        {
+            path += '%';
+            continue;
+        }
+        bool zeros = i < pattern.size() && pattern[i] == '0';
+        size_t width = 0;
+        for (; i < pattern.size() && std::isdigit((unsigned char)pattern[i]); i++)
+            width = width * 10 + (pattern[i] - '0');
+        if (i == pattern.size() || pattern[i] != 'd' || width > 10)
+            throw "The file names can only have a %d, or a %0Nd.";
+        std::string digits = std::to_string(index);
+        if (digits.size() < width)
+            path.append(width - digits.size(), zeros ? '0' : ' ');
+        path += digits;
+        nIndices++;
+    }
+    if (nIndices != 1)
+        throw "The file names must have exactly one %d for the frame number.";
+    return path;
+}
 
-        return true;
+void viewer::render_path(const std::string& path, uint32_t width, uint32_t height,
+    const std::vector<viewer_data>& cameras)
+{
+    if (!s_kernels)
+        throw "The render kernels are not built.";
+    if (cameras.empty())
+        throw "At least one camera is required.";
+    tracer::scope renderScope("render_path", "render");
+    perf::scoped_timer timer("host.render_path");
+    bool isVideo = util::image_writer::is_video(path);
+    // Bad paths should fail before anything is traced.
+    std::unique_ptr<util::image_writer> videoWriter;
+    if (isVideo)
+        videoWriter = util::image_writer::create_video(path, width, height, (uint32_t)cameras.size());
+    else
+        frame_path(path, 0);
+    try
+    {
+        cl::CommandQueue queue(s_context, s_context.getInfo<CL_CONTEXT_DEVICES>().front(),
+            CL_QUEUE_PROFILING_ENABLE);
+        trace_kernels kernels(s_program);
+        trace_target target(s_context, width, height);
+        // All the cameras are uploaded at once, and copied into place on the device before each frame.
+        std::vector<viewer_data> batch(cameras);
+        for (viewer_data& camera : batch)
+            camera.viewport = { 0.0f, 0.0f, (float)width, (float)height };
+        cl::Buffer cameraBuf(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, batch.size() * sizeof(viewer_data));
+        queue.enqueueWriteBuffer(cameraBuf, CL_FALSE, 0, batch.size() * sizeof(viewer_data), batch.data());
+        cl::Buffer prevViewerData(s_context, CL_MEM_HOST_NO_ACCESS | CL_MEM_READ_ONLY, sizeof(viewer_data));
+        // A frame is read back while the next one is traced, and written in the background while the one after
+        // that is traced, so there are three sets of pixels.
+        size_t nBytes = (size_t)width * height * sizeof(cl_uint);
+        cl::Buffer pixels[3];
+        for (cl::Buffer& buf : pixels)
+            buf = cl::Buffer(s_context, CL_MEM_ALLOC_HOST_PTR | CL_MEM_HOST_READ_ONLY | CL_MEM_WRITE_ONLY, nBytes);
+        // The streams release the pixels on this queue, so they must be finished before it goes away.
+        std::unique_ptr<util::image_stream> video;
+        if (isVideo)
+            video = std::make_unique<util::image_stream>(std::move(videoWriter));
+        std::deque<std::unique_ptr<util::image_stream>> frames; // The files of the frames not yet finished.
+        // Hands the mapped pixels of a frame to its stream, once the map is done.
+        auto write_frame = [&](size_t index, cl::Buffer& buf, uint32_t* mapped, cl::Event& mapDone)
+        {
+            mapDone.wait();
+            util::image_stream* stream = video.get();
+            if (!stream)
+            {
+                frames.push_back(std::make_unique<util::image_stream>(
+                    util::image_writer::create(frame_path(path, (uint32_t)index), width, height)));
+                stream = frames.back().get();
+            }
+            // The rows of the kernels go up.
+            bool bottomUp = stream->writer().bottom_up();
+            stream->write_rows(bottomUp ? mapped : mapped + (size_t)(height - 1) * width, height,
+                bottomUp ? (ptrdiff_t)width : -(ptrdiff_t)width, [&queue, &buf, mapped]()
+                {
+                    try
+                    {
+                        queue.enqueueUnmapMemObject(buf, mapped);
+                    }
+                    CATCH_EXIT_CL_ERR;
+                });
+        };
+        cl_uint2 dims;
+        dims.s[0] = width;
+        dims.s[1] = height;
+        std::vector<frame_event> events;
+        uint32_t* mapped = nullptr; // The pixels of the previous frame, being read back.
+        cl::Event mapEvent;
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            // The frame three frames back must be written, and its pixels unmapped, before they are reused. The
+            // previous frame is not handed to its stream yet.
+            if (video)
+                video->wait(1);
+            while (frames.size() > 1)
+            {
+                frames.front()->finish();
+                frames.pop_front();
+            }
+            cl::Buffer& buf = pixels[i % 3];
+            events.clear();
+            queue.enqueueCopyBuffer(cameraBuf, target.viewerData, i * sizeof(viewer_data), 0, sizeof(viewer_data));
+            queue.enqueueFillBuffer(target.reprojected, (cl_uint)UINT32_MAX, 0, nBytes);
+            if (i > 0 && camera_moved_slightly(batch[i - 1], batch[i]))
+            {
+                queue.enqueueCopyBuffer(cameraBuf, prevViewerData, (i - 1) * sizeof(viewer_data), 0,
+                    sizeof(viewer_data));
+                enqueue_stage(events, "k_reproject", kernels.reproject,
+                    tile_launch(queue, width, height),
+                    target.samples, prevViewerData, target.viewerData, dims, target.reprojected);
+            }
+            trace_pixels(queue, kernels, target, buf, dims, 1, events);
+            cl::Event event;
+            uint32_t* frame = (uint32_t*)queue.enqueueMapBuffer(buf, CL_FALSE, CL_MAP_READ, 0, nBytes, nullptr,
+                &event);
+            // This frame is queued behind the read back of the previous one, which can now be written.
+            if (mapped)
+                write_frame(i - 1, pixels[(i - 1) % 3], mapped, mapEvent);
+            mapped = frame;
+            mapEvent = event;
+        }
+        write_frame(batch.size() - 1, pixels[(batch.size() - 1) % 3], mapped, mapEvent);
+        if (video)
+            video->finish();
+        for (auto& frame : frames)
+            frame->finish();
+        queue.finish();
     }
     CATCH_EXIT_CL_ERR;
 }
 
+void viewer::record_begin(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(s_recordMutex);
+    if (s_recordFile.is_open())
+        s_recordFile.close();
+    s_recordFile.open(path, std::ios::trunc);
+    if (!s_recordFile)
+        throw "Cannot open the file for recording.";
+    // Enough digits for the floats to be read back exactly.
+    s_recordFile << std::setprecision(9);
+    s_recordFile << "# distance theta phi target_x target_y target_z lod\n";
+}
+
+void viewer::record_end()
+{
+    std::lock_guard<std::mutex> lock(s_recordMutex);
+    if (!s_recordFile.is_open())
+        throw "The camera is not being recorded.";
+    s_recordFile.close();
+}
+
+/*Reads the frames written by record_begin. Lines starting with # are comments.*/
+static std::vector<recorded_frame> read_recorded_frames(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file)
+        throw "Cannot open the recorded camera path.";
+    std::vector<recorded_frame> frames;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream values(line);
+        recorded_frame frame;
+        int lod;
+        values >> frame.distance >> frame.theta >> frame.phi >> frame.target.x >> frame.target.y >> frame.target.z
+            >> lod;
+        if (!values || lod < 0 || lod > 8)
+            throw "The recorded camera path is invalid.";
+        frame.lod = (uint8_t)lod;
+        frames.push_back(frame);
+    }
+    if (frames.empty())
+        throw "The recorded camera path has no frames.";
+    return frames;
+}
+
+/*Traces the views one after the other on a queue of their own, with the given kernels. See
+viewer::trace_offscreen.*/
+static std::vector<viewer::frame_stats> trace_views(trace_kernels& kernels,
+    const std::vector<viewer::viewer_data>& views, const std::vector<uint8_t>& lods, uint32_t width,
+    uint32_t height, std::vector<uint32_t>* image)
+{
+    using viewer::viewer_data;
+    std::vector<viewer::frame_stats> stats;
+    try
+    {
+        cl::CommandQueue queue(s_context, s_context.getInfo<CL_CONTEXT_DEVICES>().front(),
+            CL_QUEUE_PROFILING_ENABLE);
+        trace_target target(s_context, width, height);
+        size_t nBytes = (size_t)width * height * sizeof(cl_uint);
+        cl::Buffer pixels(s_context, CL_MEM_HOST_READ_ONLY | CL_MEM_WRITE_ONLY, nBytes);
+        cl::Buffer prevViewerDataBuf(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, sizeof(viewer_data));
+        std::vector<frame_event> events;
+        for (size_t i = 0; i < views.size(); i++)
+        {
+            viewer_data vdata = views[i];
+            vdata.viewport = { 0.0f, 0.0f, (float)width, (float)height };
+            viewer_data prev = i > 0 ? views[i - 1] : vdata;
+            prev.viewport = vdata.viewport;
+            events.clear();
+            queue.enqueueFillBuffer(target.iters, (cl_uint)0, 0, nBytes);
+            trace_frame(queue, kernels, target, pixels, prevViewerDataBuf, i > 0 ? &prev : nullptr, vdata,
+                1u << lods[i], events);
+            queue.finish();
+            stats.push_back(frame_stats_of(queue, target, record_frame_events(events)));
+        }
+        if (image && !views.empty())
+        {
+            image->resize((size_t)width * height);
+            queue.enqueueReadBuffer(pixels, CL_TRUE, 0, nBytes, image->data());
+        }
+    }
+    CATCH_EXIT_CL_ERR;
+    return stats;
+}
+
+std::vector<viewer::frame_stats> viewer::trace_offscreen(const std::vector<viewer_data>& views,
+    const std::vector<uint8_t>& lods, uint32_t width, uint32_t height, std::vector<uint32_t>* image)
+{
+    if (!s_kernels)
+        throw "The render kernels are not built.";
+    if (lods.size() != views.size())
+        throw "Every view needs a level of detail.";
+    pause_render_loop();
+    std::vector<frame_stats> stats;
+    try
+    {
+        trace_kernels kernels(s_program);
+        stats = trace_views(kernels, views, lods, width, height, image);
+    }
+    CATCH_EXIT_CL_ERR;
+    resume_render_loop();
+    return stats;
+}
+
+double viewer::eval_points(const std::vector<glm::vec3>& points, std::vector<float>& values)
+{
+    if (!s_kernels)
+        throw "The render kernels are not built.";
+    values.resize(points.size());
+    if (points.empty())
+        return 0.0;
+    double evalTime = 0.0;
+    pause_render_loop();
+    try
+    {
+        cl::CommandQueue queue(s_context, s_context.getInfo<CL_CONTEXT_DEVICES>().front(),
+            CL_QUEUE_PROFILING_ENABLE);
+        eval_kernel eval(s_program, "k_eval");
+        // glm::vec3 is tightly packed, the kernel reads it with vload3.
+        cl::Buffer pointBuf(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, points.size() * sizeof(glm::vec3));
+        cl::Buffer valueBuf(s_context, CL_MEM_HOST_READ_ONLY | CL_MEM_WRITE_ONLY, points.size() * sizeof(float));
+        queue.enqueueWriteBuffer(pointBuf, CL_TRUE, 0, points.size() * sizeof(glm::vec3), points.data());
+        double queued = tracer::now_us();
+        cl::Event event = eval(
+            cl::EnqueueArgs(queue, cl::NDRange(ray_launch_size(points.size())), cl::NDRange(s_workGroupSize)),
+            s_packedBuf, s_typeBuf, s_offsetBuf, s_valueBuf, s_regBuf, s_opStepBuf, s_sceneBuf, s_voxelAtlas,
+            pointBuf, (cl_uint)points.size(), valueBuf);
+        queue.enqueueReadBuffer(valueBuf, CL_TRUE, 0, values.size() * sizeof(float), values.data());
+        evalTime = record_device_event("k_eval", event, queued);
+    }
+    CATCH_EXIT_CL_ERR;
+    resume_render_loop();
+    return evalTime;
+}
+
+std::vector<viewer::frame_stats> viewer::replay(const std::string& path, bool windowed)
+{
+    if (!s_kernels)
+        throw "The render kernels are not built.";
+    std::vector<recorded_frame> frames = read_recorded_frames(path);
+    tracer::scope replayScope("replay", "render");
+    if (!windowed)
+    {
+        // Off screen at the size of the window, with the bounds of the window.
+        std::vector<viewer_data> views;
+        std::vector<uint8_t> lods;
+        for (const recorded_frame& frame : frames)
+        {
+            viewer_data vdata = current_view();
+            vdata.camDistance = frame.distance;
+            vdata.camTheta = frame.theta;
+            vdata.camPhi = frame.phi;
+            vdata.camTarget = frame.target;
+            views.push_back(vdata);
+            lods.push_back(frame.lod);
+        }
+        return trace_offscreen(views, lods, WIN_W, WIN_H);
+    }
+
+    auto replay = std::make_shared<window_replay>();
+    replay->frames = std::move(frames);
+    std::unique_lock<std::mutex> lock(s_replayMutex);
+    if (s_replay)
+        throw "Another replay is running.";
+    s_replay = replay;
+    while (s_replay == replay)
+    {
+        if (s_replayCv.wait_for(lock, std::chrono::milliseconds(100)) == std::cv_status::timeout &&
+            (viewer::window_should_close() || s_shouldExit))
+        {
+            s_replay.reset();
+            throw "The window was closed during the replay.";
+        }
+    }
+    return replay->stats;
+}
+
 void viewer::setbounds(float(&bounds)[6])
 {
     s_minBounds.x = bounds[0];
@@ -567,6 +1390,65 @@ void viewer::debugstep()
 }
 #endif // CLDEBUG
 
+/*Creates the queue on the device of the context, builds the kernels and reads the limits of the device.*/
+/*Builds the render kernels for the device with the given options, besides the include path. Prints the
+build log and returns false if the build fails.*/
+static bool build_program(const cl::Device& device, const std::string& options, cl::Program& program)
+{
+    program = cl::Program(s_context, cl_kernel_sources::render_kernel(), false);
+    std::string optionStr = "-I \"" + cl_kernel_sources::abs_path() + "\"";
+#ifdef CLDEBUG
+    optionStr += " -D CLDEBUG";
+#endif // CLDEBUG
+    if (!options.empty())
+        optionStr += " " + options;
+    try
+    {
+        program.build(optionStr.c_str());
+        return true;
+    }
+    catch (cl::Error error)
+    {
+        std::string log = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+        std::cerr << "Error - " << error.err() << " when building the kernel program. Error log: " << std::endl;
+        std::cerr << log << std::endl;
+        return false;
+    }
+}
+
+static void init_device(const cl::Device& device)
+{
+    s_queue = cl::CommandQueue(s_context, device, CL_QUEUE_PROFILING_ENABLE);
+    if (build_program(device, s_buildOptions, s_program))
+        s_kernels = new trace_kernels(s_program);
+    s_globalMemSize = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+    s_maxBufSize = s_globalMemSize / 32;
+    s_localMemSize = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+    s_constMemSize = device.getInfo< CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>();
+    s_maxLocalBufSize = s_localMemSize / 4;
+    s_valueBuf = cl::Local(s_maxLocalBufSize);
+    s_regBuf = cl::Local(s_maxLocalBufSize);
+    s_maxWorkGroupSize = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+    viewer::set_work_group_size();
+}
+
+/*Allocates the buffers of the scene, which the window and the off screen renders share.*/
+static void init_scene_buffers()
+{
+    s_packedBuf = cl::Buffer(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, s_maxBufSize);
+    s_typeBuf = cl::Buffer(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, s_maxBufSize);
+    s_offsetBuf = cl::Buffer(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, s_maxBufSize);
+    s_opStepBuf = cl::Buffer(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, s_maxBufSize);
+    s_sceneBuf = cl::Buffer(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, s_maxBufSize);
+    // The scene is empty until something is shown.
+    i_scene empty = {};
+    s_queue.enqueueWriteBuffer(s_sceneBuf, CL_TRUE, 0, sizeof(empty), &empty);
+    s_prevViewerDataBuf = cl::Buffer(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY,
+        sizeof(viewer::viewer_data));
+    // Placeholder until a voxel grid is shown. 3d images need a depth of at least 2.
+    s_voxelAtlas = cl::Image3D(s_context, CL_MEM_READ_ONLY, cl::ImageFormat(CL_R, CL_FLOAT), 1, 1, 2);
+}
+
 void viewer::init_ocl()
 {
     try
@@ -597,41 +1479,54 @@ void viewer::init_ocl()
             exit(1);
         }
         s_context = cl::Context(devices[0], props);
-        s_queue = cl::CommandQueue(s_context, devices[0]);
-        s_program = cl::Program(s_context, cl_kernel_sources::render_kernel(), false);
-        std::string optionStr = "-I \"" + cl_kernel_sources::abs_path() + "\"";
-#ifdef CLDEBUG
-        optionStr += " -D CLDEBUG";
-#endif // CLDEBUG
-        try
-        {
-            s_program.build(optionStr.c_str());
-
-            s_kernel = new cl::make_kernel<
-                cl::BufferGL&, cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::LocalSpaceArg,
-                cl::LocalSpaceArg, cl_uint, cl::Buffer&, cl_uint, cl::Buffer&, cl_uchar
-#ifdef CLDEBUG
-                , cl_uint2
-#endif // CLDEBUG
-            >(s_program, "k_trace");
+        init_device(devices[0]);
+    }
+    CATCH_EXIT_CL_ERR;
+}
 
-            s_repeatPixelKernel = new cl::make_kernel<cl::BufferGL&, cl_uchar>(s_program, "k_repeatPixels");
-        }
-        catch (cl::Error error)
+void viewer::init_headless(cl_device_type deviceType)
+{
+    cl::Device device;
+    try
+    {
+        // CPU runtimes are often on a platform of their own.
+        std::vector<cl::Platform> platforms;
+        cl::Platform::get(&platforms);
+        for (const cl::Platform& platform : platforms)
         {
-            std::string log = s_program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(cl::Device::getDefault());
-            std::cerr << "Error - " << error.err() << " when building the kernel program. Error log: " << std::endl;
-            std::cerr << log << std::endl;
+            std::vector<cl::Device> devices;
+            try
+            {
+                platform.getDevices(deviceType, &devices);
+            }
+            catch (cl::Error)
+            {
+                continue; // No devices of this type.
+            }
+            if (!devices.empty())
+            {
+                device = devices.front();
+                break;
+            }
         }
-        s_globalMemSize = devices[0].getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
-        s_maxBufSize = s_globalMemSize / 32;
-        s_localMemSize = devices[0].getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
-        s_constMemSize = devices[0].getInfo< CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>();
-        s_maxLocalBufSize = s_localMemSize / 4;
-        s_valueBuf = cl::Local(s_maxLocalBufSize);
-        s_regBuf = cl::Local(s_maxLocalBufSize);
-        s_maxWorkGroupSize = devices[0].getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
-        viewer::set_work_group_size();
+    }
+    CATCH_EXIT_CL_ERR;
+    if (!device())
+        throw "No OpenCL device of that type was found.";
+    try
+    {
+        s_context = cl::Context(device);
+        init_device(device);
+        init_scene_buffers();
+    }
+    CATCH_EXIT_CL_ERR;
+}
+
+std::string viewer::device_name()
+{
+    try
+    {
+        return s_context.getInfo<CL_CONTEXT_DEVICES>().front().getInfo<CL_DEVICE_NAME>();
     }
     CATCH_EXIT_CL_ERR;
 }
@@ -663,58 +1558,193 @@ void viewer::init_buffers()
             exit(1);
         }
 
-        s_packedBuf = cl::Buffer(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, s_maxBufSize);
-        s_typeBuf = cl::Buffer(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, s_maxBufSize);
-        s_offsetBuf = cl::Buffer(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, s_maxBufSize);
-        s_opStepBuf = cl::Buffer(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, s_maxBufSize);
-        s_viewerDataBuf = cl::Buffer(s_context, CL_MEM_HOST_WRITE_ONLY | CL_MEM_READ_ONLY, 12 * sizeof(float));
+        init_scene_buffers();
+        s_frame = trace_target(s_context, WIN_W, WIN_H);
+        s_readbackBuf = cl::Buffer(s_context, CL_MEM_ALLOC_HOST_PTR | CL_MEM_HOST_READ_ONLY | CL_MEM_WRITE_ONLY,
+            WIN_W * WIN_H * sizeof(uint32_t));
     }
     CATCH_EXIT_CL_ERR;
 }
 
+/*Scenes are tuned by the number of entities of the largest object, rounded up to a power of two, because
+that is what decides how much local memory every ray needs.*/
+static std::string scene_class()
+{
+    size_t bound = 1;
+    while (bound < s_numCurrentEntities)
+        bound *= 2;
+    return "up to " + std::to_string(bound) + " entities";
+}
+
+static std::string tuning_key(const std::string& sceneClass)
+{
+    cl::Device device = s_context.getInfo<CL_CONTEXT_DEVICES>().front();
+    return device.getInfo<CL_DEVICE_NAME>() + " / " + device.getInfo<CL_DRIVER_VERSION>() + " / " + sceneClass;
+}
+
+/*Switches the kernels to the program built with the options, building it if they differ from the current ones.
+Returns false if the build fails, and the current kernels are kept.*/
+static bool use_build_options(const std::string& options)
+{
+    if (options == s_buildOptions && s_kernels)
+        return true;
+    cl::Program program;
+    if (!build_program(s_context.getInfo<CL_CONTEXT_DEVICES>().front(), options, program))
+        return false;
+    delete s_kernels;
+    s_program = program;
+    s_kernels = new trace_kernels(s_program);
+    s_buildOptions = options;
+    return true;
+}
+
+/*The largest work-group the compiler allows for the 2-D stages, which can be less than the device allows.*/
+static size_t max_tile_size(const cl::Program& program, const cl::Device& device)
+{
+    size_t size = s_maxWorkGroupSize;
+    for (const char* name : { "k_reproject", "k_generate", "k_refine" })
+        size = std::min(size, cl::Kernel(program, name).getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+    return size;
+}
+
+/*Whether the 2-D stages of the program can be launched in tiles of the shape on the device.*/
+static bool tile_fits(uint32_t width, uint32_t height, size_t maxTile, const std::vector<size_t>& maxItems)
+{
+    return (size_t)width * height <= maxTile && maxItems.size() >= 2 && width <= maxItems[0]
+        && height <= maxItems[1];
+}
+
+/*Looks up the launch configuration tuned for the device and the current class of scene, and uses it. The
+defaults are used for the scenes that were never tuned. Either is halved along its longer side until the
+device and the kernels allow it.*/
+static void apply_tuning()
+{
+    std::string sceneClass = scene_class();
+    if (sceneClass == s_tunedClass)
+        return;
+    s_tunedClass = sceneClass;
+    tune_cache::launch_config config;
+    if (!tune_cache::load(tuning_key(sceneClass), config))
+        config = { 8, 8, std::string() };
+    if (!use_build_options(config.buildOptions))
+        use_build_options(std::string());
+    cl::Device device = s_context.getInfo<CL_CONTEXT_DEVICES>().front();
+    std::vector<size_t> maxItems = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+    size_t maxTile = s_kernels ? max_tile_size(s_program, device) : s_maxWorkGroupSize;
+    while ((config.tileWidth > 1 || config.tileHeight > 1)
+        && !tile_fits(config.tileWidth, config.tileHeight, maxTile, maxItems))
+    {
+        if (config.tileWidth >= config.tileHeight)
+            config.tileWidth /= 2;
+        else
+            config.tileHeight /= 2;
+    }
+    s_tileW = config.tileWidth;
+    s_tileH = config.tileHeight;
+}
+
+/*The rays are launched in work-groups as large as the tiles, unless the local memory the rays of the largest
+object need doesn't allow it.*/
+static void update_work_group_size()
+{
+    size_t nEntities = std::max((uint64_t)1ULL, (uint64_t)s_numCurrentEntities);
+    s_workGroupSize = std::max((size_t)1, std::min({ (size_t)s_tileW * s_tileH, s_maxWorkGroupSize,
+        s_maxLocalBufSize / (sizeof(float) * nEntities) }));
+}
+
 void viewer::set_work_group_size()
 {
     if (s_numCurrentEntities > MAX_ENTITY_COUNT)
     {
         throw "too many entities";
     }
-    size_t nEntities = std::max((uint64_t)1ULL, (uint64_t)s_numCurrentEntities);
-    std::vector<size_t> factors;
-    auto fIter = std::back_inserter(factors);
-    size_t width = (size_t)WIN_W;
-    util::factorize(width, fIter);
-    std::sort(factors.begin(), factors.end());
-    s_workGroupSize =
-        std::min(width, std::min(
-            s_maxWorkGroupSize,
-            (size_t)std::ceil(s_maxLocalBufSize / (sizeof(float) * nEntities))));
-    if (width % s_workGroupSize)
-    {
-        size_t newSize = width;
-        for (size_t f : factors)
+    std::lock_guard<std::mutex> lock(s_launchMutex);
+    apply_tuning();
+    update_work_group_size();
+}
+
+/*Work-group shapes of the 2-D stages tried by autotune, in the order they are tried.*/
+static const std::pair<uint32_t, uint32_t> TILE_SHAPES[] = {
+    { 8, 8 }, { 16, 4 }, { 32, 2 }, { 64, 1 }, { 4, 16 }, { 16, 8 }, { 32, 4 }, { 16, 16 }, { 32, 8 }, { 64, 4 } };
+/*Build options tried by autotune. The finite math options are left out because the kernels rely on INFINITY.*/
+static const char* BUILD_OPTIONS[] = { "", "-cl-mad-enable", "-cl-unsafe-math-optimizations" };
+
+std::vector<viewer::tuning_result> viewer::autotune()
+{
+    if (!s_kernels)
+        throw "The render kernels are not built.";
+    const size_t RUNS = 5;
+    cl::Device device = s_context.getInfo<CL_CONTEXT_DEVICES>().front();
+    std::vector<size_t> maxItems = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+    std::vector<viewer_data> views = { current_view() };
+    std::vector<uint8_t> lods = { 0 };
+    std::vector<tuning_result> results;
+    pause_render_loop();
+    std::unique_lock<std::mutex> lock(s_launchMutex);
+    uint32_t tileW = s_tileW, tileH = s_tileH;
+    for (const char* options : BUILD_OPTIONS)
+    {
+        cl::Program program;
+        if (!build_program(device, options, program))
+            continue;
+        trace_kernels kernels(program);
+        size_t maxTile = max_tile_size(program, device);
+        for (const auto& shape : TILE_SHAPES)
         {
-            newSize /= f;
-            if (newSize <= s_workGroupSize) break;
+            if (!tile_fits(shape.first, shape.second, maxTile, maxItems))
+                continue;
+            s_tileW = shape.first;
+            s_tileH = shape.second;
+            update_work_group_size();
+            trace_views(kernels, views, lods, WIN_W, WIN_H, nullptr); // Warm up.
+            std::vector<double> times;
+            for (size_t i = 0; i < RUNS; i++)
+                times.push_back(trace_views(kernels, views, lods, WIN_W, WIN_H, nullptr).front().traceMs);
+            std::sort(times.begin(), times.end());
+            results.push_back({ shape.first, shape.second, options, times[RUNS / 2] });
         }
-        s_workGroupSize = newSize;
     }
+    std::sort(results.begin(), results.end(), [](const tuning_result& a, const tuning_result& b) {
+        return a.traceMs < b.traceMs;
+    });
+    if (results.empty() || !use_build_options(results.front().buildOptions))
+    {
+        s_tileW = tileW;
+        s_tileH = tileH;
+        update_work_group_size();
+        lock.unlock();
+        resume_render_loop();
+        throw "No launch configuration could be traced on the device.";
+    }
+    const tuning_result& best = results.front();
+    s_tileW = best.tileWidth;
+    s_tileH = best.tileHeight;
+    update_work_group_size();
+    s_tunedClass = scene_class();
+    lock.unlock();
+    resume_render_loop();
+    tune_cache::store(tuning_key(s_tunedClass), { best.tileWidth, best.tileHeight, best.buildOptions });
+    return results;
 }
 
 void viewer::pause_render_loop()
 {
+    tracer::instant("pause_render_loop", "sync");
     std::lock_guard<std::mutex> lock(s_mutex);
     s_pauseRender = true;
 }
 
 void viewer::resume_render_loop()
 {
+    tracer::instant("resume_render_loop", "sync");
     std::lock_guard<std::mutex> lock(s_mutex);
     s_pauseRender = false;
     s_cv.notify_one();
 }
 
+/*Writes the data to the buffer and returns the device time spent on the transfer in milliseconds.*/
 template <typename T>
-void write_buf(cl::Buffer& buffer, T* data, size_t size)
+double write_buf(const char* name, cl::Buffer& buffer, T* data, size_t size)
 {
     size_t nBytes = size * sizeof(T);
     if (nBytes > s_maxBufSize)
@@ -722,23 +1752,33 @@ void write_buf(cl::Buffer& buffer, T* data, size_t size)
         std::cerr << "Device buffer overflow... terminating application" << std::endl;
         exit(1);
     }
-    if (nBytes == 0) return;
+    if (nBytes == 0) return 0.0;
 
-    s_queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, size * sizeof(T), data);
+    cl::Event event;
+    double queued = tracer::now_us();
+    s_queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, size * sizeof(T), data, nullptr, &event);
+    return record_device_event(name, event, queued);
 };
 
-void viewer::add_render_data(uint8_t* bytes, size_t nBytes, uint8_t* types, uint32_t* offsets, size_t nEntities, op_step* steps, size_t nSteps)
+void viewer::add_render_data(uint8_t* bytes, size_t nBytes, uint8_t* types, uint32_t* offsets, size_t nEntities,
+    op_step* steps, size_t nSteps, uint8_t* scene, size_t nSceneBytes, size_t maxObjectEntities)
 {
     try
     {
+        tracer::scope uploadScope("add_render_data", "upload");
         pause_render_loop();
-        write_buf(s_packedBuf, bytes, nBytes);
-        write_buf(s_typeBuf, types, nEntities);
-        write_buf(s_offsetBuf, offsets, nEntities);
-        write_buf(s_opStepBuf, steps, nSteps);
-        s_numCurrentEntities = nEntities;
-        s_opStepCount = nSteps;
+        double uploadTime =
+            write_buf("write packed", s_packedBuf, bytes, nBytes) +
+            write_buf("write types", s_typeBuf, types, nEntities) +
+            write_buf("write offsets", s_offsetBuf, offsets, nEntities) +
+            write_buf("write steps", s_opStepBuf, steps, nSteps) +
+            write_buf("write scene", s_sceneBuf, scene, nSceneBytes);
+        perf::record("device.upload", uploadTime);
+        // The objects are evaluated one at a time, so the local buffers only need to fit the largest.
+        s_numCurrentEntities = maxObjectEntities;
         set_work_group_size();
+        // The depths of the previous frame belong to the old scene.
+        s_hasPrevFrame = false;
 
         // Resume the render loop.
         resume_render_loop();
@@ -746,30 +1786,342 @@ void viewer::add_render_data(uint8_t* bytes, size_t nBytes, uint8_t* types, uint
     CATCH_EXIT_CL_ERR;
 }
 
-void viewer::show_entity(entities::ent_ref entity)
+static float half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h >> 15) << 31;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    float val;
+    if (exp == 0)
+        val = std::ldexp((float)mant, -24);
+    else if (exp == 31)
+        val = mant ? NAN : INFINITY;
+    else
+        val = std::ldexp((float)(mant | 0x400), (int)exp - 25);
+    uint32_t bits;
+    std::memcpy(&bits, &val, sizeof(bits));
+    bits |= sign;
+    std::memcpy(&val, &bits, sizeof(val));
+    return val;
+}
+
+/*Writes a box of samples into the atlas. The pitches are in samples. If the atlas holds floats and the
+samples are halves, they are converted one slice at a time. Otherwise they go straight from the source,
+which is usually the file mapping.*/
+static void write_voxels(const uint8_t* src, uint32_t srcBytes, uint32_t atlasBytes,
+    size_t rowPitch, size_t slicePitch, size_t x, size_t y, size_t z, size_t nx, size_t ny, size_t nz)
+{
+    cl::size_t<3> origin, region;
+    origin[0] = x; origin[1] = y; origin[2] = z;
+    region[0] = nx; region[1] = ny; region[2] = nz;
+    if (srcBytes == atlasBytes)
+    {
+        s_queue.enqueueWriteImage(s_voxelAtlas, CL_FALSE, origin, region,
+            rowPitch * srcBytes, slicePitch * srcBytes, src);
+        return;
+    }
+    std::vector<float> slice(nx * ny);
+    region[2] = 1;
+    for (size_t k = 0; k < nz; k++)
+    {
+        for (size_t j = 0; j < ny; j++)
+        {
+            const uint16_t* halves = (const uint16_t*)src + k * slicePitch + j * rowPitch;
+            std::transform(halves, halves + nx, slice.begin() + j * nx, half_to_float);
+        }
+        origin[2] = z + k;
+        s_queue.enqueueWriteImage(s_voxelAtlas, CL_TRUE, origin, region,
+            nx * sizeof(float), 0, slice.data());
+    }
+}
+
+/*Packs the voxel grids into one image, in rows along x, the rows stacked along y into layers, and the
+layers stacked along z, within the image limits of the device. Assigns the atlas origins of the grids
+and uploads their samples.*/
+static void upload_voxel_atlas(const std::vector<entities::voxelgrid*>& grids)
 {
+    tracer::scope atlasScope("upload_voxel_atlas", "upload");
+    cl::Device device = s_context.getInfo<CL_CONTEXT_DEVICES>().front();
+    const size_t maxSize[3] = { device.getInfo<CL_DEVICE_IMAGE3D_MAX_WIDTH>(),
+        device.getInfo<CL_DEVICE_IMAGE3D_MAX_HEIGHT>(), device.getInfo<CL_DEVICE_IMAGE3D_MAX_DEPTH>() };
+    // The deepest grids go first, so the layers waste less depth.
+    std::vector<entities::voxelgrid*> order(grids);
+    std::stable_sort(order.begin(), order.end(), [](const entities::voxelgrid* a, const entities::voxelgrid* b) {
+        return a->dims[2] != b->dims[2] ? a->dims[2] > b->dims[2] : a->dims[1] > b->dims[1];
+    });
+    size_t width = 1, height = 1, depth = 2;
+    size_t atX = 0, atY = 0, atZ = 0, rowHeight = 0, layerDepth = 0;
+    // The atlas only holds halves if all the grids are dense grids of halves.
+    bool halfAtlas = true;
+    for (entities::voxelgrid* grid : order)
+    {
+        size_t nx = grid->dims[0], ny = grid->dims[1], nz = grid->dims[2];
+        if (atX + nx > maxSize[0])
+        {
+            atX = 0;
+            atY += rowHeight;
+            rowHeight = 0;
+        }
+        if (atY + ny > maxSize[1])
+        {
+            atX = atY = rowHeight = 0;
+            atZ += layerDepth;
+            layerDepth = 0;
+        }
+        if (nx > maxSize[0] || ny > maxSize[1] || atZ + nz > maxSize[2])
+            throw "The voxel grids are too large for a 3d image on this device";
+        grid->atlas_origin[0] = (uint32_t)atX;
+        grid->atlas_origin[1] = (uint32_t)atY;
+        grid->atlas_origin[2] = (uint32_t)atZ;
+        width = std::max(width, atX + nx);
+        height = std::max(height, atY + ny);
+        depth = std::max(depth, atZ + nz);
+        atX += nx;
+        rowHeight = std::max(rowHeight, ny);
+        layerDepth = std::max(layerDepth, nz);
+        halfAtlas = halfAtlas && grid->brick_size == 0 && grid->value_bytes == sizeof(uint16_t);
+    }
+
+    uint32_t atlasBytes = halfAtlas ? sizeof(uint16_t) : sizeof(float);
+    s_voxelAtlas = cl::Image3D(s_context, CL_MEM_READ_ONLY,
+        cl::ImageFormat(CL_R, halfAtlas ? CL_HALF_FLOAT : CL_FLOAT), width, height, depth);
+    for (const entities::voxelgrid* grid : grids)
+    {
+        size_t nx = grid->dims[0], ny = grid->dims[1], nz = grid->dims[2];
+        if (grid->brick_size == 0)
+        {
+            write_voxels(grid->values, grid->value_bytes, atlasBytes, nx, nx * ny,
+                grid->atlas_origin[0], grid->atlas_origin[1], grid->atlas_origin[2], nx, ny, nz);
+            continue;
+        }
+        // Fill with the background one slice at a time, then write the bricks over it.
+        std::vector<float> background(nx * ny, grid->background);
+        for (size_t k = 0; k < nz; k++)
+        {
+            write_voxels((const uint8_t*)background.data(), sizeof(float), atlasBytes, nx, nx * ny,
+                grid->atlas_origin[0], grid->atlas_origin[1], grid->atlas_origin[2] + k, nx, ny, 1);
+        }
+        s_queue.finish(); // The background slice must outlive the writes.
+        size_t bs = grid->brick_size;
+        size_t brickBytes = bs * bs * bs * grid->value_bytes;
+        for (uint32_t bi = 0; bi < grid->brick_count; bi++)
+        {
+            const uint32_t* coord = grid->brick_coords + 3 * bi;
+            size_t x = coord[0] * bs, y = coord[1] * bs, z = coord[2] * bs;
+            // Bricks on the far faces are clipped to the grid.
+            write_voxels(grid->values + bi * brickBytes, grid->value_bytes, atlasBytes, bs, bs * bs,
+                grid->atlas_origin[0] + x, grid->atlas_origin[1] + y, grid->atlas_origin[2] + z,
+                std::min(bs, nx - x), std::min(bs, ny - y), std::min(bs, nz - z));
+        }
+    }
+    s_queue.finish();
+}
+
+/*Linearizes the entity of a scene object into its own render data.*/
+static void linearize(scene_entry& entry)
+{
+    perf::scoped_timer copyTimer("host.copy_render_data");
+    tracer::scope copyScope("copy_render_data", "linearize");
+
+    // The render data of a compiled scene is copied straight from the file mapping.
+    auto compiled = std::dynamic_pointer_cast<entities::compiled_entity>(entry.entity);
+    if (compiled)
+    {
+        const entities::scene_header& header = compiled->header;
+        entry.bytes.assign(compiled->bytes, compiled->bytes + header.num_bytes);
+        entry.types.assign(compiled->types, compiled->types + header.num_entities);
+        entry.offsets.assign(compiled->offsets, compiled->offsets + header.num_entities);
+        entry.steps.assign(compiled->steps, compiled->steps + header.num_steps);
+        return;
+    }
+
     size_t nBytes = 0, nEntities = 0, nSteps = 0;
-    entity->render_data_size(nBytes, nEntities, nSteps);
-    std::vector<uint8_t> bytes(nBytes);
-    std::vector<uint32_t> offsets(nEntities);
-    std::vector<uint8_t> types(nEntities);
-    std::vector<op_step> steps(nSteps);
+    entry.entity->render_data_size(nBytes, nEntities, nSteps);
+    entry.bytes.resize(nBytes);
+    entry.offsets.resize(nEntities);
+    entry.types.resize(nEntities);
+    entry.steps.resize(nSteps);
+    uint8_t* bptr = entry.bytes.data();
+    uint32_t* optr = entry.offsets.data();
+    uint8_t* tptr = entry.types.data();
+    op_step* sptr = entry.steps.data();
+    entry.entity->copy_render_data(bptr, optr, tptr, sptr);
+    // The sizes computed above are upper bounds, the actual counts depend on how the operands are shared.
+    entry.bytes.resize(bptr - entry.bytes.data());
+    entry.offsets.resize(optr - entry.offsets.data());
+    entry.types.resize(tptr - entry.types.data());
+    entry.steps.resize(sptr - entry.steps.data());
+}
 
-    // Copy the render data into these buffers.
+/*Uploads the voxel atlas if the set of grids in the scene changed. The objects with grids are linearized
+again in that case, because their render data holds offsets into the atlas. Voxel grids must be uploaded
+before their render data is written.*/
+static void update_voxel_atlas()
+{
+    std::vector<entities::voxelgrid*> grids;
+    for (scene_entry& entry : s_scene)
     {
-        uint8_t* bptr = bytes.data();
-        uint32_t* optr = offsets.data();
-        uint8_t* tptr = types.data();
-        op_step* sptr = steps.data();
-        entity->copy_render_data(bptr, optr, tptr, sptr);
+        std::vector<entities::entity*> simpleEnts;
+        entry.entity->collect_simple(simpleEnts);
+        entry.hasGrids = false;
+        for (entities::entity* ent : simpleEnts)
+        {
+            if (ent->type() != ENT_TYPE_VOXELGRID)
+                continue;
+            entry.hasGrids = true;
+            if (std::find(grids.begin(), grids.end(), ent) == grids.end())
+                grids.push_back((entities::voxelgrid*)ent);
+        }
     }
+    if (grids.empty() || grids == s_atlasGrids)
+        return;
 
-    viewer::add_render_data(bytes.data(), nBytes, types.data(), offsets.data(), nEntities, steps.data(), nSteps);
+    viewer::pause_render_loop();
+    try
+    {
+        upload_voxel_atlas(grids);
+    }
+    catch (const char*)
+    {
+        viewer::resume_render_loop();
+        throw;
+    }
+    CATCH_EXIT_CL_ERR;
+    s_atlasGrids = grids;
+    for (scene_entry& entry : s_scene)
+    {
+        if (entry.hasGrids)
+            linearize(entry);
+    }
+}
+
+/*Builds the top level bvh over the bounded objects, concatenates the render data of all the objects
+and uploads it.*/
+static void upload_scene()
+{
+    tracer::scope uploadScope("upload_scene", "linearize");
+    std::vector<const scene_entry*> bounded, unbounded;
+    std::vector<glm::vec3> mins, maxs;
+    for (const scene_entry& entry : s_scene)
+    {
+        if (!entry.bounded)
+        {
+            unbounded.push_back(&entry);
+            continue;
+        }
+        bounded.push_back(&entry);
+        mins.push_back(entry.min);
+        maxs.push_back(entry.max);
+    }
+    // One object per leaf, so the box of every object is tested on its own.
+    std::vector<uint32_t> order;
+    std::vector<bvh_node> nodes = entities::build_bvh(mins, maxs, order, 1);
+    std::vector<const scene_entry*> entries;
+    for (uint32_t i : order)
+        entries.push_back(bounded[i]);
+    entries.insert(entries.end(), unbounded.begin(), unbounded.end());
+
+    std::vector<uint8_t> bytes, types;
+    std::vector<uint32_t> offsets;
+    std::vector<op_step> steps;
+    std::vector<scene_object> objects;
+    size_t maxEntities = 0;
+    for (const scene_entry* entry : entries)
+    {
+        uint32_t base = (uint32_t)bytes.size();
+        objects.push_back({ (uint32_t)types.size(), (uint32_t)entry->types.size(),
+            (uint32_t)steps.size(), (uint32_t)entry->steps.size() });
+        bytes.insert(bytes.end(), entry->bytes.begin(), entry->bytes.end());
+        types.insert(types.end(), entry->types.begin(), entry->types.end());
+        for (uint32_t offset : entry->offsets)
+            offsets.push_back(base + offset);
+        steps.insert(steps.end(), entry->steps.begin(), entry->steps.end());
+        maxEntities = std::max(maxEntities, entry->types.size());
+    }
+
+    i_scene header = { (uint32_t)objects.size(), (uint32_t)bounded.size(), (uint32_t)nodes.size() };
+    std::vector<uint8_t> scene(sizeof(header) + sizeof(bvh_node) * nodes.size() +
+        sizeof(scene_object) * objects.size());
+    uint8_t* ptr = scene.data();
+    std::memcpy(ptr, &header, sizeof(header));
+    ptr += sizeof(header);
+    std::memcpy(ptr, nodes.data(), sizeof(bvh_node) * nodes.size());
+    ptr += sizeof(bvh_node) * nodes.size();
+    std::memcpy(ptr, objects.data(), sizeof(scene_object) * objects.size());
+
+    viewer::add_render_data(bytes.data(), bytes.size(), types.data(), offsets.data(), types.size(),
+        steps.data(), steps.size(), scene.data(), scene.size(), maxEntities);
+}
+
+static std::vector<scene_entry>::iterator find_object(uint32_t id)
+{
+    return std::find_if(s_scene.begin(), s_scene.end(), [id](const scene_entry& e) { return e.id == id; });
+}
+
+/*Adds the object, or replaces the object with the same id, and uploads the scene. If the entity cannot be
+linearized the scene is left as it was.*/
+static void set_object(uint32_t id, entities::ent_ref entity)
+{
+    scene_entry entry;
+    entry.id = id;
+    entry.entity = entity;
+    entry.bounded = entity->bounds(entry.min, entry.max);
+    auto match = find_object(id);
+    if (match == s_scene.end())
+    {
+        s_scene.push_back(std::move(entry));
+        match = std::prev(s_scene.end());
+    }
+    else
+    {
+        std::swap(*match, entry); // The entry now holds the replaced object.
+    }
+    size_t index = match - s_scene.begin();
+    try
+    {
+        update_voxel_atlas();
+        if (s_scene[index].types.empty())
+            linearize(s_scene[index]);
+    }
+    catch (const char*)
+    {
+        if (entry.entity)
+            s_scene[index] = std::move(entry);
+        else
+            s_scene.erase(s_scene.begin() + index);
+        throw;
+    }
+    upload_scene();
+}
+
+void viewer::show_entity(entities::ent_ref entity)
+{
+    perf::scoped_timer timer("host.show_entity");
+    tracer::scope showScope("show_entity", "linearize");
+    set_object(SHOWN_OBJECT_ID, entity);
+}
+
+uint32_t viewer::scene_add(entities::ent_ref entity)
+{
+    perf::scoped_timer timer("host.scene_add");
+    tracer::scope addScope("scene_add", "linearize");
+    uint32_t id = s_nextObjectId++;
+    set_object(id, entity);
+    return id;
+}
+
+bool viewer::scene_remove(uint32_t id)
+{
+    auto match = find_object(id);
+    if (match == s_scene.end())
+        return false;
+    s_scene.erase(match);
+    upload_scene();
+    return true;
 }
 
-bool check_format(const std::string& path, const std::string& ext)
+void viewer::scene_clear()
 {
-    std::string pathLower(path);
-    boost::to_lower(pathLower);
-    return pathLower.size() >= ext.size() && pathLower.compare(path.size() - ext.size(), ext.size(), ext) == 0;
+    s_scene.clear();
+    upload_scene();
 }
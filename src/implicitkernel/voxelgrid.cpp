@@ -0,0 +1,91 @@
+#include <implicitkernel/host_primitives.h>
+
+std::shared_ptr<entities::voxelgrid>
+entities::voxelgrid::load_raw(const std::string &path,
+                              const uint32_t (&dims)[3], glm::vec3 origin,
+                              float spacing) {
+  if (dims[0] == 0 || dims[1] == 0 || dims[2] == 0)
+    throw "The voxel grid must have at least one sample along each axis.";
+  if (spacing <= 0.0f)
+    throw "The spacing of the voxel grid must be positive.";
+  auto grid = std::make_shared<voxelgrid>();
+  grid->m_file = std::make_shared<util::mapped_file>(path);
+  size_t nSamples = (size_t)dims[0] * dims[1] * dims[2];
+  if (grid->m_file->size() == nSamples * sizeof(float))
+    grid->value_bytes = sizeof(float);
+  else if (grid->m_file->size() == nSamples * sizeof(uint16_t))
+    grid->value_bytes = sizeof(uint16_t);
+  else
+    throw "The size of the file does not match the dimensions of the grid.";
+  grid->origin = origin;
+  grid->spacing = spacing;
+  std::copy(dims, dims + 3, grid->dims);
+  grid->values = grid->m_file->data();
+  return grid;
+}
+
+std::shared_ptr<entities::voxelgrid>
+entities::voxelgrid::load_bricks(const std::string &path) {
+  auto grid = std::make_shared<voxelgrid>();
+  grid->m_file = std::make_shared<util::mapped_file>(path);
+  const uint8_t *data = grid->m_file->data();
+  size_t size = grid->m_file->size();
+  voxel_brick_header header;
+  if (size < sizeof(header))
+    throw "The file is too small to be a voxel brick file.";
+  std::memcpy(&header, data, sizeof(header));
+  if (std::memcmp(header.magic, "IVBK", 4) != 0 || header.version != 1)
+    throw "Not a voxel brick file, or an unsupported version.";
+  if (header.value_bytes != sizeof(float) &&
+      header.value_bytes != sizeof(uint16_t))
+    throw "Voxel bricks must have float or half samples.";
+  if (header.brick_size == 0 || header.dims[0] == 0 || header.dims[1] == 0 ||
+      header.dims[2] == 0 || header.spacing <= 0.0f)
+    throw "The voxel brick file has an invalid header.";
+  size_t brickBytes = (size_t)header.brick_size * header.brick_size *
+                      header.brick_size * header.value_bytes;
+  size_t coordBytes = sizeof(uint32_t) * 3 * header.brick_count;
+  if (size != sizeof(header) + coordBytes + brickBytes * header.brick_count)
+    throw "The size of the voxel brick file does not match its header.";
+
+  grid->origin = {header.origin[0], header.origin[1], header.origin[2]};
+  grid->spacing = header.spacing;
+  std::copy(header.dims, header.dims + 3, grid->dims);
+  grid->value_bytes = header.value_bytes;
+  grid->brick_size = header.brick_size;
+  grid->brick_count = header.brick_count;
+  grid->background = header.background;
+  grid->brick_coords = (const uint32_t *)(data + sizeof(header));
+  grid->values = data + sizeof(header) + coordBytes;
+  for (uint32_t bi = 0; bi < grid->brick_count; bi++) {
+    for (int a = 0; a < 3; a++) {
+      if ((size_t)grid->brick_coords[3 * bi + a] * grid->brick_size >=
+          grid->dims[a])
+        throw "A voxel brick lies outside the grid.";
+    }
+  }
+  return grid;
+}
+
+uint8_t entities::voxelgrid::type() const { return ENT_TYPE_VOXELGRID; }
+
+bool entities::voxelgrid::bounds(glm::vec3 &min, glm::vec3 &max) const {
+  min = origin;
+  max = origin + glm::vec3((float)(dims[0] - 1), (float)(dims[1] - 1),
+                           (float)(dims[2] - 1)) *
+                     spacing;
+  return true;
+}
+
+size_t entities::voxelgrid::num_render_bytes() const {
+  return sizeof(i_voxelgrid);
+}
+
+void entities::voxelgrid::write_render_bytes(uint8_t *&bytes) const {
+  i_voxelgrid ient = {{origin.x, origin.y, origin.z},
+                      spacing,
+                      {dims[0], dims[1], dims[2]},
+                      {atlas_origin[0], atlas_origin[1], atlas_origin[2]}};
+  std::memcpy(bytes, &ient, sizeof(ient));
+  bytes += sizeof(ient);
+}
@@ -1,6 +1,9 @@
 #include <fstream>
+#include <glm/gtc/matrix_transform.hpp>
 #include <implicitlua/luabindings.h>
 #include <implicitlua/map_macro.h>
+#include <implicitkernel/perf.h>
+#include <implicitkernel/tune_cache.h>
 #define LUA_REG_FUNC(lstate, name) lua_register(lstate, #name, name)
 
 // Function name macro for logging purposes.
@@ -13,6 +16,9 @@
 #endif
 
 bool s_shouldExit = false;
+static bool s_autoShow = true; // Show every entity returned to lua.
+static int s_batchDepth = 0;
+static entities::ent_ref s_pendingShow; // The entity to be shown at the end of the current batch.
 
 template <>
 float implicit_lua::read_lua<float>(lua_State* L, int i)
@@ -47,6 +53,14 @@ std::string implicit_lua::read_lua<std::string>(lua_State* L, int i)
     return ret;
 }
 
+template <>
+implicit_lua::lua_function implicit_lua::read_lua<implicit_lua::lua_function>(lua_State* L, int i)
+{
+    if (!lua_isfunction(L, i))
+        luathrow(L, "Not a function...");
+    return { i };
+}
+
 template <>
 entities::ent_ref implicit_lua::read_lua<entities::ent_ref>(lua_State* L, int i)
 {
@@ -57,6 +71,47 @@ entities::ent_ref implicit_lua::read_lua<entities::ent_ref>(lua_State* L, int i)
     return ref;
 }
 
+template <>
+std::vector<entities::ent_ref> implicit_lua::read_lua<std::vector<entities::ent_ref>>(lua_State* L, int i)
+{
+    using namespace entities;
+    if (!lua_istable(L, i))
+        luathrow(L, "Not a table of entities...");
+    size_t n = lua_rawlen(L, i);
+    std::vector<ent_ref> ents;
+    ents.reserve(n);
+    for (size_t j = 1; j <= n; j++)
+    {
+        lua_rawgeti(L, i, (int)j);
+        ents.push_back(read_lua<ent_ref>(L, -1));
+        lua_pop(L, 1);
+    }
+    return ents;
+}
+
+template <>
+std::vector<float> implicit_lua::read_lua<std::vector<float>>(lua_State* L, int i)
+{
+    if (!lua_istable(L, i))
+        luathrow(L, "Not a table of numbers...");
+    size_t n = lua_rawlen(L, i);
+    std::vector<float> vals;
+    vals.reserve(n);
+    for (size_t j = 1; j <= n; j++)
+    {
+        lua_rawgeti(L, i, (int)j);
+        vals.push_back(read_lua<float>(L, -1));
+        lua_pop(L, 1);
+    }
+    return vals;
+}
+
+template <>
+void implicit_lua::push_lua<int>(lua_State* L, const int& val)
+{
+    lua_pushinteger(L, val);
+}
+
 template <>
 void implicit_lua::push_lua<entities::ent_ref>(lua_State* L, const entities::ent_ref& ref)
 {
@@ -69,7 +124,33 @@ void implicit_lua::push_lua<entities::ent_ref>(lua_State* L, const entities::ent
     lua_pushcfunction(L, delete_entity);;
     lua_settable(L, -3);
     lua_setmetatable(L, -2);
-    viewer::show_entity(ref);
+    if (s_autoShow)
+        request_show(ref);
+}
+
+void implicit_lua::request_show(const entities::ent_ref& ref)
+{
+    if (s_batchDepth > 0)
+        s_pendingShow = ref;
+    else
+        viewer::show_entity(ref);
+}
+
+void implicit_lua::begin_batch()
+{
+    s_batchDepth++;
+}
+
+void implicit_lua::end_batch()
+{
+    if (s_batchDepth == 0 || --s_batchDepth > 0)
+        return;
+    if (s_pendingShow)
+    {
+        entities::ent_ref ref = s_pendingShow;
+        s_pendingShow.reset();
+        viewer::show_entity(ref);
+    }
 }
 
 void implicit_lua::init_lua()
@@ -102,7 +183,9 @@ int implicit_lua::delete_entity(lua_State* L)
 void implicit_lua::run_cmd(const std::string& line)
 {
     lua_State* L = state();
+    double start = tracer::now_us();
     int ret = luaL_dostring(L, line.c_str());
+    tracer::complete("run_cmd", "lua", start, tracer::now_us() - start, line);
     if (ret != LUA_OK)
     {
         std::cerr << "Lua Error: " << lua_tostring(L, -1) << std::endl;
@@ -195,7 +278,49 @@ LUA_FUNC(void, quit, false, "Aborts the application.")
 LUA_FUNC(void, show, true, "Shows the given entity in the viewer",
     (ent_ref, ent, "The entity to be displayed"))
 {
-    viewer::show_entity(ent);
+    request_show(ent);
+}
+
+LUA_FUNC(int, scene_add, true, "Adds the entity to the scene as a separate object and returns its id. Rays only evaluate the objects whose bounds they cross",
+    (ent_ref, ent, "The entity to be added"))
+{
+    return (int)viewer::scene_add(ent);
+}
+
+LUA_FUNC(void, scene_remove, true, "Removes an object from the scene",
+    (int, id, "The id returned by scene_add"))
+{
+    if (id < 0 || !viewer::scene_remove((uint32_t)id))
+        throw "There is no object with that id.";
+}
+
+LUA_FUNC(void, scene_clear, false, "Removes all the objects from the scene, including the shown entity")
+{
+    viewer::scene_clear();
+}
+
+LUA_FUNC(void, autoshow, true, "Sets whether every entity created is shown in the viewer. When disabled, use 'show'",
+    (int, flag, "The flag to be set, either 0 or 1"))
+{
+    if (flag != 0 && flag != 1)
+        throw "Argument must be either 0 or 1.";
+    s_autoShow = flag == 1;
+}
+
+LUA_FUNC(void, batch, true, "Runs the given function and uploads only the last entity it shows, once, at the end",
+    (lua_function, func, "The function to be run"))
+{
+    lua_State* L = state();
+    begin_batch();
+    lua_pushvalue(L, func.index);
+    int ret = lua_pcall(L, 0, 0, 0);
+    end_batch();
+    if (ret != LUA_OK)
+    {
+        std::cerr << "Lua Error: " << lua_tostring(L, -1) << std::endl;
+        lua_pop(L, 1);
+        throw "The batch function failed.";
+    }
 }
 
 LUA_FUNC(ent_ref, box, true, "Creates and returns a box entity",
@@ -277,6 +402,94 @@ LUA_FUNC(ent_ref, schwarz, true, "Creates a schwarz lattice",
     return entities::entity::wrap_simple(entities::schwarz(scale, thickness));
 }
 
+LUA_FUNC(ent_ref, beam_lattice, true, "Creates a lattice of cylindrical struts with rounded ends",
+    (std::vector<float>, nodes, "Flat table of node coordinates: {x1, y1, z1, x2, y2, z2, ...}"),
+    (std::vector<float>, edges, "Flat table of 1-based node indices, two per strut: {a1, b1, a2, b2, ...}"),
+    (float, radius, "The radius of the struts"))
+{
+    if (nodes.size() % 3)
+        throw "The number of node coordinates must be a multiple of 3";
+    std::vector<glm::vec3> points(nodes.size() / 3);
+    for (size_t i = 0; i < points.size(); i++)
+        points[i] = glm::vec3(nodes[3 * i], nodes[3 * i + 1], nodes[3 * i + 2]);
+    std::vector<uint32_t> indices(edges.size());
+    for (size_t i = 0; i < edges.size(); i++)
+    {
+        if (edges[i] < 1.0f)
+            throw "Node indices must start at 1";
+        indices[i] = (uint32_t)edges[i] - 1;
+    }
+    return std::make_shared<entities::beam_lattice>(points, indices, radius);
+}
+
+LUA_FUNC(ent_ref, convex, true, "Creates the convex hull of the given points",
+    (std::vector<float>, points, "Flat table of point coordinates: {x1, y1, z1, x2, y2, z2, ...}"))
+{
+    if (points.size() % 3)
+        throw "The number of point coordinates must be a multiple of 3";
+    std::vector<glm::vec3> pts(points.size() / 3);
+    for (size_t i = 0; i < pts.size(); i++)
+        pts[i] = glm::vec3(points[3 * i], points[3 * i + 1], points[3 * i + 2]);
+    return entities::polytope::hull(pts);
+}
+
+LUA_FUNC(ent_ref, polytope, true, "Creates a convex polytope bounded by the given planes",
+    (std::vector<float>, planes, "Flat table of 4 numbers per plane, the outward normal and the offset along it: {nx1, ny1, nz1, d1, ...}"))
+{
+    if (planes.size() % 4)
+        throw "The number of plane values must be a multiple of 4";
+    std::vector<glm::vec4> list(planes.size() / 4);
+    for (size_t i = 0; i < list.size(); i++)
+        list[i] = glm::vec4(planes[4 * i], planes[4 * i + 1], planes[4 * i + 2], planes[4 * i + 3]);
+    return std::make_shared<entities::polytope>(list);
+}
+
+LUA_FUNC(ent_ref, mesh, true, "Loads a closed triangle mesh from a binary or ascii STL, or an OBJ file",
+    (std::string, path, "The path of the mesh file"))
+{
+    return entities::mesh::load(path);
+}
+
+LUA_FUNC(ent_ref, mesh_grid, true, "Loads a closed triangle mesh and samples its distance field on a grid, which is faster to render",
+    (std::string, path, "The path of the mesh file"),
+    (int, resolution, "The number of grid cells along the longest side of the mesh"))
+{
+    if (resolution < 1)
+        throw "The resolution must be at least 1";
+    return entities::distance_grid::bake(*entities::mesh::load(path), (uint32_t)resolution);
+}
+
+LUA_FUNC(ent_ref, voxelgrid, true, "Memory maps a dense grid of float or half signed distance samples, x varying fastest",
+    (std::string, path, "The path of the raw file"),
+    (std::vector<float>, dims, "The number of samples along each axis: {nx, ny, nz}"),
+    (std::vector<float>, origin, "The position of the first sample: {x, y, z}"),
+    (float, spacing, "The distance between neighbouring samples"))
+{
+    if (dims.size() != 3 || origin.size() != 3)
+        throw "The dimensions and the origin must have 3 values each";
+    uint32_t counts[3] = { (uint32_t)dims[0], (uint32_t)dims[1], (uint32_t)dims[2] };
+    return entities::voxelgrid::load_raw(path, counts, glm::vec3(origin[0], origin[1], origin[2]), spacing);
+}
+
+LUA_FUNC(ent_ref, voxelbricks, true, "Memory maps a sparse voxel brick file of signed distance samples",
+    (std::string, path, "The path of the brick file"))
+{
+    return entities::voxelgrid::load_bricks(path);
+}
+
+LUA_FUNC(void, save_scene, true, "Writes the render data of the entity to a compiled scene file, which loads much faster than the script",
+    (ent_ref, ent, "The entity"),
+    (std::string, path, "The path of the scene file"))
+{
+    entities::compiled_entity::save(ent, path);
+}
+
+LUA_FUNC(ent_ref, load_scene, true, "Memory maps a compiled scene file written by save_scene",
+    (std::string, path, "The path of the scene file"))
+{
+    return entities::compiled_entity::load(path);
+}
+
 LUA_FUNC(ent_ref, bunion, true, "Creates a boolean union of the given entities",
     (ent_ref, first, "First entity"),
     (ent_ref, second, "Second entity"))
@@ -307,6 +520,24 @@ LUA_FUNC(ent_ref, bsubtract, true, "Creates a boolean difference of the given en
     return comp_entity::make_csg(first, second, op);
 }
 
+LUA_FUNC(ent_ref, union_all, true, "Creates a boolean union of all the entities in the given table",
+    (std::vector<ent_ref>, ents, "Table of entities"))
+{
+    op_defn op;
+    op.data.blend_radius = 0.0f;
+    op.type = op_type::OP_UNION;
+    return comp_entity::make_nary(ents, op);
+}
+
+LUA_FUNC(ent_ref, intersect_all, true, "Creates a boolean intersection of all the entities in the given table",
+    (std::vector<ent_ref>, ents, "Table of entities"))
+{
+    op_defn op;
+    op.data.blend_radius = 0.0f;
+    op.type = op_type::OP_INTERSECTION;
+    return comp_entity::make_nary(ents, op);
+}
+
 LUA_FUNC(ent_ref, offset, true, "Creates an entity that is offset from the given entity",
     (ent_ref, ent, "Entity to be offset"),
     (float, dist, "Offset distance"))
@@ -340,6 +571,89 @@ LUA_FUNC(ent_ref, smoothblend, true, "Creates a smooth blend by interpolating (w
     return comp_entity::make_smoothblend(first, second, { xfirst, yfirst, zfirst }, { xsecond, ysecond, zsecond });
 }
 
+LUA_FUNC(ent_ref, translate, true, "Moves the entity by the given vector",
+    (ent_ref, ent, "The entity"),
+    (float, x, "The x coordinate of the vector"),
+    (float, y, "The y coordinate of the vector"),
+    (float, z, "The z coordinate of the vector"))
+{
+    return comp_entity::make_transform(ent, glm::translate(glm::mat4(1.0f), { x, y, z }));
+}
+
+LUA_FUNC(ent_ref, rotate, true, "Rotates the entity about an axis through the origin",
+    (ent_ref, ent, "The entity"),
+    (float, xaxis, "The x coordinate of the axis"),
+    (float, yaxis, "The y coordinate of the axis"),
+    (float, zaxis, "The z coordinate of the axis"),
+    (float, angle, "The angle in degrees, counter-clockwise when looking down the axis"))
+{
+    glm::vec3 axis(xaxis, yaxis, zaxis);
+    if (glm::length(axis) == 0.0f)
+        throw "The axis of rotation cannot be zero";
+    return comp_entity::make_transform(ent, glm::rotate(glm::mat4(1.0f), glm::radians(angle), axis));
+}
+
+LUA_FUNC(ent_ref, scale, true, "Scales the entity uniformly about the origin",
+    (ent_ref, ent, "The entity"),
+    (float, factor, "The scale factor"))
+{
+    return comp_entity::make_transform(ent, glm::scale(glm::mat4(1.0f), { factor, factor, factor }));
+}
+
+LUA_FUNC(ent_ref, transform, true, "Applies an affine transform to the entity. Non-uniform scaling gives approximate distances, which slows down the rendering",
+    (ent_ref, ent, "The entity"),
+    (std::vector<float>, matrix, "The 4x4 matrix as a table of 16 numbers, row by row. The last row must be {0, 0, 0, 1}"))
+{
+    if (matrix.size() != 16)
+        throw "The matrix must have 16 values";
+    glm::mat4 xform;
+    for (int r = 0; r < 4; r++)
+    {
+        for (int c = 0; c < 4; c++)
+            xform[c][r] = matrix[r * 4 + c];
+    }
+    return comp_entity::make_transform(ent, xform);
+}
+
+LUA_FUNC(ent_ref, pattern_linear, true, "Repeats the entity along a line. Only the nearest copies are evaluated, so the cost does not depend on the count. The entity should fit within one step",
+    (ent_ref, ent, "The entity"),
+    (float, dx, "The x coordinate of the step between copies"),
+    (float, dy, "The y coordinate of the step between copies"),
+    (float, dz, "The z coordinate of the step between copies"),
+    (int, count, "The number of copies"))
+{
+    if (count < 1)
+        throw "The number of copies must be at least one";
+    return comp_entity::make_linear_pattern(ent, { dx, dy, dz }, (uint32_t)count);
+}
+
+LUA_FUNC(ent_ref, pattern_grid, true, "Repeats the entity on an axis aligned grid. Only the nearest copies are evaluated. The entity should fit within one cell",
+    (ent_ref, ent, "The entity"),
+    (float, dx, "The spacing along x"),
+    (float, dy, "The spacing along y"),
+    (float, dz, "The spacing along z"),
+    (int, nx, "The number of copies along x"),
+    (int, ny, "The number of copies along y"),
+    (int, nz, "The number of copies along z"))
+{
+    if (nx < 1 || ny < 1 || nz < 1)
+        throw "The number of copies must be at least one";
+    uint32_t counts[3] = { (uint32_t)nx, (uint32_t)ny, (uint32_t)nz };
+    return comp_entity::make_grid_pattern(ent, { dx, dy, dz }, counts);
+}
+
+LUA_FUNC(ent_ref, pattern_polar, true, "Repeats the entity at equal angles around an axis through the origin. Only the nearest copies are evaluated. The entity should fit within the angle between copies",
+    (ent_ref, ent, "The entity"),
+    (float, xaxis, "The x coordinate of the axis"),
+    (float, yaxis, "The y coordinate of the axis"),
+    (float, zaxis, "The z coordinate of the axis"),
+    (int, count, "The number of copies"))
+{
+    if (count < 1)
+        throw "The number of copies must be at least one";
+    return comp_entity::make_polar_pattern(ent, { xaxis, yaxis, zaxis }, (uint32_t)count);
+}
+
 LUA_FUNC(void, load, true, "Runs a lua script into the current environment",
     (std::string, filepath, "The path to the script file"))
 {
@@ -357,7 +671,16 @@ LUA_FUNC(void, load, true, "Runs a lua script into the current environment",
     std::cout << std::endl << std::endl;
     f.close();
 
-    luaL_dofile(state(), filepath.c_str());
+    // Only the last entity of the script is uploaded to the viewer.
+    lua_State* L = state();
+    begin_batch();
+    int ret = luaL_dofile(L, filepath.c_str());
+    end_batch();
+    if (ret != LUA_OK)
+    {
+        std::cerr << "Lua Error: " << lua_tostring(L, -1) << std::endl;
+        lua_pop(L, 1);
+    }
 }
 
 #ifdef CLDEBUG
@@ -375,12 +698,154 @@ LUA_FUNC(void, viewer_debugstep, false, "Advances the viewer by one frame in the
 }
 #endif
 
-LUA_FUNC(void, exportframe, true, "Exports the current view as a BMP image",
-    (std::string, filepath, "Path of the BMP file to be written"))
+LUA_FUNC(void, exportframe, true,
+    "Exports the current view as an image. The format is BMP, PPM, PNG or PFM. The file is written in the background",
+    (std::string, filepath, "Path of the image file to be written"))
 {
     if (!viewer::exportframe(filepath))
         throw "Failed to export the frame.";
-    std::cout << "Frame was exported.\n";
+    std::cout << "Frame is being exported.\n";
+}
+
+LUA_FUNC(void, render_image, true,
+    "Renders the scene into an image of any size, seen from the given camera. The format is BMP, PPM, PNG or PFM",
+    (std::string, filepath, "Path of the image file to be written"),
+    (int, width, "Width of the image in pixels"),
+    (int, height, "Height of the image in pixels"),
+    (float, distance, "Distance of the camera from the target"),
+    (float, theta, "Polar angle of the camera around the z axis"),
+    (float, phi, "Elevation angle of the camera"),
+    (float, tx, "X coordinate of the target"),
+    (float, ty, "Y coordinate of the target"),
+    (float, tz, "Z coordinate of the target"))
+{
+    if (width <= 0 || height <= 0)
+        throw "The size of the image must be positive.";
+    viewer::viewer_data cam = viewer::current_view();
+    cam.camDistance = distance;
+    cam.camTheta = theta;
+    cam.camPhi = phi;
+    cam.camTarget = glm::vec3(tx, ty, tz);
+    viewer::render_image(filepath, (uint32_t)width, (uint32_t)height, cam);
+    std::cout << "Image was rendered.\n";
+}
+
+/*Shows the entity, and renders it from the cameras. Nothing else is printed when the frames go to the standard
+output, so they can be piped into a video encoder.*/
+static void render_entity_path(const entities::ent_ref& ent, const std::string& filepath, int width, int height,
+    const std::vector<viewer::viewer_data>& cameras)
+{
+    if (width <= 0 || height <= 0)
+        throw "The size of the image must be positive.";
+    viewer::show_entity(ent);
+    viewer::render_path(filepath, (uint32_t)width, (uint32_t)height, cameras);
+    if (filepath != "-")
+        std::cout << "Path was rendered.\n";
+}
+
+LUA_FUNC(void, render_path, true,
+    "Shows the entity and renders it from each of the cameras. The frames are image files, or a Y4M video",
+    (ent_ref, ent, "The entity to be rendered"),
+    (std::vector<float>, cameras, "Flat table of 6 numbers per frame, the distance, theta and phi of the camera and its target: {d1, theta1, phi1, tx1, ty1, tz1, ...}"),
+    (std::string, filepath, "Path of the frames with a %d for the frame number, like out_%05d.png. A .y4m file, or - for the standard output, writes a Y4M video"),
+    (int, width, "Width of the frames in pixels"),
+    (int, height, "Height of the frames in pixels"))
+{
+    if (cameras.empty() || cameras.size() % 6)
+        throw "Each camera must have 6 numbers.";
+    viewer::viewer_data view = viewer::current_view();
+    std::vector<viewer::viewer_data> list(cameras.size() / 6, view);
+    for (size_t i = 0; i < list.size(); i++)
+    {
+        const float* c = cameras.data() + 6 * i;
+        list[i].camDistance = c[0];
+        list[i].camTheta = c[1];
+        list[i].camPhi = c[2];
+        list[i].camTarget = glm::vec3(c[3], c[4], c[5]);
+    }
+    render_entity_path(ent, filepath, width, height, list);
+}
+
+LUA_FUNC(void, render_turntable, true,
+    "Shows the entity and renders it from cameras spaced evenly around the z axis. The frames are image files, or a Y4M video",
+    (ent_ref, ent, "The entity to be rendered"),
+    (std::string, filepath, "Path of the frames with a %d for the frame number, like out_%05d.png. A .y4m file, or - for the standard output, writes a Y4M video"),
+    (int, width, "Width of the frames in pixels"),
+    (int, height, "Height of the frames in pixels"),
+    (int, frames, "Number of frames in one turn"),
+    (float, distance, "Distance of the camera from the target"),
+    (float, phi, "Elevation angle of the camera"),
+    (float, tx, "X coordinate of the target"),
+    (float, ty, "Y coordinate of the target"),
+    (float, tz, "Z coordinate of the target"))
+{
+    if (frames <= 0)
+        throw "The number of frames must be positive.";
+    viewer::viewer_data view = viewer::current_view();
+    view.camDistance = distance;
+    view.camPhi = phi;
+    view.camTarget = glm::vec3(tx, ty, tz);
+    std::vector<viewer::viewer_data> list((size_t)frames, view);
+    for (int i = 0; i < frames; i++)
+        list[i].camTheta = glm::radians(360.0f * (float)i / (float)frames);
+    render_entity_path(ent, filepath, width, height, list);
+}
+
+LUA_FUNC(void, record_camera, true, "Starts recording the camera and the level of detail of every frame of the viewer to a file",
+    (std::string, filepath, "Path of the file to be written"))
+{
+    viewer::record_begin(filepath);
+}
+
+LUA_FUNC(void, record_camera_end, false, "Stops recording the camera and closes the file")
+{
+    viewer::record_end();
+}
+
+LUA_FUNC(void, replay_camera, true, "Traces the frames of a recorded camera again, and reports their device time and ray iterations",
+    (std::string, filepath, "Path of the file written by record_camera"),
+    (int, windowed, "1 to trace the frames in the viewer, 0 to trace them off screen"),
+    (std::string, reportpath, "Path of a CSV file that receives the cost of every frame, or an empty string"))
+{
+    if (windowed != 0 && windowed != 1)
+        throw "Argument must be either 0 or 1.";
+    std::vector<viewer::frame_stats> stats = viewer::replay(filepath, windowed == 1);
+    std::vector<double> times(stats.size());
+    double totalTime = 0.0, totalIters = 0.0;
+    for (size_t i = 0; i < stats.size(); i++)
+    {
+        times[i] = stats[i].traceMs;
+        totalTime += stats[i].traceMs;
+        totalIters += (double)stats[i].iterations;
+    }
+    perf::metric_summary summary = perf::summarize("trace", times);
+    std::cout << "Frames: " << stats.size() << "\n"
+        << "Trace time (ms): mean " << totalTime / stats.size() << ", p50 " << summary.p50 << ", p95 "
+        << summary.p95 << ", p99 " << summary.p99 << "\n"
+        << "Iterations per frame: mean " << (uint64_t)(totalIters / stats.size()) << "\n";
+    if (reportpath.empty())
+        return;
+    std::ofstream report(reportpath, std::ios::trunc);
+    if (!report)
+        throw "Cannot open the report file for writing.";
+    report << "frame,trace_ms,iterations\n";
+    for (size_t i = 0; i < stats.size(); i++)
+        report << i << ',' << stats[i].traceMs << ',' << stats[i].iterations << '\n';
+}
+
+LUA_FUNC(void, autotune, false, "Traces the current view with every work-group shape and build option, and keeps the fastest for this device and size of scene")
+{
+    std::vector<viewer::tuning_result> results = viewer::autotune();
+    std::cout << "Shape\tTrace (ms)\tOptions\n";
+    for (const viewer::tuning_result& r : results)
+    {
+        std::cout << r.tileWidth << 'x' << r.tileHeight << '\t' << r.traceMs << '\t'
+            << (r.buildOptions.empty() ? "(none)" : r.buildOptions) << '\n';
+    }
+    const viewer::tuning_result& best = results.front();
+    std::cout << "Using " << best.tileWidth << 'x' << best.tileHeight << " tiles"
+        << (best.buildOptions.empty() ? std::string() : " with " + best.buildOptions) << ", saved in "
+        << tune_cache::directory() << "\n";
 }
 
 LUA_FUNC(void, setbounds, true, "Sets the bounds, or the build volume for the current environment",
@@ -428,6 +893,16 @@ LUA_FUNC(ent_ref, filleted_union, true, "Creates a boolean union of the given en
     return comp_entity::make_csg(first, second, op);
 }
 
+LUA_FUNC(ent_ref, filleted_union_all, true, "Creates a boolean union of all the entities in the given table with the meeting edges filleted",
+    (std::vector<ent_ref>, ents, "Table of entities"),
+    (float, filletRadius, "The fillet radius"))
+{
+    op_defn op;
+    op.type = op_type::OP_UNION;
+    op.data.blend_radius = filletRadius;
+    return comp_entity::make_nary(ents, op);
+}
+
 LUA_FUNC(ent_ref, filleted_intersection, true, "Creates a boolean intersection of the given entities with the meeting edges filleted",
     (ent_ref, first, "The first entity"),
     (ent_ref, second, "The second entity"),
@@ -466,11 +941,46 @@ LUA_FUNC(void, adaptive_rendermode, true, "Sets the level of detail for the adap
     viewer::adaptive_rendermode((uint8_t)lod);
 }
 
+LUA_FUNC(void, stats, false, "Shows the p50, p95 and p99 timings of the device kernels, transfers and host side work")
+{
+    perf::print_stats(std::cout);
+}
+
+LUA_FUNC(void, stats_log, true, "Periodically prints a single line summary of the timings from the render loop",
+    (float, seconds, "The interval between the log lines in seconds. Zero disables the log"))
+{
+    if (seconds < 0.0f)
+        throw "The interval cannot be negative.";
+    perf::set_log_interval(seconds);
+}
+
+LUA_FUNC(void, stats_reset, false, "Discards all the timings recorded so far")
+{
+    perf::reset();
+}
+
+LUA_FUNC(void, trace_begin, true, "Starts writing a Chrome trace (json) of the host and device timelines",
+    (std::string, filepath, "Path of the json file to be written"))
+{
+    if (!tracer::begin(filepath))
+        throw "Cannot open the trace file.";
+}
+
+LUA_FUNC(void, trace_end, false, "Stops the trace started with trace_begin and closes the file")
+{
+    tracer::end();
+}
+
 void implicit_lua::init_functions()
 {
     lua_State* L = state();
     INIT_LUA_FUNC(L, quit);
     INIT_LUA_FUNC(L, show);
+    INIT_LUA_FUNC(L, scene_add);
+    INIT_LUA_FUNC(L, scene_remove);
+    INIT_LUA_FUNC(L, scene_clear);
+    INIT_LUA_FUNC(L, autoshow);
+    INIT_LUA_FUNC(L, batch);
     INIT_LUA_FUNC(L, box);
     INIT_LUA_FUNC(L, sphere);
     INIT_LUA_FUNC(L, cylinder);
@@ -478,12 +988,30 @@ void implicit_lua::init_functions()
     INIT_LUA_FUNC(L, polyface4);
     INIT_LUA_FUNC(L, gyroid);
     INIT_LUA_FUNC(L, schwarz);
+    INIT_LUA_FUNC(L, beam_lattice);
+    INIT_LUA_FUNC(L, convex);
+    INIT_LUA_FUNC(L, polytope);
+    INIT_LUA_FUNC(L, mesh);
+    INIT_LUA_FUNC(L, mesh_grid);
+    INIT_LUA_FUNC(L, voxelgrid);
+    INIT_LUA_FUNC(L, voxelbricks);
+    INIT_LUA_FUNC(L, save_scene);
+    INIT_LUA_FUNC(L, load_scene);
     INIT_LUA_FUNC(L, bunion);
     INIT_LUA_FUNC(L, bintersect);
     INIT_LUA_FUNC(L, bsubtract);
+    INIT_LUA_FUNC(L, union_all);
+    INIT_LUA_FUNC(L, intersect_all);
     INIT_LUA_FUNC(L, offset);
     INIT_LUA_FUNC(L, linblend);
     INIT_LUA_FUNC(L, smoothblend);
+    INIT_LUA_FUNC(L, translate);
+    INIT_LUA_FUNC(L, rotate);
+    INIT_LUA_FUNC(L, scale);
+    INIT_LUA_FUNC(L, transform);
+    INIT_LUA_FUNC(L, pattern_linear);
+    INIT_LUA_FUNC(L, pattern_grid);
+    INIT_LUA_FUNC(L, pattern_polar);
     INIT_LUA_FUNC(L, load);
 
 #ifdef CLDEBUG
@@ -492,11 +1020,24 @@ void implicit_lua::init_functions()
 #endif // CLDEBUG
 
     INIT_LUA_FUNC(L, exportframe);
+    INIT_LUA_FUNC(L, render_image);
+    INIT_LUA_FUNC(L, render_path);
+    INIT_LUA_FUNC(L, render_turntable);
+    INIT_LUA_FUNC(L, record_camera);
+    INIT_LUA_FUNC(L, record_camera_end);
+    INIT_LUA_FUNC(L, replay_camera);
+    INIT_LUA_FUNC(L, autotune);
     INIT_LUA_FUNC(L, setbounds);
     INIT_LUA_FUNC(L, help_all);
     INIT_LUA_FUNC(L, help);
     INIT_LUA_FUNC(L, filleted_union);
+    INIT_LUA_FUNC(L, filleted_union_all);
     INIT_LUA_FUNC(L, filleted_intersection);
     INIT_LUA_FUNC(L, filleted_subtraction);
     INIT_LUA_FUNC(L, adaptive_rendermode);
+    INIT_LUA_FUNC(L, stats);
+    INIT_LUA_FUNC(L, stats_log);
+    INIT_LUA_FUNC(L, stats_reset);
+    INIT_LUA_FUNC(L, trace_begin);
+    INIT_LUA_FUNC(L, trace_end);
 }
@@ -10,6 +10,7 @@
 
 static void cmd_loop()
 {
+    tracer::set_thread_name("command");
     std::string input;
     bool running = true;
     while (running)
@@ -46,6 +47,7 @@ int main(int argc, char** argv)
     viewer::render_loop();
 
     cmdThread.join();
+    tracer::end();
     viewer::stop();
     implicit_lua::stop();
     return 0;
@@ -9,6 +9,12 @@
 #define STEP_FOS 0.9f
 #define EPSILON 0.0001
 #define NUM_ITERS 500
+#define MARCH_STEPS 16 // Iterations of a ray per launch of k_march.
+#define CONE_ITERS 64 // Iterations of a cone in the depth prepass.
+#define REFINE_DEPTH_TOL 0.02f // Relative depth difference of samples that are interpolated.
+#define REFINE_NORMAL_COS 0.95f // Cosine of the angle between normals of samples that are interpolated.
+#define REPROJECT_MARGIN 0.05f // Fraction of the reprojected depth the rays start in front of it.
+#define NO_DEPTH 0xffffffff // Pixels without a reprojected depth.
 #define TOLERANCE 0.00001f
 
 #include "kernel_primitives.clh"
@@ -92,79 +98,277 @@ float bound_distance(__constant float* viewerData, float3* pos, float3* dir,
   return -1.0f;
 }
 
-uint sphere_trace(global uchar* packed,
-                  global uint* offsets,
-                  global uchar* types,
-                  local float* valBuf,
-                  local float* regBuf,
-                  uint nEntities,
-                  global op_step* steps,
-                  uint nSteps,
-                  float3 pt,
-                  float3 dir,
-                  int iters,
-                  float tolerance,
-                  float boundDist
-#ifdef CLDEBUG
-                  , uchar debugFlag
-#endif
-                  )
+/*
+Returns true if the ray starting at pt crosses the box. Boxes that are behind
+the ray, or that it passes by, cannot be hit anymore.
+*/
+bool ray_crosses(global float* bounds, float3* pt, float3 dir)
 {
-  if (nEntities == 0)
-    return BACKGROUND_COLOR;
-  
-  dir = normalize(dir);
-  float3 norm = (float3)(0.0f, 0.0f, 0.0f);
-  bool found = false;
-  float dTotal = 0.0f;
-  float d;
+  float3 lo = (float3)(bounds[0], bounds[1], bounds[2]);
+  float3 hi = (float3)(bounds[3], bounds[4], bounds[5]);
+  float3 inv = 1.0f / dir;
+  float3 t0 = (lo - (*pt)) * inv;
+  float3 t1 = (hi - (*pt)) * inv;
+  float3 tnear = fmin(t0, t1);
+  float3 tfar = fmax(t0, t1);
+  float tmin = fmax(fmax(tnear.x, tnear.y), fmax(tnear.z, 0.0f));
+  float tmax = fmin(fmin(tfar.x, tfar.y), tfar.z);
+  return tmin <= tmax;
+}
+
+float f_object(global uchar* packed,
+               global uint* offsets,
+               global uchar* types,
+               local float* valBuf,
+               local float* regBuf,
+               global op_step* steps,
+               global scene_object* object,
+               float3* pt,
+               read_only image3d_t voxels
+#ifdef CLDEBUG
+               , uchar debugFlag
+#endif
+               )
+{
+  return f_entity(packed, offsets + object->first_entity,
+                  types + object->first_entity, valBuf, regBuf,
+                  object->num_entities, steps + object->first_step,
+                  object->num_steps, pt, voxels
+#ifdef CLDEBUG
+                  , debugFlag
+#endif
+                  );
+}
+
+/*
+The union of all the objects in the scene. The top level bvh is descended like
+a bvh union. With cullByRay, the boxes the ray does not cross are skipped as
+well, and INFINITY is returned if there is nothing left for the ray to hit. The
+index of the object with the smallest value is written to nearest.
+*/
+float f_scene(global uchar* packed,
+              global uint* offsets,
+              global uchar* types,
+              local float* valBuf,
+              local float* regBuf,
+              global op_step* steps,
+              global uchar* scene,
+              float3* pt,
+              float3 dir,
+              bool cullByRay,
+              uint* nearest,
+              read_only image3d_t voxels
+#ifdef CLDEBUG
+              , uchar debugFlag
+#endif
+              )
+{
+  global i_scene* header = (global i_scene*)scene;
+  global bvh_node* nodes = (global bvh_node*)(scene + sizeof(i_scene));
+  global scene_object* objects =
+    (global scene_object*)(nodes + header->num_nodes);
+
+  float result = INFINITY;
+  *nearest = 0;
+  for (uint oi = header->num_bounded; oi < header->num_objects; oi++){
+    float d = f_object(packed, offsets, types, valBuf, regBuf, steps,
+                       objects + oi, pt, voxels
+#ifdef CLDEBUG
+                       , debugFlag
+#endif
+                       );
+    if (d < result){
+      result = d;
+      *nearest = oi;
+    }
+  }
+  if (header->num_nodes == 0)
+    return result;
+
+  uint stack[BVH_STACK_SIZE];
+  uint top = 0;
+  stack[top++] = 0;
+  while (top > 0){
+    global bvh_node* node = nodes + stack[--top];
+    if (box_distance(node->bounds, pt) >= result ||
+        (cullByRay && !ray_crosses(node->bounds, pt, dir)))
+      continue;
+    if (node->count > 0){
+      for (uint i = node->first; i < node->first + node->count; i++){
+        float d = f_object(packed, offsets, types, valBuf, regBuf, steps,
+                           objects + i, pt, voxels
+#ifdef CLDEBUG
+                           , debugFlag
+#endif
+                           );
+        if (d < result){
+          result = d;
+          *nearest = i;
+        }
+      }
+      continue;
+    }
+    // Push the farther child first, so the nearer child is visited next.
+    float dl = box_distance(nodes[node->first].bounds, pt);
+    float dr = box_distance(nodes[node->first + 1].bounds, pt);
+    uint nearChild = dl < dr ? node->first : node->first + 1;
+    uint farChild = dl < dr ? node->first + 1 : node->first;
+    if (top + 2 > BVH_STACK_SIZE){
+      // Out of stack space, fall back to the conservative bound.
+      result = min(result, min(dl, dr));
+      continue;
+    }
+    stack[top++] = farChild;
+    stack[top++] = nearChild;
+  }
+  return result;
+}
+
+#define RAY_LIVE 0
+#define RAY_HIT 1
+#define RAY_MISS 2
+
+/*
+Marches the ray for at most the given number of iterations, and returns whether
+it is still live, hit the surface or missed everything. The index of the object
+nearest to the ray is written to object.
+*/
+int march_ray(global uchar* packed,
+              global uint* offsets,
+              global uchar* types,
+              local float* valBuf,
+              local float* regBuf,
+              global op_step* steps,
+              global uchar* scene,
+              ray_state* ray,
+              int iters,
+              float tolerance,
+              uint* object,
+              read_only image3d_t voxels
+#ifdef CLDEBUG
+              , uchar debugFlag
+#endif
+              )
+{
+  float3 pt = vload3(0, ray->pos);
+  float3 dir = vload3(0, ray->dir);
+  int result = RAY_LIVE;
   for (int i = 0; i < iters; i++){
-    d = f_entity(packed, offsets, types, valBuf, regBuf,
-                       nEntities, steps, nSteps, &pt
+    if (ray->iters >= NUM_ITERS){
+      result = RAY_MISS;
+      break;
+    }
+    float d = f_scene(packed, offsets, types, valBuf, regBuf, steps, scene,
+                      &pt, dir, true, object, voxels
 #ifdef CLDEBUG
-                 , debugFlag
+                      , debugFlag
 #endif
-                 );
+                      );
+    ray->value = d;
+    ray->iters++;
 
-    if (d < 0.0f && dTotal == 0.0f) break; // Too close to camera.
-    if (d < tolerance && (-tolerance) < d){
-      GRADIENT(f_entity(packed, offsets, types, valBuf, regBuf,
-                        nEntities, steps, nSteps, &pt
+    if (ray->restart >= 0.0f){
+      // The ray started at a reprojected depth, and is only valid if the start
+      // is outside. Otherwise it marches again from where it would have started.
+      if (d < 0.0f){
 #ifdef CLDEBUG
-                        , debugFlag
+        if (debugFlag)
+          printf("Reprojected start is inside, restarting at %.3f\n",
+                 ray->restart);
 #endif
-                        ),
-               pt, d, norm);
-      norm = normalize(norm);
-      found = true;
+        pt -= dir * (ray->dist - ray->restart);
+        ray->dist = ray->restart;
+        ray->restart = -1.0f;
+        continue;
+      }
+      ray->restart = -1.0f;
+    }
+
+    if (d == INFINITY){ // The ray does not cross any more objects.
+      result = RAY_MISS;
+      break;
+    }
+    if (d < 0.0f && ray->dist == 0.0f){ // Too close to camera.
+      result = RAY_MISS;
+      break;
+    }
+    if (d < tolerance && (-tolerance) < d){
+      result = RAY_HIT;
       break;
     }
 
     pt += dir * (d * STEP_FOS);
-    dTotal += d * STEP_FOS;
-    if (i > 3 && dTotal > boundDist) break;
+    ray->dist += d * STEP_FOS;
+    if (ray->iters > 4 && ray->dist > ray->bound_dist){
+      result = RAY_MISS;
+      break;
+    }
   }
-  
-  if (!found){
+  vstore3(pt, 0, ray->pos);
 #ifdef CLDEBUG
-    if (debugFlag)
-      printf("Can't find intersection. Rendering background color\n");
+  if (debugFlag && result == RAY_MISS)
+    printf("Can't find intersection. Rendering background color\n");
 #endif
-    return BACKGROUND_COLOR;
-  }
+  return result;
+}
+
+/*
+The color of a hit, from the gradient of the field and the ambient term. The
+gradient only needs the object that was hit, while the ambient term looks at
+the whole scene. The normal is the normalized gradient.
+*/
+uint shade_hit(global uchar* packed,
+               global uint* offsets,
+               global uchar* types,
+               local float* valBuf,
+               local float* regBuf,
+               global op_step* steps,
+               global uchar* scene,
+               uint object,
+               float3 pt,
+               float3 dir,
+               float3* normal,
+               read_only image3d_t voxels
+#ifdef CLDEBUG
+               , uchar debugFlag
+#endif
+               )
+{
+  global i_scene* header = (global i_scene*)scene;
+  global scene_object* hitObject =
+    (global scene_object*)(scene + sizeof(i_scene) +
+                           sizeof(bvh_node) * header->num_nodes) + object;
+  float d = f_object(packed, offsets, types, valBuf, regBuf, steps, hitObject,
+                     &pt, voxels
+#ifdef CLDEBUG
+                     , debugFlag
+#endif
+                     );
+  float3 norm = (float3)(0.0f, 0.0f, 0.0f);
+  GRADIENT(f_object(packed, offsets, types, valBuf, regBuf, steps, hitObject,
+                    &pt, voxels
+#ifdef CLDEBUG
+                    , debugFlag
+#endif
+                    ),
+           pt, d, norm);
+  norm = normalize(norm);
+  *normal = norm;
 
   pt -= dir * AMB_STEP;
   float old = d;
-  d = f_entity(packed, offsets, types, valBuf, regBuf,
-               nEntities, steps, nSteps, &pt
+  uint nearest;
+  d = f_scene(packed, offsets, types, valBuf, regBuf, steps, scene,
+              &pt, dir, true, &nearest, voxels
 #ifdef CLDEBUG
-               , debugFlag
+              , debugFlag
 #endif
-               );
+              );
   float amb = (d - old) / AMB_STEP;
   float c = 0.2f + dot(norm, -dir) * (0.6f * amb + 0.3f);
 #ifdef CLDEBUG
   if (debugFlag){
+    printf("Object: %u\n", object);
     printf("Gradient: (%.2f, %.2f, %.2f)\n", norm.x, norm.y, norm.z);
     printf("RayDir:   (%.2f, %.2f, %.2f)\n", -dir.x, -dir.y, -dir.z);
     printf("Dot: %.2f\n", dot(norm, -dir));
@@ -174,17 +378,17 @@ uint sphere_trace(global uchar* packed,
   return colorToInt(c);
 }
 
-void perspective_project(__constant float* viewerData,
-                         uint2 coord,
-                         uint2 dims,
-                         float3* pos,
-                         float3* dir,
-                         float* boundDist,
-                         uint* color
-#ifdef CLDEBUG
-                         , uchar debugFlag
-#endif
-                         )
+/*
+The ray of a point on the screen. All the rays start on the screen, and point
+away from the center, which is the apex of every ray. The coordinates are
+relative to the viewport, which is the part of the image being traced, given by
+its offset and the size of the whole image.
+*/
+void camera_ray(__constant float* viewerData,
+                float2 coord,
+                float3* center,
+                float3* pos,
+                float3* dir)
 {
   float3 camPos = vload3(0, viewerData);
   float3 camTarget = vload3(1, viewerData);
@@ -196,16 +400,71 @@ void perspective_project(__constant float* viewerData,
   *pos = camTarget - (*dir);
   *dir = normalize(*dir);
 
-  float3 center = (*pos) - ((*dir) * 2.0f);
+  *center = (*pos) - ((*dir) * 2.0f);
   
   float3 x = normalize(cross(*dir, (float3)(0, 0, 1)));
   float3 y = normalize(cross(x, *dir));
+  float4 viewport = vload4(3, viewerData);
+  float2 halfSize = viewport.zw / 2.0f;
+  coord += viewport.xy;
   *pos += 1.5f *
-    (x * (((float)coord.x - (float)dims.x / 2.0f) / ((float)dims.x / 2.0f)) +
-     y * (((float)coord.y - (float)dims.y / 2.0f) / ((float)dims.x / 2.0f)));
+    (x * ((coord.x - halfSize.x) / halfSize.x) +
+     y * ((coord.y - halfSize.y) / halfSize.x));
 
-  *dir = normalize((*pos) - center);
-  
+  *dir = normalize((*pos) - (*center));
+}
+
+/*
+The inverse of camera_ray. Finds the screen coordinates of the pixel whose ray
+goes through the point, and the distance of the point from the screen along
+that ray. Returns false if the point is not in front of the screen.
+*/
+bool project_point(__constant float* viewerData,
+                   float3 pt,
+                   float2* coord,
+                   float* depth)
+{
+  float3 camPos = vload3(0, viewerData);
+  float3 camTarget = vload3(1, viewerData);
+  float st, ct, sp, cp;
+  st = sincos(camPos.y, &ct);
+  sp = sincos(camPos.z, &cp);
+
+  float3 dir = -(float3)(camPos.x * cp * ct, camPos.x * cp * st, camPos.x * sp);
+  float3 pos = camTarget - dir;
+  dir = normalize(dir);
+  float3 center = pos - dir * 2.0f;
+  float3 x = normalize(cross(dir, (float3)(0, 0, 1)));
+  float3 y = normalize(cross(x, dir));
+
+  float3 rel = pt - center;
+  float along = dot(rel, dir);
+  if (along <= 2.0f)
+    return false;
+  float3 screen = center + rel * (2.0f / along);
+  float4 viewport = vload4(3, viewerData);
+  float2 halfSize = viewport.zw / 2.0f;
+  *coord = (float2)(dot(screen - pos, x) / 1.5f * halfSize.x + halfSize.x,
+                    dot(screen - pos, y) / 1.5f * halfSize.x + halfSize.y) -
+    viewport.xy;
+  *depth = length(pt - screen);
+  return true;
+}
+
+void perspective_project(__constant float* viewerData,
+                         uint2 coord,
+                         float3* center,
+                         float3* pos,
+                         float3* dir,
+                         float* boundDist,
+                         uint* color
+#ifdef CLDEBUG
+                         , uchar debugFlag
+#endif
+                         )
+{
+  camera_ray(viewerData, (float2)((float)coord.x, (float)coord.y), center, pos,
+             dir);
   *boundDist = bound_distance(viewerData, pos, dir, color
 #ifdef CLDEBUG
                               , debugFlag
@@ -213,74 +472,493 @@ void perspective_project(__constant float* viewerData,
                               );
 }
 
-kernel void k_trace(global uint* pBuffer, // The pixel buffer
+/*
+Marches a cone from the center of the camera that encloses the rays of all the
+pixels in a block of blockSize x blockSize pixels. The distance from the apex
+up to which the whole cone is empty is written to blockDepths, and the rays of
+the block start at that depth instead of at the screen.
+*/
+kernel void k_cone_prepass(global uchar* packed,
+                           global uchar* types,
+                           global uint* offsets,
+                           local float* valBuf,
+                           local float* regBuf,
+                           global op_step* steps,
+                           global uchar* scene,
+                           read_only image3d_t voxels,
+                           __constant float* viewerData,
+                           uint2 dims, // Size of the traced pixels, a tile or the whole image.
+                           uint blockSize,
+                           global float* blockDepths)
+{
+  uint2 nBlocks = (dims + (blockSize - 1)) / blockSize;
+  // The launch is rounded up to a multiple of the work-group size.
+  uint bi = get_global_id(0);
+  if (bi >= nBlocks.x * nBlocks.y)
+    return;
+  uint2 first = (uint2)(bi % nBlocks.x, bi / nBlocks.x) * blockSize;
+  uint2 last = min(first + (blockSize - 1), dims - 1);
+#ifdef CLDEBUG
+  uchar debugFlag = 0;
+#endif
+
+  // The axis goes through the middle of the block, and the cone is as wide as
+  // the rays of the corner pixels.
+  float3 center, pos, axis, dir;
+  camera_ray(viewerData,
+             (float2)(0.5f * (float)(first.x + last.x),
+                      0.5f * (float)(first.y + last.y)),
+             &center, &pos, &axis);
+  float cosAngle = 1.0f;
+  for (uint c = 0; c < 4; c++){
+    float2 coord = (float2)((float)((c & 1) ? last.x : first.x),
+                            (float)((c & 2) ? last.y : first.y));
+    camera_ray(viewerData, coord, &center, &pos, &dir);
+    cosAngle = min(cosAngle, dot(axis, dir));
+  }
+  // The slope of the cone, slightly widened for rounding errors.
+  float slope = sqrt(max(1.0f - cosAngle * cosAngle, 0.0f)) / cosAngle + 1e-4f;
+
+  // Nothing beyond the farthest corner of the bounds is traced.
+  float3 bmin = vload3(2, viewerData);
+  float3 bmax = vload3(3, viewerData);
+  float maxDist = 0.0f;
+  for (uint c = 0; c < 8; c++){
+    float3 corner = (float3)((c & 1) ? bmax.x : bmin.x,
+                             (c & 2) ? bmax.y : bmin.y,
+                             (c & 4) ? bmax.z : bmin.z);
+    maxDist = max(maxDist, length(corner - center));
+  }
+
+  // The ball of radius d around the point on the axis at t contains the cone
+  // between t and t + (d - slope * t) / (1 + slope), so the cone is empty up to
+  // the depth where the ball no longer covers its cross section.
+  float t = 0.0f;
+  for (int i = 0; i < CONE_ITERS && t < maxDist; i++){
+    float3 pt = center + axis * t;
+    uint nearest;
+    float d = f_scene(packed, offsets, types, valBuf, regBuf, steps, scene,
+                      &pt, axis, false, &nearest, voxels
+#ifdef CLDEBUG
+                      , debugFlag
+#endif
+                      );
+    float r = slope * t;
+    if (d <= r)
+      break;
+    t += STEP_FOS * (d - r) / (1.0f + slope);
+  }
+  blockDepths[bi] = min(t, maxDist);
+}
+
+/*
+Moves the hits of the previous frame into the current view. Every pixel that
+hit something in the previous frame is projected with the current camera, and
+the nearest depth that lands on a pixel is kept. The depths are written as the
+bits of the floats, and the pixels nothing lands on keep NO_DEPTH.
+*/
+kernel void k_reproject(global float4* samples, // Of the previous frame.
+                        __constant float* prevViewerData,
+                        __constant float* viewerData,
+                        uint2 dims, // Size of the traced pixels, a tile or the whole image.
+                        global uint* reprojected)
+{
+  uint2 coord = (uint2)(get_global_id(0), get_global_id(1));
+  // The launch is rounded up to whole tiles.
+  if (coord.x >= dims.x || coord.y >= dims.y)
+    return;
+  float depth = samples[coord.x + coord.y * dims.x].x;
+  if (depth < 0.0f)
+    return;
+  float3 center, pos, dir;
+  camera_ray(prevViewerData, (float2)((float)coord.x, (float)coord.y), &center,
+             &pos, &dir);
+  float2 target;
+  float newDepth;
+  if (!project_point(viewerData, pos + dir * depth, &target, &newDepth))
+    return;
+  int2 pixel = convert_int2(floor(target + 0.5f));
+  if (pixel.x < 0 || pixel.y < 0 || pixel.x >= (int)dims.x ||
+      pixel.y >= (int)dims.y)
+    return;
+  atomic_min(reprojected + pixel.x + pixel.y * dims.x, as_uint(newDepth));
+}
+
+/*
+Queues the ray of the pixel, or writes the color of the pixel if the ray cannot
+hit anything. The rays start at the depth found by the cone of their block, or
+a little in front of the surface reprojected from the previous frame. The
+reprojection is only trusted if every pixel around this one has a depth, so the
+edges where hidden surfaces can come into view are marched in full.
+*/
+void queue_ray(global uint* pBuffer,
+               global float4* samples,
+               global uchar* scene,
+               __constant float* viewerData,
+               uint2 coord,
+               uint2 dims,
+               global float* blockDepths,
+               uint blockSize,
+               global uint* reprojected,
+               global ray_state* rays,
+               global uint* counters
+#ifdef CLDEBUG
+               , uchar debugFlag
+#endif
+               )
+{
+  uint i = coord.x + coord.y * dims.x;
+  float3 center, pos, dir;
+  float boundDist;
+  uint color;
+  perspective_project(viewerData, coord, &center, &pos, &dir, &boundDist,
+                      &color
+#ifdef CLDEBUG
+                      , debugFlag
+#endif
+                      );
+  samples[i] = (float4)(-1.0f, 0.0f, 0.0f, 0.0f);
+  if (boundDist <= 0.0f || ((global i_scene*)scene)->num_objects == 0){
+    pBuffer[i] = BACKGROUND_COLOR;
+    return;
+  }
+  // Skip the empty space found by the cone of the block.
+  uint blocksPerRow = (dims.x + blockSize - 1) / blockSize;
+  float depth = blockDepths[(coord.y / blockSize) * blocksPerRow +
+                           coord.x / blockSize];
+  float skip = max(depth - length(pos - center), 0.0f);
+  if (skip >= boundDist){
+    pBuffer[i] = color;
+    return;
+  }
+  // The depths are positive, so their bits are ordered like the floats.
+  uint nearest = NO_DEPTH;
+  bool covered = true;
+  for (int dy = -1; dy <= 1; dy++){
+    for (int dx = -1; dx <= 1; dx++){
+      int2 nc = (int2)((int)coord.x + dx, (int)coord.y + dy);
+      if (nc.x < 0 || nc.y < 0 || nc.x >= (int)dims.x || nc.y >= (int)dims.y)
+        continue;
+      uint d = reprojected[nc.x + nc.y * dims.x];
+      covered = covered && d != NO_DEPTH;
+      nearest = min(nearest, d);
+    }
+  }
+  float start = skip;
+  if (covered)
+    start = max(skip, as_float(nearest) * (1.0f - REPROJECT_MARGIN));
+#ifdef CLDEBUG
+  if (debugFlag)
+    printf("Cone skip: %.3f, reprojected start: %.3f\n", skip, start);
+#endif
+  ray_state ray;
+  vstore3(pos + dir * start, 0, ray.pos);
+  vstore3(dir, 0, ray.dir);
+  ray.dist = start;
+  ray.bound_dist = boundDist;
+  ray.restart = start > skip ? skip : -1.0f;
+  ray.value = 0.0f;
+  ray.pixel = i;
+  ray.bound_color = color;
+  ray.iters = 0;
+  rays[atomic_inc(counters)] = ray;
+}
+
+/*
+The cell of the work-item in the 2-D stages. The work-groups are tiles of cells
+with power of two sides, and the work-items of a tile go through it in Morton
+order. The work-items that run together, and queue their rays next to each
+other, are then close on screen in both directions instead of along a row.
+*/
+uint2 tile_cell()
+{
+  uint w = get_local_size(0), h = get_local_size(1);
+  uint index = get_local_id(0) + get_local_id(1) * w;
+  uint2 cell = (uint2)(0, 0);
+  uint bit = 0;
+  for (uint xb = 0, yb = 0; (1u << xb) < w || (1u << yb) < h;){
+    if ((1u << xb) < w)
+      cell.x |= ((index >> bit++) & 1u) << xb++;
+    if ((1u << yb) < h)
+      cell.y |= ((index >> bit++) & 1u) << yb++;
+  }
+  return (uint2)(get_group_id(0) * w, get_group_id(1) * h) + cell;
+}
+
+/*
+The stages of the wavefront tracer. k_generate queues the rays of the coarse
+grid of pixels, one every step pixels plus the last row and column. k_march
+advances the queued rays by MARCH_STEPS iterations, and queues the survivors
+again so the next launch only has live rays. The hits go into the G-buffer and
+their pixels are queued for k_shade, which shades them in one coherent pass.
+The ray queues hold ray_state values, and counters[0] and counters[1] count the
+live rays and the hits pushed by a launch. Every traced pixel also gets a
+sample of the hit depth and normal, which k_refine uses to fill in the pixels
+between the coarse grid. The depth is negative for misses.
+*/
+kernel void k_generate(global uint* pBuffer, // The pixel buffer
+                       global float4* samples, // Hit depth and normal of the pixels.
+                       global uchar* scene, // Top level bvh and object table.
+                       __constant float* viewerData,
+                       uint2 dims, // Size of the traced pixels, a tile or the whole image.
+                       uint step, // Pixels between the rays of the coarse grid.
+                       global float* blockDepths, // Written by k_cone_prepass.
+                       uint blockSize,
+                       global uint* reprojected, // Written by k_reproject.
+                       global ray_state* rays, // Queue of the generated rays.
+                       global uint* counters
+#ifdef CLDEBUG
+                       , uint mousePixel // Index of the pixel under the mouse.
+#endif
+                       )
+{
+  // The coarse grid, rounded up to whole tiles.
+  uint2 cell = tile_cell();
+  uint2 nCells = (dims + step - 2) / step + 1;
+  if (cell.x >= nCells.x || cell.y >= nCells.y)
+    return;
+  uint2 coord = min(cell * step, dims - 1);
+#ifdef CLDEBUG
+  uchar debugFlag = (uchar)(coord.x + coord.y * dims.x == mousePixel);
+  if (debugFlag){
+    printf("\n");
+    printf("Pixel stride is %u\n", step);
+    printf("Screen coords: (%02d, %02d)\n", coord.x, coord.y);
+  }
+#endif
+  queue_ray(pBuffer, samples, scene, viewerData, coord, dims, blockDepths,
+            blockSize, reprojected, rays, counters
+#ifdef CLDEBUG
+            , debugFlag
+#endif
+            );
+}
+
+kernel void k_march(global uint* pBuffer, // The pixel buffer
                     global uchar* packed, // Bytes of render data for simple bytes.
                     global uchar* types, // Types of simple entities in the csg tree.
-                    global uchar* offsets, // The byte offsets of simple entities.
+                    global uint* offsets, // The byte offsets of simple entities.
                     local float* valBuf, // The buffer for local use.
                     local float* regBuf, // More buffer for local use.
-                    uint nEntities, // The number of simple entities.
-                    global op_step* steps, // CSG steps.
-                    uint nSteps, // Number of csg steps.
-                    __constant float* viewerData,
-                    uchar levelOfDetail
+                    global op_step* steps, // CSG steps of all the objects.
+                    global uchar* scene, // Top level bvh and object table.
+                    read_only image3d_t voxels, // Atlas of the voxel grids.
+                    global ray_state* raysIn, // The live rays.
+                    uint nRays, // Number of live rays.
+                    global ray_state* raysOut, // Receives the rays still live after this launch.
+                    global gbuffer_texel* gbuffer, // Receives the depth and object of the hits.
+                    global uint* hits, // Receives the pixels that hit.
+                    global uint* counters,
+                    global uint* iters // Receives the iterations of the finished rays, per pixel.
 #ifdef CLDEBUG
-                    , uint2 mousePos // Mouse position in pixels.
+                    , uint mousePixel // Index of the pixel under the mouse.
 #endif
                     )
 {
-  uint2 dims = (uint2)(get_global_size(0), get_global_size(1));
-  uint2 coord = (uint2)(get_global_id(0), get_global_id(1));
-  uint step = 1 << levelOfDetail;
+  // The launch is rounded up to a multiple of the work-group size.
+  uint ri = get_global_id(0);
+  if (ri >= nRays)
+    return;
+  ray_state ray = raysIn[ri];
 #ifdef CLDEBUG
-  uchar debugFlag = (uchar)(coord.x == mousePos.x && coord.y == mousePos.y);
-  if (debugFlag){
-    printf("\n");
-    printf("Pixel stride is %u\n", step);
+  uchar debugFlag = (uchar)(ray.pixel == mousePixel);
+#endif
+  uint object;
+  int status = march_ray(packed, offsets, types, valBuf, regBuf, steps, scene,
+                         &ray, MARCH_STEPS, TOLERANCE, &object, voxels
+#ifdef CLDEBUG
+                         , debugFlag
+#endif
+                         );
+  if (status == RAY_LIVE){
+    raysOut[atomic_inc(counters)] = ray;
+    return;
   }
+  iters[ray.pixel] = ray.iters;
+  if (status == RAY_HIT){
+    gbuffer_texel texel = {ray.dist, object};
+    gbuffer[ray.pixel] = texel;
+    hits[atomic_inc(counters + 1)] = ray.pixel;
+  }
+  else
+    pBuffer[ray.pixel] = ray.bound_color;
+}
+
+kernel void k_shade(global uint* pBuffer, // The pixel buffer
+                    global float4* samples, // Hit depth and normal of the pixels.
+                    global uchar* packed, // Bytes of render data for simple bytes.
+                    global uchar* types, // Types of simple entities in the csg tree.
+                    global uint* offsets, // The byte offsets of simple entities.
+                    local float* valBuf, // The buffer for local use.
+                    local float* regBuf, // More buffer for local use.
+                    global op_step* steps, // CSG steps of all the objects.
+                    global uchar* scene, // Top level bvh and object table.
+                    read_only image3d_t voxels, // Atlas of the voxel grids.
+                    __constant float* viewerData,
+                    uint2 dims, // Size of the traced pixels, a tile or the whole image.
+                    global gbuffer_texel* gbuffer, // Written by k_march.
+                    global uint* hits, // The pixels that hit.
+                    uint nHits // Number of hits.
+#ifdef CLDEBUG
+                    , uint mousePixel // Index of the pixel under the mouse.
 #endif
-  uint i = coord.x + (coord.y * get_global_size(0));
-  if (coord.x % step == 0 && coord.y % step == 0){
-    float3 pos, dir;
-    float boundDist;
-    uint color;
-    perspective_project(viewerData, coord, dims, &pos, &dir, &boundDist, &color
+                    )
+{
+  uint hi = get_global_id(0);
+  if (hi >= nHits)
+    return;
+  uint pixel = hits[hi];
 #ifdef CLDEBUG
-                        , debugFlag
+  uchar debugFlag = (uchar)(pixel == mousePixel);
 #endif
-                        );
-    if (boundDist > 0.0f){
-      pBuffer[i] = sphere_trace(packed, offsets, types, valBuf, regBuf,
-                                nEntities, steps, nSteps, pos, dir,
-                                NUM_ITERS, TOLERANCE, boundDist
+  gbuffer_texel texel = gbuffer[pixel];
+  float3 center, pos, dir;
+  camera_ray(viewerData,
+             (float2)((float)(pixel % dims.x), (float)(pixel / dims.x)), &center,
+             &pos, &dir);
+  float3 normal;
+  pBuffer[pixel] = shade_hit(packed, offsets, types, valBuf, regBuf, steps,
+                             scene, texel.object, pos + dir * texel.dist, dir,
+                             &normal, voxels
 #ifdef CLDEBUG
-                                , debugFlag
+                             , debugFlag
 #endif
-                                );
-      if (pBuffer[i] == BACKGROUND_COLOR) pBuffer[i] = color;
-    }
-    else{
-      pBuffer[i] = BACKGROUND_COLOR;
-    }
+                             );
+  samples[pixel] = (float4)(texel.dist, normal.x, normal.y, normal.z);
+#ifdef CLDEBUG
+  if (debugFlag)
+    printf("Color: %08x\n", pBuffer[pixel]);
+#endif
+}
+
+/*
+Blends the colors channel by channel.
+*/
+uint blend_colors(uint c00, uint c10, uint c01, uint c11, float u, float v)
+{
+  uint result = 0;
+  for (uint shift = 0; shift < 32; shift += 8){
+    float a = (float)((c00 >> shift) & 0xff) * (1.0f - u) +
+      (float)((c10 >> shift) & 0xff) * u;
+    float b = (float)((c01 >> shift) & 0xff) * (1.0f - u) +
+      (float)((c11 >> shift) & 0xff) * u;
+    result |= ((uint)(a * (1.0f - v) + b * v + 0.5f) & 0xff) << shift;
   }
+  return result;
+}
+
+/*
+Refines the pixels between the samples of the previous level. Every work-item
+owns a block of 2 * halfStep pixels, whose corners are samples, and fills in
+the midpoints of its top and left edges and its middle, plus the midpoints of
+its bottom and right edges at the last row and column. If the corners all miss
+with the same color, or all hit at similar depths with similar normals, the
+new pixels are interpolated from the corners. Otherwise they are traced.
+*/
+kernel void k_refine(global uint* pBuffer, // The pixel buffer
+                     global float4* samples, // Hit depth and normal of the pixels.
+                     global uchar* scene, // Top level bvh and object table.
+                     __constant float* viewerData,
+                     uint2 dims, // Size of the traced pixels, a tile or the whole image.
+                     uint halfStep, // Half the size of the blocks.
+                     global float* blockDepths, // Written by k_cone_prepass.
+                     uint blockSize,
+                     global uint* reprojected, // Written by k_reproject.
+                     global ray_state* rays, // Queue of the rays to be traced.
+                     global uint* counters
 #ifdef CLDEBUG
-  if (debugFlag){
-    printf("Screen coords: (%02d, %02d)\n", mousePos.x, mousePos.y);
-    printf("Color: %08x\n", pBuffer[i]);
+                     , uint mousePixel // Index of the pixel under the mouse.
+#endif
+                     )
+{
+  uint s = halfStep;
+  uint2 lo = tile_cell() * (2 * s);
+  if (lo.x >= dims.x - 1 || lo.y >= dims.y - 1)
+    return;
+  uint2 hi = min(lo + 2 * s, dims - 1);
+  uint corners[4] = {lo.x + lo.y * dims.x, hi.x + lo.y * dims.x,
+                     lo.x + hi.y * dims.x, hi.x + hi.y * dims.x};
+
+  float4 first = samples[corners[0]];
+  uint color = pBuffer[corners[0]];
+  float dmin = first.x, dmax = first.x, cosAngle = 1.0f;
+  bool smooth = true;
+  for (uint c = 1; c < 4; c++){
+    float4 other = samples[corners[c]];
+    if (first.x < 0.0f){
+      smooth = smooth && other.x < 0.0f && pBuffer[corners[c]] == color;
+      continue;
+    }
+    smooth = smooth && other.x >= 0.0f;
+    dmin = min(dmin, other.x);
+    dmax = max(dmax, other.x);
+    cosAngle = min(cosAngle, first.y * other.y + first.z * other.z +
+                   first.w * other.w);
   }
+  smooth = smooth &&
+    (first.x < 0.0f ||
+     (dmax - dmin <= REFINE_DEPTH_TOL * max(dmin, 1.0f) &&
+      cosAngle >= REFINE_NORMAL_COS));
+
+  uint2 pts[5];
+  uint n = 0;
+  bool midX = lo.x + s < hi.x, midY = lo.y + s < hi.y;
+  if (midX) pts[n++] = (uint2)(lo.x + s, lo.y);
+  if (midY) pts[n++] = (uint2)(lo.x, lo.y + s);
+  if (midX && midY) pts[n++] = (uint2)(lo.x + s, lo.y + s);
+  if (midX && hi.y == dims.y - 1) pts[n++] = (uint2)(lo.x + s, hi.y);
+  if (midY && hi.x == dims.x - 1) pts[n++] = (uint2)(hi.x, lo.y + s);
+
+  for (uint k = 0; k < n; k++){
+    uint i = pts[k].x + pts[k].y * dims.x;
+#ifdef CLDEBUG
+    uchar debugFlag = (uchar)(i == mousePixel);
+    if (debugFlag)
+      printf("Refining with half step %u, smooth: %d\n", s, (int)smooth);
+#endif
+    if (!smooth){
+      queue_ray(pBuffer, samples, scene, viewerData, pts[k], dims,
+                blockDepths, blockSize, reprojected, rays, counters
+#ifdef CLDEBUG
+                , debugFlag
 #endif
+                );
+      continue;
+    }
+    float u = (float)(pts[k].x - lo.x) / (float)(hi.x - lo.x);
+    float v = (float)(pts[k].y - lo.y) / (float)(hi.y - lo.y);
+    float4 s00 = samples[corners[0]], s10 = samples[corners[1]];
+    float4 s01 = samples[corners[2]], s11 = samples[corners[3]];
+    samples[i] = (s00 * (1.0f - u) + s10 * u) * (1.0f - v) +
+      (s01 * (1.0f - u) + s11 * u) * v;
+    pBuffer[i] = blend_colors(pBuffer[corners[0]], pBuffer[corners[1]],
+                              pBuffer[corners[2]], pBuffer[corners[3]], u, v);
+  }
 }
 
-kernel void k_repeatPixels(global uint* pBuffer,
-                           uchar levelOfDetail)
+kernel void k_eval(global uchar* packed, // Bytes of render data for simple bytes.
+                   global uchar* types, // Types of simple entities in the csg tree.
+                   global uint* offsets, // The byte offsets of simple entities.
+                   local float* valBuf, // The buffer for local use.
+                   local float* regBuf, // More buffer for local use.
+                   global op_step* steps, // CSG steps of all the objects.
+                   global uchar* scene, // Top level bvh and object table.
+                   read_only image3d_t voxels, // Atlas of the voxel grids.
+                   global float* points, // Three floats per point.
+                   uint nPoints,
+                   global float* values // Receives the value of the scene at every point.
+                   )
 {
-  uint2 dims = (uint2)(get_global_size(0), get_global_size(1));
-  uint2 coord = (uint2)(get_global_id(0), get_global_id(1));
-  uint step = 1 << levelOfDetail;
-  uint i = coord.x + (coord.y * get_global_size(0));
-  if (coord.x % step != 0 || coord.y % step != 0){
-    coord.x -= (coord.x % step);
-    coord.y -= (coord.y % step);
-    pBuffer[i] = pBuffer[coord.x + (coord.y * get_global_size(0))];
-  }
+  // The launch is rounded up to a multiple of the work-group size.
+  uint i = get_global_id(0);
+  if (i >= nPoints)
+    return;
+  float3 pt = vload3(i, points);
+  uint nearest;
+  values[i] = f_scene(packed, offsets, types, valBuf, regBuf, steps, scene,
+                      &pt, (float3)(0.0f, 0.0f, 0.0f), false, &nearest, voxels
+#ifdef CLDEBUG
+                      , 0
+#endif
+                      );
 }
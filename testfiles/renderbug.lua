@@ -1,4 +1,5 @@
 b1 = box(0, 0, 1, 3, 3, 4)
 b2 = box(-1.5, -1.5, 1, 1.5, 1.5, 4)
 b = smoothblend(b1, b2, 0, 0, 0, 0, 0, 3)
-viewer_debugmode(1)
+-- Only bound in builds with CLDEBUG.
+if viewer_debugmode then viewer_debugmode(1) end